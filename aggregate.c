@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "aggregate.h"
+
+
+static void clear_bucket(aggregate_t *a) {
+    memset(a->edges, 0, sizeof(a->edges));
+    memset(a->high, 0, sizeof(a->high));
+    memset(a->min_pulse, 0, sizeof(a->min_pulse));
+    memset(a->max_pulse, 0, sizeof(a->max_pulse));
+}
+
+
+void aggregate_reset(aggregate_t *a, uint64_t width, uint64_t channels) {
+    a->width = width;
+    a->channels = channels;
+    a->started = false;
+    a->bucket = 0;
+    a->level = 0;
+    for (int b = 0; b < 64; b++) {
+        a->since[b] = UINT64_MAX;
+    }
+    clear_bucket(a);
+    a->out_len = 0;
+}
+
+
+void aggregate_free(aggregate_t *a) {
+    free(a->out);
+    a->out = NULL;
+    a->out_len = a->out_cap = 0;
+}
+
+
+void aggregate_start(aggregate_t *a, uint64_t end, uint64_t value) {
+    a->started = true;
+    a->bucket = (end + a->width - 1) / a->width * a->width;
+    a->level = value & a->channels;
+}
+
+
+static proto_bucket_t *reserve_record(aggregate_t *a) {
+    if (a->out_len == a->out_cap) {
+        size_t cap = a->out_cap ? 2 * a->out_cap : 64;
+        proto_bucket_t *out = realloc(a->out, cap * sizeof(out[0]));
+        if (out == NULL) {
+            perror("Failed to grow bucket records");
+            exit(1);
+        }
+        a->out = out;
+        a->out_cap = cap;
+    }
+    return &a->out[a->out_len++];
+}
+
+
+/* Time a channel spent at its current level since `from`, within the
+ * current bucket. */
+static uint64_t level_time(const aggregate_t *a, int b, uint64_t to) {
+    uint64_t from = a->since[b];
+    if (from == UINT64_MAX || from < a->bucket) {
+        from = a->bucket;
+    }
+    return to - from;
+}
+
+
+/* Closes the bucket as `width` samples wide. */
+static void close_bucket(aggregate_t *a, uint64_t width) {
+    uint64_t end = a->bucket + width;
+    for (uint64_t channels = a->channels; channels; channels &= channels - 1) {
+        int b = __builtin_ctzll(channels);
+        bool high = (a->level >> b) & 1;
+        proto_bucket_t *r = reserve_record(a);
+        memset(r, 0, sizeof(*r));
+        r->idx = a->bucket;
+        r->width = width;
+        r->channel = b;
+        r->last = high;
+        r->edges = a->edges[b];
+        r->high = a->high[b] + (high ? level_time(a, b, end) : 0);
+        r->min_pulse = a->min_pulse[b];
+        r->max_pulse = a->max_pulse[b];
+    }
+    clear_bucket(a);
+    a->bucket = end;
+}
+
+
+void aggregate_close(aggregate_t *a, uint64_t end) {
+    if (!a->started || a->bucket + a->width > end) {
+        return;
+    }
+    close_bucket(a, a->width);
+    /* No edge came after that bucket: one record covers the span. */
+    uint64_t idle = (end - a->bucket) / a->width * a->width;
+    if (idle != 0) {
+        close_bucket(a, idle);
+    }
+}
+
+
+void aggregate_push(aggregate_t *a, const capture_edge_t *edge) {
+    if (!a->started) {
+        return;
+    }
+    aggregate_close(a, edge->idx);
+    bool counted = edge->idx >= a->bucket;
+    uint64_t changed = (a->level ^ edge->value) & a->channels;
+    for (; changed; changed &= changed - 1) {
+        int b = __builtin_ctzll(changed);
+        if (counted) {
+            if ((a->level >> b) & 1) {
+                a->high[b] += level_time(a, b, edge->idx);
+            }
+            if (a->since[b] != UINT64_MAX) {
+                uint64_t pulse = edge->idx - a->since[b];
+                if (a->min_pulse[b] == 0 || pulse < a->min_pulse[b]) {
+                    a->min_pulse[b] = pulse;
+                }
+                if (pulse > a->max_pulse[b]) {
+                    a->max_pulse[b] = pulse;
+                }
+            }
+            a->edges[b]++;
+        }
+        a->since[b] = edge->idx;
+    }
+    a->level = edge->value & a->channels;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "capture.h"
+#include "protocol.h"
+
+/* Per-channel statistics over fixed buckets of samples, for clients that
+ * subscribe to them instead of edges.
+ *
+ * Buckets are aligned to multiples of `width`. The first one starts at the
+ * first boundary after the aggregate was started, since the level before
+ * that is only known from then on. A pulse is the time between two edges of
+ * a channel and belongs to the bucket it ends in; the first pulse of every
+ * channel is not measured. A run of buckets without edges is closed as a
+ * single one, as wide as all of them. Capture thread only.
+ *
+ * Buckets are at least 1/AGGREGATE_MAX_RATE seconds wide, so that closing
+ * them stays cheap next to the capture.
+ */
+
+#define AGGREGATE_MAX_RATE 1000
+
+typedef struct aggregate {
+    uint64_t width;
+    uint64_t channels;
+    bool started;
+    /* Start of the bucket being accumulated. */
+    uint64_t bucket;
+    uint64_t level;
+    /* Per channel: index of the last edge, or UINT64_MAX before the first. */
+    uint64_t since[64];
+    uint32_t edges[64];
+    uint64_t high[64];
+    uint64_t min_pulse[64];
+    uint64_t max_pulse[64];
+    /* Records of the closed buckets, for the caller to take. */
+    proto_bucket_t *out;
+    size_t out_len;
+    size_t out_cap;
+} aggregate_t;
+
+void aggregate_reset(aggregate_t *a, uint64_t width, uint64_t channels);
+void aggregate_free(aggregate_t *a);
+/* Starts the first bucket at the boundary after `end`; `value` is the level
+ * at end - 1. */
+void aggregate_start(aggregate_t *a, uint64_t end, uint64_t value);
+void aggregate_push(aggregate_t *a, const capture_edge_t *edge);
+/* Closes every bucket that ends at or before `end`, the ones after the
+ * first in a single record per channel. */
+void aggregate_close(aggregate_t *a, uint64_t end);
@@ -0,0 +1,334 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <zlib.h>
+#include "archive.h"
+#include "ring.h"
+#include "srzip.h"
+#include "log.h"
+
+/* How often the writer looks for new samples. */
+#define ARCHIVE_POLL_NS 10000000
+
+RING_DEFINE(archive_ring, capture_edge_t)
+
+static struct {
+    srzip_writer_t *zip;
+    archive_ring_t ring;
+    pthread_t thread;
+    /* Every edge before this sample is in the ring. */
+    _Atomic uint64_t end;
+    _Atomic bool failed;
+    _Atomic bool stopping;
+    /* Capture thread only, but `first` is published along with `end`. */
+    bool started;
+    uint64_t first;
+    /* Writer thread only, until it is joined. */
+    bool broken;
+    unsigned int channels;
+    unsigned int unitsize;
+    uint64_t value;
+    uint64_t written;
+    uint8_t *block;
+    size_t block_samples;
+    size_t filled;
+    uint64_t block_value;
+    bool block_constant;
+    uint8_t *deflated;
+    size_t deflated_cap;
+    z_stream stream;
+    unsigned int members;
+    /* The last member of a single value, to write again as is. */
+    uint8_t *idle;
+    size_t idle_length;
+    uint64_t idle_value;
+    uint32_t idle_crc;
+} arc;
+
+
+static bool add_stored(const char *name, const void *data, size_t size) {
+    uint32_t crc = crc32(0, data, size);
+    return srzip_add(arc.zip, name, data, size, size, crc, false);
+}
+
+
+/* Writes `n` samples of `value` at the end of the block. */
+static void fill(uint64_t value, size_t n) {
+    uint8_t *p = arc.block + arc.filled * arc.unitsize;
+    switch (arc.unitsize) {
+        case 1:
+            memset(p, (uint8_t) value, n);
+            break;
+        case 2:
+            for (size_t i = 0; i < n; i++) {
+                ((uint16_t *) p)[i] = value;
+            }
+            break;
+        case 4:
+            for (size_t i = 0; i < n; i++) {
+                ((uint32_t *) p)[i] = value;
+            }
+            break;
+        case 8:
+            for (size_t i = 0; i < n; i++) {
+                ((uint64_t *) p)[i] = value;
+            }
+            break;
+        default:
+            for (size_t i = 0; i < n; i++) {
+                memcpy(p + i * arc.unitsize, &value, arc.unitsize);
+            }
+    }
+    if (arc.filled == 0) {
+        arc.block_value = value;
+        arc.block_constant = true;
+    } else if (value != arc.block_value) {
+        arc.block_constant = false;
+    }
+    arc.filled += n;
+}
+
+
+/* Deflates the block into the next member of the archive. */
+static bool flush_block() {
+    if (arc.filled == 0) {
+        return true;
+    }
+    size_t size = arc.filled * arc.unitsize;
+    bool idle = arc.block_constant && arc.filled == arc.block_samples;
+    char name[32];
+    snprintf(name, sizeof(name), "logic-1-%u", ++arc.members);
+    arc.filled = 0;
+
+    if (idle && arc.idle != NULL && arc.idle_value == arc.block_value) {
+        return srzip_add(arc.zip, name, arc.idle, arc.idle_length, size,
+                arc.idle_crc, true);
+    }
+    z_stream *z = &arc.stream;
+    deflateReset(z);
+    z->next_in = arc.block;
+    z->avail_in = size;
+    z->next_out = arc.deflated;
+    z->avail_out = arc.deflated_cap;
+    if (Z_STREAM_END != deflate(z, Z_FINISH)) {
+        log_msg(LOG_ERROR, "Can't deflate archive member %s", name);
+        return false;
+    }
+    size_t length = arc.deflated_cap - z->avail_out;
+    uint32_t crc = crc32(0, arc.block, size);
+    if (idle) {
+        uint8_t *copy = realloc(arc.idle, length);
+        if (copy == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memcpy(copy, arc.deflated, length);
+        arc.idle = copy;
+        arc.idle_length = length;
+        arc.idle_value = arc.block_value;
+        arc.idle_crc = crc;
+    }
+    return srzip_add(arc.zip, name, arc.deflated, length, size, crc, true);
+}
+
+
+/* Writes the current value up to sample `idx`. */
+static bool fill_to(uint64_t idx) {
+    while (arc.written < idx) {
+        size_t n = arc.block_samples - arc.filled;
+        if (n > idx - arc.written) {
+            n = idx - arc.written;
+        }
+        fill(arc.value, n);
+        arc.written += n;
+        if (arc.filled == arc.block_samples && !flush_block()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/* Expands the queued edges into the samples before `end`. */
+static bool expand(uint64_t end) {
+    capture_edge_t *edges;
+    size_t pos;
+    size_t n;
+
+    if (arc.written == 0 && arc.filled == 0) {
+        arc.value = arc.first;
+    }
+    while ((n = archive_ring_peek(&arc.ring, &edges, &pos)) != 0) {
+        size_t i;
+        for (i = 0; i < n && edges[i].idx < end; i++) {
+            if (!fill_to(edges[i].idx)) {
+                return false;
+            }
+            arc.value = edges[i].value;
+        }
+        archive_ring_consume(&arc.ring, pos, i);
+        if (i < n) {
+            break;
+        }
+    }
+    return fill_to(end);
+}
+
+
+static void *archive_task(void *arg) {
+    (void) arg;
+    struct timespec poll = { .tv_nsec = ARCHIVE_POLL_NS };
+
+    while (true) {
+        /* Whatever was published before stopping gets written. */
+        bool stopping = atomic_load(&arc.stopping);
+        uint64_t end = atomic_load_explicit(&arc.end, memory_order_acquire);
+        if (end > arc.written) {
+            if (!expand(end)) {
+                log_msg(LOG_ERROR, "Archive stopped at sample %lu",
+                        arc.written);
+                arc.broken = true;
+                atomic_store(&arc.failed, true);
+                break;
+            }
+        } else if (stopping) {
+            break;
+        } else {
+            nanosleep(&poll, NULL);
+        }
+    }
+    return NULL;
+}
+
+
+static const char *samplerate_string(uint64_t rate, char *buf, size_t size) {
+    if (rate != 0 && rate % 1000000000 == 0) {
+        snprintf(buf, size, "%lu GHz", rate / 1000000000);
+    } else if (rate != 0 && rate % 1000000 == 0) {
+        snprintf(buf, size, "%lu MHz", rate / 1000000);
+    } else if (rate != 0 && rate % 1000 == 0) {
+        snprintf(buf, size, "%lu kHz", rate / 1000);
+    } else {
+        snprintf(buf, size, "%lu Hz", rate);
+    }
+    return buf;
+}
+
+
+/* The "metadata" member: one device, with a probe per channel of the bus. */
+static bool add_metadata() {
+    char rate[32];
+    size_t cap = 256 + 16 * arc.channels;
+    char *text = malloc(cap);
+    if (text == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    size_t len = snprintf(text, cap, "[global]\nsigrok version=0.5.2\n\n"
+            "[device 1]\ncapturefile=logic-1\ntotal probes=%u\n"
+            "samplerate=%s\ntotal analog=0\n", arc.channels,
+            samplerate_string(capture_samplerate(), rate, sizeof(rate)));
+    for (unsigned int i = 0; i < arc.channels; i++) {
+        len += snprintf(text + len, cap - len, "probe%u=D%u\n", i + 1, i);
+    }
+    len += snprintf(text + len, cap - len, "unitsize=%u\n", arc.unitsize);
+    bool ok = add_stored("metadata", text, len);
+    free(text);
+    return ok;
+}
+
+
+bool archive_init(const char *path) {
+    arc.channels = capture_channels();
+    if (arc.channels > 64) {
+        arc.channels = 64;
+    }
+    arc.unitsize = (arc.channels + 7) / 8;
+    arc.block_samples = ARCHIVE_MEMBER_BYTES / arc.unitsize;
+    arc.block = malloc(arc.block_samples * arc.unitsize);
+    if (arc.block == NULL) {
+        perror("Failed to allocate archive");
+        exit(1);
+    }
+    if (Z_OK != deflateInit2(&arc.stream, Z_BEST_SPEED, Z_DEFLATED,
+                -MAX_WBITS, 8, Z_DEFAULT_STRATEGY)) {
+        fprintf(stderr, "\ncan't initialize deflate\n");
+        exit(1);
+    }
+    arc.deflated_cap = deflateBound(&arc.stream,
+            arc.block_samples * arc.unitsize);
+    arc.deflated = malloc(arc.deflated_cap);
+    if (arc.deflated == NULL
+            || !archive_ring_init(&arc.ring, ARCHIVE_RING_EDGES)) {
+        perror("Failed to allocate archive");
+        exit(1);
+    }
+
+    arc.zip = srzip_create(path);
+    if (arc.zip == NULL || !add_stored("version", "2", 1)
+            || !add_metadata()) {
+        return false;
+    }
+    atomic_init(&arc.end, 0);
+    atomic_init(&arc.failed, false);
+    atomic_init(&arc.stopping, false);
+    if (0 != pthread_create(&arc.thread, NULL, archive_task, NULL)) {
+        fprintf(stderr, "\ncan't create thread\n");
+        exit(1);
+    }
+    return true;
+}
+
+
+void archive_cleanup() {
+    if (arc.zip == NULL) {
+        return;
+    }
+    atomic_store(&arc.stopping, true);
+    pthread_join(arc.thread, NULL);
+
+    /* After a failed member, what was written before it is kept. */
+    bool ok = arc.broken || flush_block();
+    ok = srzip_finish(arc.zip) && ok;
+    if (!ok) {
+        fprintf(stderr, "\ncan't complete archive\n");
+    }
+    arc.zip = NULL;
+    deflateEnd(&arc.stream);
+    archive_ring_destroy(&arc.ring);
+    free(arc.block);
+    free(arc.deflated);
+    free(arc.idle);
+    arc.block = arc.deflated = arc.idle = NULL;
+}
+
+
+bool archive_enabled() {
+    return arc.zip != NULL;
+}
+
+
+void archive_append(const capture_edge_t *edges, size_t count, uint64_t prev,
+        uint64_t end) {
+    if (atomic_load_explicit(&arc.failed, memory_order_relaxed)) {
+        return;
+    }
+    if (!arc.started) {
+        arc.first = prev;
+        arc.started = true;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!archive_ring_push(&arc.ring, &edges[i])) {
+            log_msg(LOG_ERROR, "Archive can't keep up, stopped at sample %lu",
+                    atomic_load_explicit(&arc.end, memory_order_relaxed));
+            atomic_store(&arc.failed, true);
+            return;
+        }
+    }
+    atomic_store_explicit(&arc.end, end, memory_order_release);
+}
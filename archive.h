@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "capture.h"
+
+/* Archive of the whole capture as a sigrok session (.sr), for PulseView.
+ *
+ * The capture thread only queues the edges of every run of samples, in
+ * an edge ring, and publishes the index the runs reached. A writer thread
+ * expands the runs back into samples, ARCHIVE_MEMBER_BYTES at a time, and
+ * deflates each block into a member of the archive. A block that holds a
+ * single value, the common case of an idle bus, reuses the member
+ * deflated for the last such block instead of deflating again.
+ *
+ * The capture thread never waits for the writer. If the ring fills up
+ * because deflating can't keep up, archiving stops there. The archive is
+ * still closed cleanly, and holds every sample up to that point.
+ */
+
+#define ARCHIVE_RING_EDGES (1 << 20)
+#define ARCHIVE_MEMBER_BYTES (4 << 20)
+
+bool archive_init(const char *path);
+/* Flushes what is queued and closes the archive. */
+void archive_cleanup();
+bool archive_enabled();
+/* Capture thread only: queues a run of samples, as passed to
+ * on_capture_edges. */
+void archive_append(const capture_edge_t *edges, size_t count, uint64_t prev,
+        uint64_t end);
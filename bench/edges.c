@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../capture.h"
+#include "../edges.h"
+#include "../log.h"
+
+/* Microbenchmarks for the edge detection kernels, alone and behind
+ * capture_logic, for every unitsize and a range of edge densities. */
+
+#define BENCH_SAMPLES (1 << 20)
+#define BENCH_WINDOW 4096
+#define BENCH_MIN_NS 200000000ull
+
+static const unsigned int unitsizes[] = { 1, 2, 3, 4, 8 };
+
+/* Mean samples between edges; 0 is an idle line. */
+static const uint64_t gaps[] = { 0, 10000, 100, 8, 1 };
+
+static uint64_t edges_seen;
+
+
+void on_capture_edges(const capture_edge_t *edges, size_t count,
+        uint64_t prev, uint64_t end) {
+    (void) edges;
+    (void) prev;
+    (void) end;
+    edges_seen += count;
+}
+
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static uint64_t rng = 1;
+
+static uint64_t next_random() {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 0x2545f4914f6cdd1dull;
+}
+
+
+/* Flips a random bit every 1 to 2 * gap - 1 samples, or every sample. */
+static void *make_samples(unsigned int unitsize, uint64_t gap) {
+    uint8_t *data = malloc(BENCH_SAMPLES * unitsize);
+    if (data == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    uint64_t value = 0;
+    uint64_t left = gap;
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        if (gap == 1) {
+            value ^= 1;
+        } else if (gap != 0 && --left == 0) {
+            value ^= 1ull << (next_random() % (8 * unitsize));
+            left = 1 + next_random() % (2 * gap - 1);
+        }
+        memcpy(data + i * unitsize, &value, unitsize);
+    }
+    return data;
+}
+
+
+static void report(const char *what, unsigned int unitsize, uint64_t gap,
+        uint64_t samples, uint64_t edges, uint64_t ns) {
+    char density[32];
+    if (gap == 0) {
+        snprintf(density, sizeof(density), "idle");
+    } else {
+        snprintf(density, sizeof(density), "1/%lu", gap);
+    }
+    printf("%-16s %8u %8s %12.1f %12.1f\n", what, unitsize, density,
+            samples * 1e3 / ns, edges * 1e3 / ns);
+}
+
+
+static void bench_kernel(edges_isa_t isa, unsigned int unitsize, uint64_t gap,
+        const uint8_t *data) {
+    static uint32_t out[BENCH_WINDOW];
+    edges_kernel_t kernel = edges_kernel_for(isa, unitsize);
+    uint64_t mask = unitsize == 8 ? UINT64_MAX : (1ull << (8 * unitsize)) - 1;
+    uint64_t samples = 0, edges = 0;
+    uint64_t start = now_ns(), elapsed;
+    do {
+        for (size_t base = 0; base < BENCH_SAMPLES; base += BENCH_WINDOW) {
+            edges += kernel(data + base * unitsize, BENCH_WINDOW, 0, mask, out);
+        }
+        samples += BENCH_SAMPLES;
+        elapsed = now_ns() - start;
+    } while (elapsed < BENCH_MIN_NS);
+
+    char what[32];
+    snprintf(what, sizeof(what), "kernel %s", edges_isa_name(isa));
+    report(what, unitsize, gap, samples, edges, elapsed);
+}
+
+
+static void bench_capture(unsigned int unitsize, uint64_t gap,
+        const uint8_t *data) {
+    uint64_t samples = 0;
+    edges_seen = 0;
+    uint64_t start = now_ns(), elapsed;
+    do {
+        capture_logic(data, BENCH_SAMPLES * unitsize, unitsize);
+        samples += BENCH_SAMPLES;
+        elapsed = now_ns() - start;
+    } while (elapsed < BENCH_MIN_NS);
+    report("capture_logic", unitsize, gap, samples, edges_seen, elapsed);
+}
+
+
+int main() {
+    log_init(LOG_WARN);
+    const char *source = "synthetic";
+    capture_init(&source, 1, 0);
+
+    printf("%-16s %8s %8s %12s %12s\n", "benchmark", "unitsize", "density",
+            "Msamples/s", "Medges/s");
+    for (size_t u = 0; u < sizeof(unitsizes) / sizeof(unitsizes[0]); u++) {
+        for (size_t g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++) {
+            uint8_t *data = make_samples(unitsizes[u], gaps[g]);
+            for (int isa = 0; isa <= (int) edges_isa(); isa++) {
+                if (edges_kernel_for(isa, unitsizes[u]) != NULL) {
+                    bench_kernel(isa, unitsizes[u], gaps[g], data);
+                }
+            }
+            bench_capture(unitsizes[u], gaps[g], data);
+            free(data);
+        }
+    }
+
+    capture_cleanup();
+    log_shutdown();
+    return 0;
+}
@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "../protocol.h"
+
+/* End-to-end benchmark: runs sigrok-mux on the synthetic source and drives
+ * the fanout with 1 to 1000 Unix-socket clients, each with its own mask.
+ *
+ * The throughput run generates samples as fast as the mux takes them and
+ * reports the sample and edge rates the clients saw. Clients use the
+ * drop-oldest policy so that a slow one loses edges instead of being
+ * disconnected; losses are reported.
+ *
+ * The latency run paces the source in real time, so every sample has a
+ * wall-clock due time: the end of its packet, which is when the source
+ * hands it over. Edge-to-socket latency is the time from then until the
+ * client has read the edge.
+ *
+ * Arguments after the path of the mux are passed on to it, e.g. -u 0 to
+ * compare its send paths. */
+
+#define BENCH_SOCKET "./build/bench-socket"
+#define BENCH_SECONDS 2
+#define BENCH_BUFFER 65536
+#define BENCH_LATENCIES (1 << 22)
+
+#define THROUGHPUT_SOURCE "synthetic:channels=16,gap=64,packet=65536,pace=0"
+#define LATENCY_RATE 10000000
+#define LATENCY_PACKET 10000
+#define LATENCY_SOURCE "synthetic:channels=16,gap=1000,rate=10M," \
+    "packet=10000,pace=1"
+
+static const unsigned int client_counts[] = { 1, 10, 100, 1000 };
+
+typedef struct client {
+    int sock;
+    uint8_t buf[BENCH_BUFFER];
+    size_t len;
+} client_t;
+
+static struct {
+    uint64_t samplerate;
+    uint64_t start_ns;
+    uint64_t edges;
+    uint64_t lost;
+    uint64_t first_idx;
+    uint64_t last_idx;
+    bool paced;
+    uint64_t *latencies;
+    size_t latencies_len;
+} run;
+
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static pid_t start_mux(const char *mux, char **options, const char *source) {
+    unlink(BENCH_SOCKET);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed");
+        exit(1);
+    }
+    if (pid == 0) {
+        char *args[64] = { (char *) mux, "-q", "-q", "-s", "0" };
+        size_t n = 5;
+        while (*options != NULL && n < 60) {
+            args[n++] = *options++;
+        }
+        args[n++] = "-c";
+        args[n++] = (char *) source;
+        args[n++] = BENCH_SOCKET;
+        args[n] = NULL;
+        execv(mux, args);
+        perror("exec failed");
+        _exit(1);
+    }
+    return pid;
+}
+
+
+static void stop_mux(pid_t pid) {
+    int status;
+    kill(pid, SIGINT);
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid failed");
+        exit(1);
+    }
+    unlink(BENCH_SOCKET);
+}
+
+
+static int connect_client(uint64_t mask) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, BENCH_SOCKET, sizeof(addr.sun_path) - 1);
+
+    int sock = -1;
+    for (int attempt = 0; attempt < 200; attempt++) {
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock == -1) {
+            perror("socket failed");
+            exit(1);
+        }
+        if (0 == connect(sock, (struct sockaddr *) &addr, sizeof(addr))) {
+            break;
+        }
+        close(sock);
+        sock = -1;
+        usleep(10000);
+    }
+    if (sock == -1) {
+        fprintf(stderr, "\ncan't connect to the mux\n");
+        exit(1);
+    }
+
+    struct {
+        char magic[PROTO_MAGIC_LEN];
+        proto_msg_header_t hello_header;
+        proto_hello_msg_t hello;
+        proto_msg_header_t policy_header;
+        proto_policy_msg_t policy;
+    } __attribute__((packed)) msg = {
+        .magic = PROTO_MAGIC,
+        .hello_header = { PROTO_MSG_HELLO, sizeof(proto_hello_msg_t) },
+        .hello = {
+            .version = PROTO_VERSION,
+            .encoding = PROTO_ENC_RAW,
+            .mask = mask,
+        },
+        .policy_header = { PROTO_MSG_POLICY, sizeof(proto_policy_msg_t) },
+        .policy = { .policy = PROTO_POLICY_DROP_OLDEST },
+    };
+    if (sizeof(msg) != send(sock, &msg, sizeof(msg), 0)) {
+        perror("send failed");
+        exit(1);
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    return sock;
+}
+
+
+static void on_edges(const uint8_t *payload, size_t length, uint64_t now) {
+    proto_edges_header_t header;
+    if (length < sizeof(header)) {
+        return;
+    }
+    memcpy(&header, payload, sizeof(header));
+    run.edges += header.count;
+    for (uint32_t i = 0; i < header.count; i++) {
+        proto_raw_edge_t edge;
+        memcpy(&edge, payload + sizeof(header) + i * sizeof(edge),
+                sizeof(edge));
+        if (run.first_idx == 0 || edge.idx < run.first_idx) {
+            run.first_idx = edge.idx;
+        }
+        if (edge.idx > run.last_idx) {
+            run.last_idx = edge.idx;
+        }
+        if (run.paced && run.latencies_len < BENCH_LATENCIES) {
+            uint64_t due = (edge.idx / LATENCY_PACKET + 1) * LATENCY_PACKET;
+            uint64_t due_ns = run.start_ns + due * 1000000000ull / LATENCY_RATE;
+            run.latencies[run.latencies_len++] = now > due_ns ? now - due_ns : 0;
+        }
+    }
+}
+
+
+static void read_client(client_t *c) {
+    while (1) {
+        ssize_t n = recv(c->sock, c->buf + c->len, BENCH_BUFFER - c->len, 0);
+        if (n <= 0) {
+            return;
+        }
+        uint64_t now = clock_ns(CLOCK_REALTIME);
+        c->len += n;
+
+        size_t pos = 0;
+        proto_frame_header_t header;
+        while (c->len - pos >= sizeof(header)) {
+            memcpy(&header, c->buf + pos, sizeof(header));
+            if (c->len - pos < sizeof(header) + header.length) {
+                break;
+            }
+            const uint8_t *payload = c->buf + pos + sizeof(header);
+            if (header.type == PROTO_FRAME_HELLO) {
+                proto_hello_frame_t hello;
+                memcpy(&hello, payload, sizeof(hello));
+                run.samplerate = hello.samplerate;
+                run.start_ns = hello.start_ns;
+            } else if (header.type == PROTO_FRAME_GAP) {
+                proto_gap_frame_t gap;
+                memcpy(&gap, payload, sizeof(gap));
+                run.lost += gap.count;
+            } else if (header.type == PROTO_FRAME_EDGES) {
+                on_edges(payload, header.length, now);
+            }
+            pos += sizeof(header) + header.length;
+        }
+        memmove(c->buf, c->buf + pos, c->len - pos);
+        c->len -= pos;
+    }
+}
+
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+
+static void bench(const char *mux, char **options, unsigned int count,
+        bool paced) {
+    pid_t pid = start_mux(mux, options,
+            paced ? LATENCY_SOURCE : THROUGHPUT_SOURCE);
+    client_t *clients = calloc(count, sizeof(client_t));
+    int epoll_fd = epoll_create1(0);
+    if (clients == NULL || epoll_fd == -1) {
+        perror("bench setup failed");
+        exit(1);
+    }
+
+    memset(&run, 0, sizeof(run));
+    run.paced = paced;
+    run.latencies = malloc(BENCH_LATENCIES * sizeof(uint64_t));
+    if (run.latencies == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        uint64_t mask = (1ull << (i % 16)) | (1ull << ((7 * i + 3) % 16));
+        clients[i].sock = connect_client(mask);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &clients[i] };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, clients[i].sock, &ev);
+    }
+
+    struct epoll_event events[64];
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    uint64_t end = start + BENCH_SECONDS * 1000000000ull;
+    uint64_t now;
+    while ((now = clock_ns(CLOCK_MONOTONIC)) < end) {
+        int n = epoll_wait(epoll_fd, events, 64, (end - now) / 1000000 + 1);
+        for (int i = 0; i < n; i++) {
+            read_client(events[i].data.ptr);
+        }
+    }
+    double seconds = (clock_ns(CLOCK_MONOTONIC) - start) / 1e9;
+
+    stop_mux(pid);
+    for (unsigned int i = 0; i < count; i++) {
+        close(clients[i].sock);
+    }
+    close(epoll_fd);
+    free(clients);
+
+    double p50 = 0, p99 = 0;
+    if (run.latencies_len != 0) {
+        qsort(run.latencies, run.latencies_len, sizeof(uint64_t), compare_u64);
+        p50 = run.latencies[run.latencies_len / 2] / 1e3;
+        p99 = run.latencies[run.latencies_len * 99 / 100] / 1e3;
+    }
+    printf("%-10s %8u %12.1f %12.2f %12lu %10.1f %10.1f\n",
+            paced ? "latency" : "throughput", count,
+            (run.last_idx - run.first_idx) / seconds / 1e6,
+            run.edges / seconds / 1e6, run.lost, p50, p99);
+    free(run.latencies);
+    run.latencies = NULL;
+}
+
+
+int main(int argc, char **argv) {
+    const char *mux = argc > 1 ? argv[1] : "./build/sigrok-mux";
+    char **options = argc > 1 ? argv + 2 : argv + argc;
+
+    struct rlimit limit;
+    if (0 == getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-10s %8s %12s %12s %12s %10s %10s\n", "run", "clients",
+            "Msamples/s", "Medges/s", "lost", "p50 us", "p99 us");
+    for (size_t i = 0; i < sizeof(client_counts) / sizeof(client_counts[0]);
+            i++) {
+        bench(mux, options, client_counts[i], false);
+        bench(mux, options, client_counts[i], true);
+    }
+    return 0;
+}
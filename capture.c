@@ -1,400 +1,824 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include <math.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
-#include <gmodule.h>
-#include <libsigrok/libsigrok.h>
+#include <time.h>
+#include <pthread.h>
 #include "capture.h"
-
-#define UNUSED(x) (void)(x)
-
-
-typedef struct state {
-    struct sr_context *context;
-    struct sr_dev_driver *driver;
-    struct sr_dev_inst *device;
-    struct sr_session *session;
-    unsigned int num_channels;
+#include "edges.h"
+#include "log.h"
+#include "merge.h"
+#include "stats.h"
+#include "trace.h"
+
+
+/* Samples are scanned in windows so the index scratch buffer stays small
+ * enough to live in cache. */
+#define EDGES_WINDOW 4096
+/* With workers, packets are copied into a pool of PIPELINE_DEPTH buffers per
+ * worker, split into chunks of at most this many bytes. */
+#define PIPELINE_CHUNK_BYTES (1 << 20)
+#define PIPELINE_DEPTH 4
+/* With several devices, each one's place on the bus clock is corrected once
+ * per window, by this fraction of the error seen. */
+#define ALIGN_WINDOW_NS 1000000000ull
+#define ALIGN_GAIN 4
+
+typedef enum chunk_stage {
+    CHUNK_FREE,
+    CHUNK_FILLED,
+    CHUNK_DONE,
+} chunk_stage_t;
+
+/* A run of samples and, once scanned, its edges. */
+typedef struct capture_chunk {
+    const uint8_t *data;
+    unsigned int unitsize;
+    uint64_t count;
+    uint64_t idx;
+    /* The sample before data[0]. */
+    uint64_t prev;
+    /* When the packet arrived, if tracing. */
+    uint64_t received_ns;
+    capture_edge_t *edges;
+    size_t edges_len;
+    size_t edges_cap;
+    /* Pipeline only: the chunk's copy of the samples. */
+    uint8_t *buffer;
+    chunk_stage_t stage;
+} capture_chunk_t;
+
+/* A backend instance and the samples it has fed. */
+typedef struct capture_device {
+    const capture_backend_t *backend;
+    void *self;
+    char *options;
     uint64_t prev;
     uint64_t idx;
-    bool running;
+    bool warned_wide;
+    capture_chunk_t chunk;
+    uint32_t scratch[EDGES_WINDOW];
+    /* Several devices only: its first channel on the bus and how many it
+     * has, where its sample 0 is on the bus clock, and the last bus index
+     * it was given. It is aligned from its first packet, and settled after
+     * a first window. */
+    unsigned int shift;
+    unsigned int width;
+    bool aligned;
+    bool settled;
+    int64_t offset;
+    /* The least a packet lagged behind its place on the bus in the current
+     * window, which ends at window_ns. */
+    int64_t min_lag;
+    uint64_t window_ns;
+    uint64_t last;
+    pthread_t thread;
+} capture_device_t;
+
+typedef struct state {
+    capture_device_t devices[CAPTURE_DEVICES_MAX];
+    size_t count;
+    uint64_t start_ns;
+    struct timespec start_mono;
 } state_t;
 
 static struct state state;
 
-static const uint64_t SAMPLERATE = 50000000;
-
-#define SR_ERROR_CHECK(x) do {                                          \
-        int __err_rc = (x);                                             \
-        if (__err_rc != SR_OK) {                                        \
-        fprintf(stderr, "\033[1;31m");                                  \
-            fprintf(stderr, "Sigrok error %s @ %s:%d.\n",               \
-                    sr_strerror_name(__err_rc), __FILE__, __LINE__);    \
-        fprintf(stderr, "\033[0m");                                     \
-        }                                                               \
-        exit(1);                                                        \
-    } while(0)
-
-
-static int assert_sr(int ret, const char *string) {
-    if (ret != SR_OK) {
-    fprintf(stderr, "\033[1;31m");
-        fprintf(stderr, "Error %s (%s): %s.\n", string, sr_strerror_name(ret),
-                sr_strerror(ret));
-    fprintf(stderr, "\033[0m");
-        exit(1);
+/* The device whose backend runs on this thread. */
+static _Thread_local capture_device_t *current;
+
+/* Chunk-parallel edge detection.
+ *
+ * The backend thread copies each packet into free pool chunks, tagged with
+ * their first index and the sample before them, and queues them in order.
+ * Workers take the oldest queued chunk and scan it on their own, since the
+ * sample before it is all they need from its predecessor. The merge thread
+ * hands the scanned chunks to on_capture_edges in queue order and frees
+ * them, so the fanout still runs on a single thread. Chunk i of the queue
+ * lives in chunks[i % depth]. */
+static struct {
+    unsigned int workers;
+    size_t depth;
+    capture_chunk_t *chunks;
+    pthread_t *threads;
+    pthread_t merger;
+    pthread_mutex_t mutex;
+    pthread_cond_t filled;
+    pthread_cond_t done;
+    pthread_cond_t freed;
+    uint64_t next_fill;
+    uint64_t next_work;
+    uint64_t next_merge;
+    bool stopping;
+} pipeline;
+
+capture_stats_t capture_stats;
+
+static const capture_backend_t *backends[] = {
+#ifndef CAPTURE_NO_SIGROK
+    &capture_sigrok,
+#endif
+    &capture_replay,
+    &capture_synthetic,
+};
+
+#define BACKENDS_COUNT (sizeof(backends) / sizeof(backends[0]))
+
+
+static capture_edge_t *reserve_edges(capture_chunk_t *chunk, size_t count) {
+    size_t needed = chunk->edges_len + count;
+    if (needed > chunk->edges_cap) {
+        size_t cap = chunk->edges_cap ? chunk->edges_cap : EDGES_WINDOW;
+        while (cap < needed) {
+            cap *= 2;
+        }
+        capture_edge_t *edges = realloc(chunk->edges, cap * sizeof(*edges));
+        if (edges == NULL) {
+            perror("Failed to grow edge batch");
+            exit(1);
+        }
+        chunk->edges = edges;
+        chunk->edges_cap = cap;
     }
-    return ret;
-}
-
-
-static const char *configkey_tostring(int option) {
-    const char *option_name;
-    switch (option) {
-        case SR_CONF_LOGIC_ANALYZER:
-            option_name = "Logic Analyzer"; break;
-        case SR_CONF_OSCILLOSCOPE:
-            option_name = "Oscilloscope"; break;
-        case SR_CONF_CONN:
-            option_name = "Connection"; break;
-        case SR_CONF_SAMPLERATE:
-            option_name = "Sample Rate"; break;
-        case SR_CONF_VDIV:
-            option_name = "Volts/Div"; break;
-        case SR_CONF_COUPLING:
-            option_name = "Coupling"; break;
-        case SR_CONF_NUM_VDIV:
-            option_name = "Number of Vertical Divisions"; break;
-        case SR_CONF_LIMIT_MSEC:
-            option_name = "Sample Time Limit (ms)"; break;
-        case SR_CONF_LIMIT_SAMPLES:
-            option_name = "Sample Number Limit"; break;
-        case SR_CONF_LIMIT_FRAMES:
-            option_name = "Frames Number Limit"; break;
-        case SR_CONF_CONTINUOUS:
-            option_name = "Continuous"; break;
-        default: option_name = NULL;
-    }
-    return option_name;
-}
-
-
-static void enumerate_device_options(const char *name, struct sr_dev_driver *driver,
-        struct sr_dev_inst *dev, struct sr_channel_group *chgroup) {
-    GVariant *gvar;
-    int res;
-    GArray *options_list;
-
-    options_list= sr_dev_options(driver, dev, chgroup);
-
-    if (options_list == NULL) {
-        fprintf(stderr, "\033[1;31m");
-        fprintf(stderr, "Error getting options list from %s!\n", name);
-        fprintf(stderr, "\033[0m");
-        exit(1);
+    return &chunk->edges[chunk->edges_len];
+}
+
+
+/* Collects every edge of the chunk into chunk->edges. */
+#define ON_LOGIC_FRAME(FUNCTION_NAME, DATA_T)                                 \
+static void FUNCTION_NAME(capture_chunk_t *chunk, uint32_t *scratch) {        \
+    edges_kernel_t kernel = edges_kernel(sizeof(DATA_T));                     \
+    const DATA_T *data = (const DATA_T *) chunk->data;                        \
+    DATA_T mask = (DATA_T) ~(DATA_T) 0;                                       \
+    DATA_T prev = (DATA_T) chunk->prev;                                       \
+    uint64_t idx = chunk->idx;                                                \
+    uint64_t count = chunk->count;                                            \
+    uint64_t base;                                                            \
+    chunk->edges_len = 0;                                                     \
+    for (base = 0; base < count; base += EDGES_WINDOW) {                      \
+        size_t window = count - base;                                         \
+        if (window > EDGES_WINDOW) {                                          \
+            window = EDGES_WINDOW;                                            \
+        }                                                                     \
+        size_t n = kernel(data + base, window, prev, mask, scratch);          \
+        capture_edge_t *out = reserve_edges(chunk, n);                        \
+        for (size_t k = 0; k < n; k++) {                                      \
+            uint64_t i = base + scratch[k];                                   \
+            out[k].idx = idx + i;                                             \
+            out[k].value = data[i];                                           \
+        }                                                                     \
+        if (n != 0) {                                                         \
+            prev = (DATA_T) out[n - 1].value;                                 \
+        }                                                                     \
+        chunk->edges_len += n;                                                \
+    }                                                                         \
+}                                                                             \
+
+ON_LOGIC_FRAME(on_logic_frame_8, uint8_t)
+ON_LOGIC_FRAME(on_logic_frame_16, uint16_t)
+ON_LOGIC_FRAME(on_logic_frame_32, uint32_t)
+ON_LOGIC_FRAME(on_logic_frame_64, uint64_t)
+
+
+/* Any other unitsize: every window is widened to 8-byte samples and goes
+ * through the 8-byte kernel. */
+static void on_logic_frame_wide(capture_chunk_t *chunk, uint32_t *scratch) {
+    edges_kernel_t kernel = edges_kernel(sizeof(uint64_t));
+    uint64_t wide[EDGES_WINDOW];
+    const uint8_t *data = chunk->data;
+    uint64_t prev = chunk->prev;
+    chunk->edges_len = 0;
+    for (uint64_t base = 0; base < chunk->count; base += EDGES_WINDOW) {
+        size_t window = chunk->count - base;
+        if (window > EDGES_WINDOW) {
+            window = EDGES_WINDOW;
+        }
+        edges_widen(data + base * chunk->unitsize, window, chunk->unitsize,
+                wide);
+        size_t n = kernel(wide, window, prev, UINT64_MAX, scratch);
+        capture_edge_t *out = reserve_edges(chunk, n);
+        for (size_t k = 0; k < n; k++) {
+            out[k].idx = chunk->idx + base + scratch[k];
+            out[k].value = wide[scratch[k]];
+        }
+        prev = wide[window - 1];
+        chunk->edges_len += n;
     }
+}
 
-    for (guint i = 0; i < options_list->len; i++) {
-        uint32_t option = g_array_index(options_list, uint32_t, i);
-        const char *option_name = configkey_tostring(option);
 
-        fprintf(stderr, "\033[1;32m");
-        if (option_name == NULL) {
-            fprintf(stderr, "%s option %u available\n", name, option);
-        } else {
-            fprintf(stderr, "%s option %u available: %s\n", name, option, option_name);
+static void detect_edges(capture_chunk_t *chunk, uint32_t *scratch) {
+    switch (chunk->unitsize) {
+        case 1: on_logic_frame_8(chunk, scratch); break;
+        case 2: on_logic_frame_16(chunk, scratch); break;
+        case 4: on_logic_frame_32(chunk, scratch); break;
+        case 8: on_logic_frame_64(chunk, scratch); break;
+        default: on_logic_frame_wide(chunk, scratch); break;
+    }
+}
+
+
+/* Hands the edges of a chunk to the fanout with a single on_capture_edges
+ * call. */
+static void deliver_chunk(capture_chunk_t *chunk) {
+    counter_add(&capture_stats.samples, chunk->count);
+    counter_add(&capture_stats.edges, chunk->edges_len);
+    if (chunk->received_ns != 0) {
+        trace_run(chunk->idx, chunk->idx + chunk->count, chunk->received_ns);
+    }
+    on_capture_edges(chunk->edges, chunk->edges_len, chunk->prev,
+            chunk->idx + chunk->count);
+}
+
+
+static void *pipeline_worker(void *param) {
+    (void) param;
+    uint32_t scratch[EDGES_WINDOW];
+
+    pthread_mutex_lock(&pipeline.mutex);
+    while (true) {
+        while (!pipeline.stopping && pipeline.next_work == pipeline.next_fill) {
+            pthread_cond_wait(&pipeline.filled, &pipeline.mutex);
         }
-        fprintf(stderr, "\033[0m");
-
-        res = sr_config_get(driver, dev, chgroup, option, &gvar);
-        if (res == SR_OK) {
-            gchar *value = g_variant_print(gvar, TRUE);
-            fprintf(stderr, "\033[1;32m");
-            fprintf(stderr, "value is %s\n", value);
-            fprintf(stderr, "\033[0m");
-            free(value);
+        if (pipeline.next_work == pipeline.next_fill) {
+            break;
         }
+        capture_chunk_t *chunk =
+            &pipeline.chunks[pipeline.next_work++ % pipeline.depth];
+        pthread_mutex_unlock(&pipeline.mutex);
 
-        res = sr_config_list(driver, dev, chgroup, option, &gvar);
-        if (res == SR_OK) {
-            gchar *value = g_variant_print(gvar, TRUE);
-            fprintf(stderr, "\033[1;32m");
-            fprintf(stderr, "list values are %s\n", value);
-            fprintf(stderr, "\033[0m");
-            free(value);
+        detect_edges(chunk, scratch);
+
+        pthread_mutex_lock(&pipeline.mutex);
+        chunk->stage = CHUNK_DONE;
+        pthread_cond_signal(&pipeline.done);
+    }
+    pthread_mutex_unlock(&pipeline.mutex);
+    return NULL;
+}
+
+
+static void *pipeline_merge(void *param) {
+    (void) param;
+
+    pthread_mutex_lock(&pipeline.mutex);
+    while (true) {
+        capture_chunk_t *chunk =
+            &pipeline.chunks[pipeline.next_merge % pipeline.depth];
+        while (chunk->stage != CHUNK_DONE && !(pipeline.stopping
+                    && pipeline.next_merge == pipeline.next_fill)) {
+            pthread_cond_wait(&pipeline.done, &pipeline.mutex);
+        }
+        if (chunk->stage != CHUNK_DONE) {
+            break;
         }
+        pthread_mutex_unlock(&pipeline.mutex);
 
-        fprintf(stderr, "\n");
+        deliver_chunk(chunk);
+
+        pthread_mutex_lock(&pipeline.mutex);
+        chunk->stage = CHUNK_FREE;
+        pipeline.next_merge++;
+        pthread_cond_signal(&pipeline.freed);
     }
-    g_array_free(options_list, TRUE);
+    pthread_mutex_unlock(&pipeline.mutex);
+    return NULL;
 }
 
 
-static struct sr_channel** get_device_channels(struct sr_dev_inst *dev, unsigned int *num) {
-    GSList *ch_list;
-    struct sr_channel **channels;
-    if ((ch_list = sr_dev_inst_channels_get(dev)) == NULL) {
-        fprintf(stderr, "Error enumerating channels\n");
-        exit(1);
+/* Backend thread: copies samples into the next free chunk and queues it,
+ * waiting for the merge stage if the whole pool is in flight. */
+static void pipeline_push(const uint8_t *data, uint64_t count,
+        unsigned int unitsize, uint64_t idx, uint64_t prev,
+        uint64_t received_ns) {
+    pthread_mutex_lock(&pipeline.mutex);
+    capture_chunk_t *chunk =
+        &pipeline.chunks[pipeline.next_fill % pipeline.depth];
+    if (chunk->stage != CHUNK_FREE) {
+        counter_add(&capture_stats.stalls, 1);
+        while (chunk->stage != CHUNK_FREE) {
+            pthread_cond_wait(&pipeline.freed, &pipeline.mutex);
+        }
     }
+    pthread_mutex_unlock(&pipeline.mutex);
+
+    memcpy(chunk->buffer, data, count * unitsize);
+    chunk->data = chunk->buffer;
+    chunk->unitsize = unitsize;
+    chunk->count = count;
+    chunk->idx = idx;
+    chunk->prev = prev;
+    chunk->received_ns = received_ns;
+
+    pthread_mutex_lock(&pipeline.mutex);
+    chunk->stage = CHUNK_FILLED;
+    pipeline.next_fill++;
+    pthread_cond_signal(&pipeline.filled);
+    pthread_mutex_unlock(&pipeline.mutex);
+}
 
-    guint ch_count = g_slist_length(ch_list);
-    fprintf(stderr, "\033[1;32m");
-    fprintf(stderr, "Found %d channels\n", ch_count);
-    fprintf(stderr, "\033[0m");
 
-    channels = malloc((1 + ch_count) * sizeof(struct sr_channel *));
-    if (channels == NULL) {
-        perror("malloc");
+static void pipeline_start(unsigned int workers) {
+    pipeline.workers = workers;
+    if (workers == 0) {
+        return;
+    }
+    pipeline.depth = PIPELINE_DEPTH * workers;
+    pipeline.chunks = calloc(pipeline.depth, sizeof(pipeline.chunks[0]));
+    pipeline.threads = calloc(workers, sizeof(pipeline.threads[0]));
+    if (pipeline.chunks == NULL || pipeline.threads == NULL) {
+        perror("Failed to allocate capture pipeline");
         exit(1);
     }
-    for (guint i = 0; i < ch_count && ch_list != NULL; ch_list = ch_list->next) {
-        struct sr_channel *channel;
-        channel = ch_list->data;
-        channels[i++] = channel;
+    for (size_t i = 0; i < pipeline.depth; i++) {
+        pipeline.chunks[i].buffer = malloc(PIPELINE_CHUNK_BYTES);
+        if (pipeline.chunks[i].buffer == NULL) {
+            perror("Failed to allocate capture pipeline");
+            exit(1);
+        }
+        pipeline.chunks[i].stage = CHUNK_FREE;
+    }
+    pipeline.next_fill = pipeline.next_work = pipeline.next_merge = 0;
+    pipeline.stopping = false;
+
+    if (0 != pthread_mutex_init(&pipeline.mutex, NULL)
+            || 0 != pthread_cond_init(&pipeline.filled, NULL)
+            || 0 != pthread_cond_init(&pipeline.done, NULL)
+            || 0 != pthread_cond_init(&pipeline.freed, NULL)) {
+        fprintf(stderr, "\ncan't make capture pipeline mutex\n");
+        exit(1);
     }
-    channels[ch_count] = NULL;
-    num[0] = ch_count;
-    return channels;
+    for (unsigned int i = 0; i < workers; i++) {
+        if (0 != pthread_create(&pipeline.threads[i], NULL, pipeline_worker,
+                    NULL)) {
+            fprintf(stderr, "\ncan't create capture worker\n");
+            exit(1);
+        }
+    }
+    if (0 != pthread_create(&pipeline.merger, NULL, pipeline_merge, NULL)) {
+        fprintf(stderr, "\ncan't create capture merge thread\n");
+        exit(1);
+    }
+    log_msg(LOG_INFO, "Edge detection on %u worker threads", workers);
 }
 
 
-static struct sr_dev_driver *get_driver(const char *driver_name,
-        struct sr_context *sr_ctx) {
-    struct sr_dev_driver** drivers;
-    struct sr_dev_driver* driver = NULL;
-    drivers = sr_driver_list(sr_ctx);
-    if (drivers == NULL) {
-        fprintf(stderr, "No drivers found!\n");
-        exit(1);
-        return NULL;
-    }
-
-    for (int i = 0; drivers[i] != NULL; i++) {
-        driver = drivers[i];
-        if (0 == strcmp(driver->name, driver_name)) {
-            int r = sr_driver_init(sr_ctx, driver);
-            if (r != SR_OK) {
-                fprintf(stderr, "Error initializing driver!\n");
-                exit(1);
-                return NULL;
-            }
-            
-            return driver;
+/* Delivers everything queued, then stops the threads. */
+static void pipeline_stop() {
+    if (pipeline.workers == 0) {
+        return;
+    }
+    pthread_mutex_lock(&pipeline.mutex);
+    pipeline.stopping = true;
+    pthread_cond_broadcast(&pipeline.filled);
+    pthread_cond_broadcast(&pipeline.done);
+    pthread_mutex_unlock(&pipeline.mutex);
+
+    for (unsigned int i = 0; i < pipeline.workers; i++) {
+        pthread_join(pipeline.threads[i], NULL);
+    }
+    pthread_join(pipeline.merger, NULL);
+
+    for (size_t i = 0; i < pipeline.depth; i++) {
+        free(pipeline.chunks[i].buffer);
+        free(pipeline.chunks[i].edges);
+    }
+    free(pipeline.chunks);
+    free(pipeline.threads);
+    pthread_cond_destroy(&pipeline.freed);
+    pthread_cond_destroy(&pipeline.done);
+    pthread_cond_destroy(&pipeline.filled);
+    pthread_mutex_destroy(&pipeline.mutex);
+}
+
+
+/* The first 64 channels of the sample at `p`. */
+static uint64_t sample_at(const uint8_t *p, unsigned int unitsize) {
+    uint64_t value = 0;
+    memcpy(&value, p, unitsize < sizeof(value) ? unitsize : sizeof(value));
+    return value;
+}
+
+
+/* The device of the calling backend thread; the first one for callers
+ * outside capture_run. */
+static capture_device_t *device() {
+    return current != NULL ? current : &state.devices[0];
+}
+
+
+static capture_stats_t *device_stats(capture_device_t *d) {
+    return state.count > 1 ? merge_stats(d - state.devices) : &capture_stats;
+}
+
+
+static uint64_t device_samplerate(capture_device_t *d) {
+    return d->backend->samplerate(d->self);
+}
+
+
+/* Sample `idx` at `from` Hz, in samples at `to` Hz. */
+static uint64_t rescale(uint64_t idx, uint64_t from, uint64_t to) {
+    if (from == to) {
+        return idx;
+    }
+    return idx / from * to + idx % from * to / from;
+}
+
+
+static uint64_t elapsed_ns() {
+    struct state *s = &state;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - s->start_mono.tv_sec) * 1000000000ull
+        + now.tv_nsec - s->start_mono.tv_nsec;
+}
+
+
+/* Several devices: the bus index of sample `idx` of the device. Bus
+ * indices count samples at the first device's rate, and never go back. */
+static uint64_t bus_idx(capture_device_t *d, uint64_t idx) {
+    int64_t bus = d->offset + (int64_t) rescale(idx, device_samplerate(d),
+            capture_samplerate());
+    if (bus < (int64_t) d->last) {
+        bus = d->last;
+    }
+    d->last = bus;
+    return bus;
+}
+
+
+/* Several devices: places the device on the bus clock as the packet that
+ * ends at sample `end` arrives. The devices run on clocks of their own, so
+ * the only common reference is when their packets arrive. The first packet
+ * of a device is taken to end as it arrives. After that, every
+ * ALIGN_WINDOW_NS the device is moved by the lowest lag of the window's
+ * packets, the one least held up by transfer and scheduling: fully after
+ * the first window, then by 1/ALIGN_GAIN of it, which follows the skew of
+ * the device's clock without chasing the jitter of the window minimum. */
+static void align_device(capture_device_t *d, uint64_t end) {
+    uint64_t now = elapsed_ns();
+    uint64_t rate = capture_samplerate();
+    int64_t arrived = now / 1000000000ull * rate
+        + now % 1000000000ull * rate / 1000000000ull;
+    int64_t samples = rescale(end, device_samplerate(d), rate);
+    if (!d->aligned) {
+        d->offset = arrived - samples;
+        d->min_lag = INT64_MAX;
+        d->window_ns = now + ALIGN_WINDOW_NS;
+        d->aligned = true;
+        return;
+    }
+    int64_t lag = arrived - (d->offset + samples);
+    if (lag < d->min_lag) {
+        d->min_lag = lag;
+    }
+    if (now >= d->window_ns) {
+        d->offset += d->settled ? d->min_lag / ALIGN_GAIN : d->min_lag;
+        d->settled = true;
+        log_msg(LOG_DEBUG, "Device %zu is %ld samples off the bus clock",
+                (size_t) (d - state.devices), d->min_lag);
+        d->min_lag = INT64_MAX;
+        d->window_ns = now + ALIGN_WINDOW_NS;
+    }
+}
+
+
+/* Several devices: queues the edges of a chunk for the merge, on the bus
+ * clock. */
+static void deliver_device(capture_device_t *d, capture_chunk_t *chunk) {
+    for (size_t i = 0; i < chunk->edges_len; i++) {
+        chunk->edges[i].idx = bus_idx(d, chunk->edges[i].idx);
+    }
+    uint64_t end = bus_idx(d, chunk->idx + chunk->count);
+    merge_push(d - state.devices, chunk->edges, chunk->edges_len, end,
+            chunk->received_ns);
+}
+
+
+void capture_logic(const void *data, uint64_t length, unsigned int unitsize) {
+    capture_device_t *d = device();
+    uint64_t received_ns = trace_enabled() ? trace_now() : 0;
+    if (unitsize == 0) {
+        counter_add(&device_stats(d)->dropped_packets, 1);
+        log_msg(LOG_WARN, "Received datafeed size %u.", unitsize);
+        return;
+    }
+    if (unitsize > sizeof(uint64_t) && !d->warned_wide) {
+        log_msg(LOG_WARN, "Datafeed of %u channels, only the first 64 are "
+                "forwarded.", 8 * unitsize);
+        d->warned_wide = true;
+    }
+    uint64_t count = length / unitsize;
+    counter_add(&device_stats(d)->packets, 1);
+    if (count == 0) {
+        return;
+    }
+
+    if (state.count > 1 || pipeline.workers == 0) {
+        capture_chunk_t *chunk = &d->chunk;
+        chunk->data = data;
+        chunk->unitsize = unitsize;
+        chunk->count = count;
+        chunk->idx = d->idx;
+        chunk->prev = d->prev;
+        chunk->received_ns = received_ns;
+        detect_edges(chunk, d->scratch);
+        if (state.count > 1) {
+            align_device(d, d->idx + count);
+            deliver_device(d, chunk);
+        } else {
+            deliver_chunk(chunk);
+        }
+    } else {
+        uint64_t per_chunk = PIPELINE_CHUNK_BYTES / unitsize;
+        uint64_t prev = d->prev;
+        for (uint64_t base = 0; base < count; base += per_chunk) {
+            uint64_t n = count - base < per_chunk ? count - base : per_chunk;
+            const uint8_t *p = (const uint8_t *) data + base * unitsize;
+            pipeline_push(p, n, unitsize, d->idx + base, prev, received_ns);
+            prev = sample_at(p + (n - 1) * unitsize, unitsize);
+        }
+    }
+
+    d->prev = sample_at((const uint8_t *) data + (count - 1) * unitsize,
+            unitsize);
+    d->idx += count;
+}
+
+
+void capture_drop() {
+    counter_add(&device_stats(device())->dropped_packets, 1);
+}
+
+
+void capture_resume() {
+    capture_device_t *d = device();
+    uint64_t ns = elapsed_ns();
+    uint64_t rate = capture_samplerate();
+    int64_t bus = ns / 1000000000ull * rate
+        + ns % 1000000000ull * rate / 1000000000ull;
+    bus -= d->offset;
+    uint64_t idx = bus > 0 ? rescale(bus, rate, device_samplerate(d)) : 0;
+    if (idx > d->idx) {
+        log_msg(LOG_DEBUG, "Resuming after %lu samples", idx - d->idx);
+        d->idx = idx;
+    }
+}
+
+
+void capture_pace(uint64_t idx) {
+    struct state *s = &state;
+    uint64_t samplerate = device_samplerate(device());
+    uint64_t ns = idx / samplerate * 1000000000ull
+        + idx % samplerate * 1000000000ull / samplerate;
+    struct timespec due = {
+        .tv_sec = s->start_mono.tv_sec + ns / 1000000000ull,
+        .tv_nsec = s->start_mono.tv_nsec + ns % 1000000000ull,
+    };
+    if (due.tv_nsec >= 1000000000) {
+        due.tv_sec++;
+        due.tv_nsec -= 1000000000;
+    }
+    while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due,
+                NULL)) {
+        continue;
+    }
+}
+
+
+/* Finds "key=" at the start of an option and returns what follows. */
+static const char *find_option(const char *options, const char *key) {
+    size_t len = strlen(key);
+    const char *p = options;
+    while (p != NULL && *p != '\0') {
+        if (0 == strncmp(p, key, len) && p[len] == '=') {
+            return p + len + 1;
+        }
+        p = strchr(p, ',');
+        if (p != NULL) {
+            p++;
         }
     }
-    fprintf(stderr, "%s driver not found!\n", driver_name);
-    exit(1);
     return NULL;
 }
 
 
-static struct sr_dev_inst *get_device(struct sr_dev_driver *driver) {
-    GSList* dev_list = sr_driver_scan(driver, NULL);
-    if (dev_list == NULL) {
-        fprintf(stderr, "No devices found\n");
+bool capture_option_str(const char *options, const char *key, char *value,
+        size_t size) {
+    const char *p = find_option(options, key);
+    if (p == NULL) {
+        return false;
+    }
+    size_t len = strcspn(p, ",");
+    if (len >= size) {
+        fprintf(stderr, "\ncapture option %s is too long\n", key);
         exit(1);
-        return NULL;
     }
+    memcpy(value, p, len);
+    value[len] = '\0';
+    return true;
+}
 
-    struct sr_dev_inst *dev;
-    dev = dev_list->data;
 
-    g_slist_free(dev_list);
-    return dev;
+/* Accepts a k, M or G suffix, so that rates read like "50M". */
+uint64_t capture_option_u64(const char *options, const char *key,
+        uint64_t fallback) {
+    const char *p = find_option(options, key);
+    if (p == NULL) {
+        return fallback;
+    }
+    char *end;
+    uint64_t value = strtoull(p, &end, 0);
+    switch (*end) {
+        case 'k': value *= 1000; end++; break;
+        case 'M': value *= 1000000; end++; break;
+        case 'G': value *= 1000000000; end++; break;
+    }
+    if (end == p || (*end != '\0' && *end != ',')) {
+        fprintf(stderr, "\ncapture option %s is not a number\n", key);
+        exit(1);
+    }
+    return value;
 }
 
 
-static void on_session_stopped(void *data) {
-    struct state *s = data;
-    UNUSED(s);
-    fprintf(stderr, "\033[1;36m");
-    fprintf(stderr, "session stopped\n");
-    fprintf(stderr, "\033[0m");
+void capture_usage() {
+    fprintf(stderr, "sources:\n");
+    for (size_t i = 0; i < BACKENDS_COUNT; i++) {
+        fprintf(stderr, "  %s\n", backends[i]->help);
+    }
 }
 
 
-#define ON_LOGIC_FRAME(FUNCTION_NAME, DATA_T)                                 \
-static void FUNCTION_NAME(struct state *s, const DATA_T *data,                \
-        uint64_t length, DATA_T mask) {                                       \
-    uint64_t diffs = 0;                                                       \
-    DATA_T prev = (DATA_T) s->prev;                                           \
-    uint64_t idx = s->idx;                                                    \
-    uint64_t count = length / 2;                                              \
-    uint64_t i;                                                               \
-    for (i = 0; i < count; i++) {                                             \
-        DATA_T unit = data[i];                                                \
-        if (unit != prev && (unit & mask) != prev) {                          \
-            double time = idx + i;                                            \
-            time /= SAMPLERATE;                                               \
-            on_capture_change(time, prev, unit);                              \
-            diffs++;                                                          \
-            prev = unit;                                                      \
-        }                                                                     \
-    }                                                                         \
-    s->prev = prev;                                                           \
-    s->idx = idx + i;                                                         \
-                                                                              \
-    if (diffs != 0) {                                                         \
-        fprintf(stderr, "\033[1;34m");                                        \
-        fprintf(stderr, "--- diffs: %lu.\n", diffs);                          \
-        fprintf(stderr, "\033[0m");                                           \
-    }                                                                         \
-                                                                              \
-}                                                                             \
+uint64_t capture_samplerate() {
+    return device_samplerate(&state.devices[0]);
+}
+
+
+unsigned int capture_channels() {
+    const capture_device_t *last = &state.devices[state.count - 1];
+    return state.count > 1 ? last->shift + last->width : last->width;
+}
 
-ON_LOGIC_FRAME(on_logic_frame_8, uint8_t)
-ON_LOGIC_FRAME(on_logic_frame_16, uint16_t)
-ON_LOGIC_FRAME(on_logic_frame_32, uint32_t)
 
-static void on_session_datafeed(const struct sr_dev_inst *dev,
-                         const struct sr_datafeed_packet *packet, void *data) {
-    UNUSED(dev);
-    uint16_t type = packet->type;
-    struct state *s = data;
-
-    switch (type) {
-
-        case SR_DF_HEADER: {
-            const struct sr_datafeed_header *payload;
-            payload = packet->payload;
-            fprintf(stderr, "\033[1;33m");
-            fprintf(stderr, "Received datafeed header.\n");
-            fprintf(stderr, "\033[0m");
-            UNUSED(payload);
-        } break;
-
-        case SR_DF_ANALOG: {
-            const struct sr_datafeed_analog *payload;
-            payload = packet->payload;
-            double *payload_data = payload->data;
-            UNUSED(payload_data);
-            unsigned int payload_count = payload->num_samples;
-            fprintf(stderr, "\033[1;33m");
-            fprintf(stderr, "Received %d analog samples.\n", payload_count);
-            fprintf(stderr, "\033[0m");
-        } break;
-
-        case SR_DF_LOGIC: {
-            const struct sr_datafeed_logic *payload;
-            payload = packet->payload;
-            uint64_t length = payload->length;
-            uint16_t unitsize = payload->unitsize;
-            if (unitsize == 1) {
-                uint8_t *data = (uint8_t *) payload->data;
-                on_logic_frame_8(s, data, length, 0xff);
-            } else if (unitsize == 2) {
-                uint16_t *data = (uint16_t *) payload->data;
-                on_logic_frame_16(s, data, length, 0xffff);
-            } else if (unitsize == 4) {
-                uint32_t *data = (uint32_t *) payload->data;
-                on_logic_frame_32(s, data, length, 0xffffffff);
-            } else {
-                fprintf(stderr, "\033[1;33m");
-                fprintf(stderr, "Received datafeed size %u.\n", unitsize);
-                fprintf(stderr, "\033[0m");
-            }
-
-        } break;
-
-        case SR_DF_END: {
-            fprintf(stderr, "\033[1;33m");
-            fprintf(stderr, "Received datafeed end.\n");
-        } break;
-
-        default:
-            fprintf(stderr, "unknown datafeed type %d\n", type);
+uint64_t capture_start_ns() {
+    return state.start_ns;
+}
 
+
+void capture_select(uint64_t channels) {
+    for (size_t i = 0; i < state.count; i++) {
+        capture_device_t *d = &state.devices[i];
+        uint64_t own = channels;
+        if (state.count > 1) {
+            own = (channels >> d->shift)
+                & (d->width < 64 ? (1ull << d->width) - 1 : UINT64_MAX);
+        }
+        if (d->backend->select != NULL) {
+            d->backend->select(d->self, own);
+        }
     }
 }
 
 
 bool capture_stop() {
-    struct state *s = &state;
-    if (s->running) {
-        s->running = false;
-        fprintf(stderr, "Trying to shut down session cleanly...\n");
-        assert_sr(sr_session_stop(s->session), "stopping session");
-        return true;
-    } else {
-        return false;
+    bool stopped = false;
+    for (size_t i = 0; i < state.count; i++) {
+        capture_device_t *d = &state.devices[i];
+        stopped |= d->backend->stop(d->self);
     }
+    return stopped;
 }
 
 
-void capture_init() {
-    int ret;
-    struct sr_channel **channels;
-    struct state *s = &state;
-    GVariant *gvar;
-
-    s->context = NULL;
-    s->session = NULL;
-    s->driver = NULL;
-    s->device = NULL;
+static void init_device(capture_device_t *d, const char *source) {
+    const char *name = source != NULL ? source : backends[0]->name;
+    size_t len = strcspn(name, ":");
 
-    assert_sr(sr_init(&s->context), "initializing libsigrok");
+    memset(d, 0, sizeof(*d));
+    for (size_t i = 0; i < BACKENDS_COUNT; i++) {
+        if (strlen(backends[i]->name) == len
+                && 0 == strncmp(backends[i]->name, name, len)) {
+            d->backend = backends[i];
+        }
+    }
+    if (d->backend == NULL) {
+        fprintf(stderr, "\nunknown capture source %.*s\n", (int) len, name);
+        capture_usage();
+        exit(1);
+    }
+    d->options = strdup(name[len] == ':' ? name + len + 1 : "");
+    if (d->options == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    log_msg(LOG_INFO, "Capturing from %s", d->backend->name);
+    d->self = d->backend->init(d->options);
+    d->width = d->backend->channels(d->self);
+}
 
-    //s->driver = get_driver("fx2lafw", s->context);
-    s->driver = get_driver("saleae-logic-pro", s->context);
-    enumerate_device_options("Driver", s->driver, NULL, NULL);
 
-    s->device = get_device(s->driver);
-    enumerate_device_options("Device", s->driver, s->device, NULL);
-    assert_sr(sr_dev_open(s->device), "opening device");
+/* Several devices: lays their channels side by side on the bus. */
+static void init_bus() {
+    unsigned int shift[CAPTURE_DEVICES_MAX];
+    unsigned int width[CAPTURE_DEVICES_MAX];
+    unsigned int channels = 0;
 
-    uint16_t channels_mask = 0x0aaa;
-    channels = get_device_channels(s->device, &s->num_channels);
-    for (unsigned int i = 0; i < s->num_channels; i++) {
-        if ((channels_mask >> i) & 1) {
-            assert_sr(sr_dev_channel_enable(channels[i], true), "enabling channel");
-        } else {
-            assert_sr(sr_dev_channel_enable(channels[i], false), "disabling channel");
+    for (size_t i = 0; i < state.count; i++) {
+        capture_device_t *d = &state.devices[i];
+        if (d->width == 0 || d->width > 64 - channels) {
+            fprintf(stderr, "\ncapture devices have more than 64 channels\n");
+            exit(1);
         }
+        d->shift = shift[i] = channels;
+        width[i] = d->width;
+        channels += d->width;
+        log_msg(LOG_INFO, "Device %zu: %s, channels %u to %u of the bus at "
+                "%lu Hz", i, d->backend->name, d->shift,
+                d->shift + d->width - 1, device_samplerate(d));
     }
+    merge_init(state.count, shift, width);
+}
 
-    gvar = g_variant_new_uint64(SAMPLERATE);
-    ret = sr_config_set(s->device, NULL, SR_CONF_SAMPLERATE, gvar);
-    assert_sr(ret, "setting samplerate");
-    g_variant_unref(gvar);
 
-    assert_sr(sr_session_new(s->context, &s->session), "creating session");
-    assert_sr(sr_session_dev_add(s->session, s->device),
-            "adding device to session");
+void capture_init(const char *const *sources, size_t count,
+        unsigned int workers) {
+    struct state *s = &state;
 
-    ret = sr_session_datafeed_callback_add(s->session, on_session_datafeed, s);
-    assert_sr(ret, "adding callback for session datafeed");
+    edges_init();
+    s->count = count > 0 ? count : 1;
+    for (size_t i = 0; i < s->count; i++) {
+        init_device(&s->devices[i], count > 0 ? sources[i] : NULL);
+    }
+    if (s->count > 1) {
+        init_bus();
+        if (workers > 0) {
+            log_msg(LOG_WARN, "With several devices, each detects its edges "
+                    "on its own thread: -j is ignored.");
+            workers = 0;
+        }
+    }
+    pipeline.workers = workers;
+}
 
-    ret = sr_session_stopped_callback_set(s->session, on_session_stopped, s);
-    assert_sr(ret, "setting callback for session stopped");
 
-    s->running = false;
+static void *device_task(void *param) {
+    capture_device_t *d = param;
+    current = d;
+    d->backend->run(d->self);
+    merge_finish(d - state.devices);
+    return NULL;
 }
 
 
 void capture_run() {
     struct state *s = &state;
 
-    s->running = true;
-    fprintf(stderr, "Session starting.\n");
-    assert_sr(sr_session_start(s->session), "starting session");
-    assert_sr(sr_session_run(s->session), "running session");
-    s->running = false;
-    fprintf(stderr, "Sigrok session finished.\n");
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    clock_gettime(CLOCK_MONOTONIC, &s->start_mono);
+    s->start_ns = now.tv_sec * 1000000000ull + now.tv_nsec;
+    for (size_t i = 0; i < s->count; i++) {
+        s->devices[i].idx = 0;
+        s->devices[i].prev = 0;
+    }
+
+    if (s->count == 1) {
+        current = &s->devices[0];
+        pipeline_start(pipeline.workers);
+        s->devices[0].backend->run(s->devices[0].self);
+        pipeline_stop();
+        current = NULL;
+        return;
+    }
+
+    for (size_t i = 0; i < s->count; i++) {
+        if (0 != pthread_create(&s->devices[i].thread, NULL, device_task,
+                    &s->devices[i])) {
+            fprintf(stderr, "\ncan't create capture device thread\n");
+            exit(1);
+        }
+    }
+    merge_run();
+    for (size_t i = 0; i < s->count; i++) {
+        pthread_join(s->devices[i].thread, NULL);
+    }
 }
 
 
 void capture_cleanup() {
     struct state *s = &state;
 
-    fprintf(stderr, "Sigrok shutting down...\n");
-    assert_sr(sr_session_destroy(s->session), "destroying session");
-    assert_sr(sr_dev_close(s->device), "closing device");
-    assert_sr(sr_exit(s->context), "shutting down libsigrok");
-    fprintf(stderr, "Sigrok successfully closed\n");
+    for (size_t i = 0; i < s->count; i++) {
+        capture_device_t *d = &s->devices[i];
+        d->backend->cleanup(d->self);
+        free(d->chunk.edges);
+        d->chunk.edges = NULL;
+        free(d->options);
+        d->options = NULL;
+    }
+    merge_cleanup();
 }
-
-
@@ -1,9 +1,84 @@
 #pragma once
 
-void capture_init();
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* A change of the sampled value, at absolute sample index `idx`. */
+typedef struct capture_edge {
+    uint64_t idx;
+    uint64_t value;
+} capture_edge_t;
+
+/* Devices captured at once, their channels side by side on one bus. */
+#define CAPTURE_DEVICES_MAX 8
+
+/* A source of logic samples.
+ *
+ * `init` returns an instance, passed back to every other call, so that a
+ * backend can drive several devices. `run` feeds every packet of samples
+ * to capture_logic, from the thread capture_run gives it, until the source
+ * is exhausted or `stop` is called. `stop` is called from a signal handler
+ * and returns false if the source was not running. `options` is the part
+ * of the source spec after the colon, a comma-separated list of key=value
+ * pairs read with capture_option_*. `channels` is the number of channels
+ * in a sample. `select`, if set, is told from another thread which of them
+ * have consumers, and may stop streaming the others.
+ */
+typedef struct capture_backend {
+    const char *name;
+    const char *help;
+    void *(*init)(const char *options);
+    void (*run)(void *self);
+    bool (*stop)(void *self);
+    void (*cleanup)(void *self);
+    uint64_t (*samplerate)(void *self);
+    unsigned int (*channels)(void *self);
+    void (*select)(void *self, uint64_t channels);
+} capture_backend_t;
+
+extern const capture_backend_t capture_sigrok;
+extern const capture_backend_t capture_replay;
+extern const capture_backend_t capture_synthetic;
+
+/* Every source is "backend[:options]"; without any, the default backend is
+ * used. With one source and `workers` > 0, edge detection runs on that
+ * many threads and the fanout on another one; otherwise everything runs on
+ * the backend's thread. With several sources, each runs and detects its
+ * edges on a thread of its own, and their edges are merged into one stream
+ * on the calling thread (see merge.h): the channels of the first source
+ * come first on the bus, and sample indices count at its rate. */
+void capture_init(const char *const *sources, size_t count,
+        unsigned int workers);
 void capture_run();
 bool capture_stop();
 void capture_cleanup();
-extern void on_capture_change(double time, uint64_t prev, uint64_t value);
+void capture_usage();
+/* Tells the source which channels someone consumes; a bit per channel. */
+void capture_select(uint64_t channels);
+uint64_t capture_samplerate();
+/* Channels of a sample, or of the bus of several devices. */
+unsigned int capture_channels();
+/* CLOCK_REALTIME of sample index 0, in nanoseconds. */
+uint64_t capture_start_ns();
 
+/* For backends: feeds `length` bytes of samples of `unitsize` bytes. These
+ * calls count for the device whose `run` is on the calling thread. */
+void capture_logic(const void *data, uint64_t length, unsigned int unitsize);
+/* For backends: counts a packet that carried no logic samples. */
+void capture_drop();
+/* For backends: after a pause in streaming, moves the sample index on to
+ * the current time, so that timestamps stay on the wall clock. */
+void capture_resume();
+/* For backends: sleeps until sample `idx` is due in real time. */
+void capture_pace(uint64_t idx);
+bool capture_option_str(const char *options, const char *key, char *value,
+        size_t size);
+uint64_t capture_option_u64(const char *options, const char *key,
+        uint64_t fallback);
 
+/* Called with all the edges of a run of samples, in sample order, always
+ * from the same thread, even for a run without edges. `prev` is the value
+ * before edges[0] and `end` the index after the last sample of the run. */
+extern void on_capture_edges(const capture_edge_t *edges, size_t count,
+        uint64_t prev, uint64_t end);
@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "capture.h"
+#include "srzip.h"
+#include "log.h"
+
+#define REPLAY_SAMPLERATE 1000000
+#define REPLAY_UNITSIZE 2
+#define REPLAY_PACKET 65536
+
+
+typedef struct replay {
+    char path[4096];
+    uint64_t samplerate;
+    unsigned int unitsize;
+    uint64_t packet;
+    bool pace;
+    uint64_t idx;
+    /* Raw dumps are mapped whole; .sr archives are read a member at a time. */
+    const uint8_t *map;
+    size_t size;
+    srzip_t *zip;
+    char capturefile[256];
+    unsigned int channels;
+    _Atomic bool running;
+} replay_t;
+
+
+/* Reads `key` from the first device section of an .sr metadata file. */
+static bool metadata_get(const char *metadata, const char *key, char *value,
+        size_t size) {
+    size_t len = strlen(key);
+    const char *line = strstr(metadata, "[device 1]");
+    while (line != NULL && *line != '\0') {
+        line += strspn(line, "\r\n");
+        if (0 == strncmp(line, key, len) && line[len] == '=') {
+            const char *p = line + len + 1;
+            size_t n = strcspn(p, "\r\n");
+            if (n >= size) {
+                return false;
+            }
+            memcpy(value, p, n);
+            value[n] = '\0';
+            return true;
+        }
+        line = strpbrk(line, "\r\n");
+    }
+    return false;
+}
+
+
+/* sigrok writes rates like "1 MHz". */
+static uint64_t parse_samplerate(const char *value) {
+    char *unit;
+    double rate = strtod(value, &unit);
+    unit += strspn(unit, " ");
+    if (unit[0] == 'k') {
+        rate *= 1e3;
+    } else if (unit[0] == 'M') {
+        rate *= 1e6;
+    } else if (unit[0] == 'G') {
+        rate *= 1e9;
+    }
+    return rate;
+}
+
+
+static void open_sr(replay_t *replay) {
+    replay->zip = srzip_open(replay->path);
+    if (replay->zip == NULL) {
+        exit(1);
+    }
+    size_t size;
+    char *metadata = srzip_read(replay->zip, "metadata", &size);
+    if (metadata == NULL) {
+        fprintf(stderr, "\n%s has no sigrok metadata\n", replay->path);
+        exit(1);
+    }
+    metadata = realloc(metadata, size + 1);
+    if (metadata == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    metadata[size] = '\0';
+
+    char value[64];
+    if (metadata_get(metadata, "samplerate", value, sizeof(value))) {
+        replay->samplerate = parse_samplerate(value);
+    }
+    if (metadata_get(metadata, "unitsize", value, sizeof(value))) {
+        replay->unitsize = strtoul(value, NULL, 10);
+    }
+    if (metadata_get(metadata, "total probes", value, sizeof(value))) {
+        replay->channels = strtoul(value, NULL, 10);
+    }
+    if (!metadata_get(metadata, "capturefile", replay->capturefile,
+                sizeof(replay->capturefile))) {
+        fprintf(stderr, "\n%s has no logic data\n", replay->path);
+        exit(1);
+    }
+    free(metadata);
+}
+
+
+static void open_raw(replay_t *replay) {
+    int fd = open(replay->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("open failed");
+        exit(1);
+    }
+    struct stat st;
+    if (0 != fstat(fd, &st)) {
+        perror("fstat failed");
+        exit(1);
+    }
+    replay->size = st.st_size;
+    if (replay->size != 0) {
+        void *map = mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap failed");
+            exit(1);
+        }
+        madvise(map, replay->size, MADV_SEQUENTIAL);
+        replay->map = map;
+    }
+    close(fd);
+}
+
+
+static bool is_zip(const char *path) {
+    char magic[4] = { 0 };
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror("fopen failed");
+        exit(1);
+    }
+    size_t n = fread(magic, 1, sizeof(magic), f);
+    fclose(f);
+    return n == sizeof(magic) && 0 == memcmp(magic, "PK\003\004", 4);
+}
+
+
+/* Feeds `size` bytes of samples in packets of replay->packet samples. */
+static void feed(replay_t *replay, const uint8_t *data, size_t size) {
+    size_t packet = replay->packet * replay->unitsize;
+    size_t pos = 0;
+    while (pos < size && atomic_load(&replay->running)) {
+        size_t n = size - pos < packet ? size - pos : packet;
+        replay->idx += n / replay->unitsize;
+        if (replay->pace) {
+            capture_pace(replay->idx);
+        }
+        capture_logic(data + pos, n, replay->unitsize);
+        pos += n;
+    }
+}
+
+
+static uint64_t replay_samplerate(void *self) {
+    replay_t *replay = self;
+    return replay->samplerate;
+}
+
+
+static unsigned int replay_channels(void *self) {
+    replay_t *replay = self;
+    if (replay->channels != 0) {
+        return replay->channels;
+    }
+    return replay->unitsize < 8 ? 8 * replay->unitsize : 64;
+}
+
+
+static bool replay_stop(void *self) {
+    replay_t *replay = self;
+    return atomic_exchange(&replay->running, false);
+}
+
+
+static void *replay_init(const char *options) {
+    replay_t *replay = calloc(1, sizeof(*replay));
+    if (replay == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if (!capture_option_str(options, "file", replay->path,
+                sizeof(replay->path))) {
+        fprintf(stderr, "\nreplay source needs a file\n");
+        exit(1);
+    }
+    replay->samplerate = capture_option_u64(options, "rate", REPLAY_SAMPLERATE);
+    replay->unitsize = capture_option_u64(options, "unitsize", REPLAY_UNITSIZE);
+    replay->packet = capture_option_u64(options, "packet", REPLAY_PACKET);
+    replay->pace = capture_option_u64(options, "pace", 0) != 0;
+
+    if (is_zip(replay->path)) {
+        open_sr(replay);
+    } else {
+        open_raw(replay);
+    }
+    if (replay->samplerate == 0 || replay->unitsize == 0
+            || replay->packet == 0) {
+        fprintf(stderr, "\nreplay rate, unitsize and packet must be "
+                "positive\n");
+        exit(1);
+    }
+    log_msg(LOG_INFO, "Replaying %s: %u-byte samples at %lu Hz%s",
+            replay->path, replay->unitsize, replay->samplerate,
+            replay->pace ? ", in real time" : "");
+    return replay;
+}
+
+
+static void replay_run(void *self) {
+    replay_t *replay = self;
+    replay->idx = 0;
+    atomic_store(&replay->running, true);
+    if (replay->zip == NULL) {
+        feed(replay, replay->map,
+                replay->size - replay->size % replay->unitsize);
+    } else {
+        /* Older archives keep everything in a single unnumbered member. */
+        char name[sizeof(replay->capturefile) + 16];
+        for (unsigned int i = 1; atomic_load(&replay->running); i++) {
+            size_t size;
+            snprintf(name, sizeof(name), "%s-%u", replay->capturefile, i);
+            uint8_t *data = srzip_read(replay->zip, name, &size);
+            if (data == NULL && i == 1) {
+                data = srzip_read(replay->zip, replay->capturefile, &size);
+            }
+            if (data == NULL) {
+                break;
+            }
+            feed(replay, data, size - size % replay->unitsize);
+            free(data);
+        }
+    }
+    atomic_store(&replay->running, false);
+    log_msg(LOG_INFO, "Replay finished after %lu samples", replay->idx);
+}
+
+
+static void replay_cleanup(void *self) {
+    replay_t *replay = self;
+    if (replay->map != NULL) {
+        munmap((void *) replay->map, replay->size);
+    }
+    srzip_close(replay->zip);
+    free(replay);
+}
+
+
+const capture_backend_t capture_replay = {
+    .name = "replay",
+    .help = "replay:file=PATH[,pace=0,rate=1M,unitsize=2,packet=65536] "
+        "(rate and unitsize of raw dumps; .sr files carry their own)",
+    .init = replay_init,
+    .run = replay_run,
+    .stop = replay_stop,
+    .cleanup = replay_cleanup,
+    .samplerate = replay_samplerate,
+    .channels = replay_channels,
+};
@@ -0,0 +1,488 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <gmodule.h>
+#include <libsigrok/libsigrok.h>
+#include "capture.h"
+#include "log.h"
+
+#define UNUSED(x) (void)(x)
+
+
+typedef struct state {
+    struct sr_dev_driver *driver;
+    struct sr_dev_inst *device;
+    struct sr_session *session;
+    struct sr_channel **channels;
+    unsigned int num_channels;
+    uint64_t samplerate;
+    /* Channels that may be enabled, from the channels option. */
+    uint64_t available;
+    /* Channels with consumers, and those the session was started with. */
+    _Atomic uint64_t wanted;
+    uint64_t enabled;
+    /* Wakes sigrok_run while no channel is wanted. */
+    int wake_fd;
+    volatile bool running;
+    volatile bool streaming;
+} state_t;
+
+#define SIGROK_DRIVERS_MAX 8
+
+/* Shared by every sigrok source: a driver is initialized and scanned once,
+ * and each source opens one of the devices it found. */
+static struct {
+    struct sr_context *context;
+    unsigned int users;
+    size_t count;
+    struct {
+        struct sr_dev_driver *driver;
+        GSList *devices;
+    } drivers[SIGROK_DRIVERS_MAX];
+} sigrok;
+
+#define SIGROK_DRIVER "saleae-logic-pro"
+#define SIGROK_SAMPLERATE 50000000
+#define SIGROK_CHANNELS 0x0aaa
+
+#define SR_ERROR_CHECK(x) do {                                          \
+        int __err_rc = (x);                                             \
+        if (__err_rc != SR_OK) {                                        \
+        fprintf(stderr, "\033[1;31m");                                  \
+            fprintf(stderr, "Sigrok error %s @ %s:%d.\n",               \
+                    sr_strerror_name(__err_rc), __FILE__, __LINE__);    \
+        fprintf(stderr, "\033[0m");                                     \
+        }                                                               \
+        exit(1);                                                        \
+    } while(0)
+
+
+static int assert_sr(int ret, const char *string) {
+    if (ret != SR_OK) {
+    fprintf(stderr, "\033[1;31m");
+        fprintf(stderr, "Error %s (%s): %s.\n", string, sr_strerror_name(ret),
+                sr_strerror(ret));
+    fprintf(stderr, "\033[0m");
+        exit(1);
+    }
+    return ret;
+}
+
+
+static const char *configkey_tostring(int option) {
+    const char *option_name;
+    switch (option) {
+        case SR_CONF_LOGIC_ANALYZER:
+            option_name = "Logic Analyzer"; break;
+        case SR_CONF_OSCILLOSCOPE:
+            option_name = "Oscilloscope"; break;
+        case SR_CONF_CONN:
+            option_name = "Connection"; break;
+        case SR_CONF_SAMPLERATE:
+            option_name = "Sample Rate"; break;
+        case SR_CONF_VDIV:
+            option_name = "Volts/Div"; break;
+        case SR_CONF_COUPLING:
+            option_name = "Coupling"; break;
+        case SR_CONF_NUM_VDIV:
+            option_name = "Number of Vertical Divisions"; break;
+        case SR_CONF_LIMIT_MSEC:
+            option_name = "Sample Time Limit (ms)"; break;
+        case SR_CONF_LIMIT_SAMPLES:
+            option_name = "Sample Number Limit"; break;
+        case SR_CONF_LIMIT_FRAMES:
+            option_name = "Frames Number Limit"; break;
+        case SR_CONF_CONTINUOUS:
+            option_name = "Continuous"; break;
+        default: option_name = NULL;
+    }
+    return option_name;
+}
+
+
+static void enumerate_device_options(const char *name, struct sr_dev_driver *driver,
+        struct sr_dev_inst *dev, struct sr_channel_group *chgroup) {
+    GVariant *gvar;
+    int res;
+    GArray *options_list;
+
+    options_list= sr_dev_options(driver, dev, chgroup);
+
+    if (options_list == NULL) {
+        fprintf(stderr, "\033[1;31m");
+        fprintf(stderr, "Error getting options list from %s!\n", name);
+        fprintf(stderr, "\033[0m");
+        exit(1);
+    }
+
+    for (guint i = 0; i < options_list->len; i++) {
+        uint32_t option = g_array_index(options_list, uint32_t, i);
+        const char *option_name = configkey_tostring(option);
+
+        if (option_name == NULL) {
+            log_msg(LOG_DEBUG, "%s option %u available", name, option);
+        } else {
+            log_msg(LOG_DEBUG, "%s option %u available: %s", name, option, option_name);
+        }
+
+        res = sr_config_get(driver, dev, chgroup, option, &gvar);
+        if (res == SR_OK) {
+            gchar *value = g_variant_print(gvar, TRUE);
+            log_msg(LOG_DEBUG, "value is %s", value);
+            free(value);
+        }
+
+        res = sr_config_list(driver, dev, chgroup, option, &gvar);
+        if (res == SR_OK) {
+            gchar *value = g_variant_print(gvar, TRUE);
+            log_msg(LOG_DEBUG, "list values are %s", value);
+            free(value);
+        }
+    }
+    g_array_free(options_list, TRUE);
+}
+
+
+static struct sr_channel** get_device_channels(struct sr_dev_inst *dev, unsigned int *num) {
+    GSList *ch_list;
+    struct sr_channel **channels;
+    if ((ch_list = sr_dev_inst_channels_get(dev)) == NULL) {
+        fprintf(stderr, "Error enumerating channels\n");
+        exit(1);
+    }
+
+    guint ch_count = g_slist_length(ch_list);
+    log_msg(LOG_INFO, "Found %d channels", ch_count);
+
+    channels = malloc((1 + ch_count) * sizeof(struct sr_channel *));
+    if (channels == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (guint i = 0; i < ch_count && ch_list != NULL; ch_list = ch_list->next) {
+        struct sr_channel *channel;
+        channel = ch_list->data;
+        channels[i++] = channel;
+    }
+    channels[ch_count] = NULL;
+    num[0] = ch_count;
+    return channels;
+}
+
+
+static struct sr_dev_driver *get_driver(const char *driver_name,
+        struct sr_context *sr_ctx) {
+    struct sr_dev_driver** drivers;
+    struct sr_dev_driver* driver = NULL;
+    drivers = sr_driver_list(sr_ctx);
+    if (drivers == NULL) {
+        fprintf(stderr, "No drivers found!\n");
+        exit(1);
+        return NULL;
+    }
+
+    for (int i = 0; drivers[i] != NULL; i++) {
+        driver = drivers[i];
+        if (0 == strcmp(driver->name, driver_name)) {
+            int r = sr_driver_init(sr_ctx, driver);
+            if (r != SR_OK) {
+                fprintf(stderr, "Error initializing driver!\n");
+                exit(1);
+                return NULL;
+            }
+            
+            return driver;
+        }
+    }
+    fprintf(stderr, "%s driver not found!\n", driver_name);
+    exit(1);
+    return NULL;
+}
+
+
+/* The devices found by a driver, scanned the first time it is asked for. */
+static GSList *get_devices(const char *driver_name,
+        struct sr_dev_driver **driver) {
+    for (size_t i = 0; i < sigrok.count; i++) {
+        if (0 == strcmp(sigrok.drivers[i].driver->name, driver_name)) {
+            *driver = sigrok.drivers[i].driver;
+            return sigrok.drivers[i].devices;
+        }
+    }
+    if (sigrok.count == SIGROK_DRIVERS_MAX) {
+        fprintf(stderr, "Too many sigrok drivers\n");
+        exit(1);
+    }
+    *driver = get_driver(driver_name, sigrok.context);
+    enumerate_device_options("Driver", *driver, NULL, NULL);
+    GSList *devices = sr_driver_scan(*driver, NULL);
+    log_msg(LOG_INFO, "%s found %u devices", driver_name,
+            g_slist_length(devices));
+    sigrok.drivers[sigrok.count].driver = *driver;
+    sigrok.drivers[sigrok.count].devices = devices;
+    sigrok.count++;
+    return devices;
+}
+
+
+static struct sr_dev_inst *get_device(GSList *devices, unsigned int index) {
+    struct sr_dev_inst *dev = g_slist_nth_data(devices, index);
+    if (dev == NULL) {
+        fprintf(stderr, "No device %u found\n", index);
+        exit(1);
+        return NULL;
+    }
+    return dev;
+}
+
+
+static void on_session_stopped(void *data) {
+    struct state *s = data;
+    UNUSED(s);
+    log_msg(LOG_INFO, "session stopped");
+}
+
+
+static void wake_run(struct state *s) {
+    uint64_t one = 1;
+    if (-1 == write(s->wake_fd, &one, sizeof(one)) && errno != EAGAIN) {
+        perror("eventfd write failed");
+    }
+}
+
+
+static void enable_channels(struct state *s, uint64_t channels_mask) {
+    for (unsigned int i = 0; i < s->num_channels; i++) {
+        bool enable = (channels_mask >> i) & 1;
+        assert_sr(sr_dev_channel_enable(s->channels[i], enable),
+                enable ? "enabling channel" : "disabling channel");
+    }
+    s->enabled = channels_mask;
+    log_msg(LOG_INFO, "Streaming channels %lx", channels_mask);
+}
+
+
+static void on_session_datafeed(const struct sr_dev_inst *dev,
+                         const struct sr_datafeed_packet *packet, void *data) {
+    UNUSED(dev);
+    uint16_t type = packet->type;
+    struct state *s = data;
+
+    /* Stopping from the session's own thread is always safe, so a new
+     * channel set takes effect on the next packet. */
+    if (s->streaming && (!s->running || atomic_load(&s->wanted) != s->enabled)) {
+        s->streaming = false;
+        sr_session_stop(s->session);
+    }
+
+    switch (type) {
+
+        case SR_DF_HEADER: {
+            const struct sr_datafeed_header *payload;
+            payload = packet->payload;
+            log_msg(LOG_INFO, "Received datafeed header.");
+            UNUSED(payload);
+        } break;
+
+        case SR_DF_ANALOG: {
+            const struct sr_datafeed_analog *payload;
+            payload = packet->payload;
+            double *payload_data = payload->data;
+            UNUSED(payload_data);
+            unsigned int payload_count = payload->num_samples;
+            capture_drop();
+            log_msg(LOG_DEBUG, "Received %d analog samples.", payload_count);
+        } break;
+
+        case SR_DF_LOGIC: {
+            const struct sr_datafeed_logic *payload;
+            payload = packet->payload;
+            capture_logic(payload->data, payload->length, payload->unitsize);
+        } break;
+
+        case SR_DF_END: {
+            log_msg(LOG_INFO, "Received datafeed end.");
+        } break;
+
+        default:
+            log_msg(LOG_WARN, "unknown datafeed type %d", type);
+
+    }
+}
+
+
+static uint64_t sigrok_samplerate(void *self) {
+    struct state *s = self;
+    return s->samplerate;
+}
+
+
+static unsigned int sigrok_channels(void *self) {
+    struct state *s = self;
+    return s->num_channels;
+}
+
+
+static bool sigrok_stop(void *self) {
+    struct state *s = self;
+    if (s->running) {
+        s->running = false;
+        fprintf(stderr, "Trying to shut down session cleanly...\n");
+        if (s->streaming) {
+            assert_sr(sr_session_stop(s->session), "stopping session");
+        }
+        wake_run(s);
+        return true;
+    } else {
+        return false;
+    }
+}
+
+
+/* Restarts the session with the union of the channels clients consume, or
+ * stops it while there are none; the device stays open meanwhile. */
+static void sigrok_select(void *self, uint64_t channels) {
+    struct state *s = self;
+    channels &= s->available;
+    if (atomic_exchange(&s->wanted, channels) != channels) {
+        wake_run(s);
+    }
+}
+
+
+static void *sigrok_init(const char *options) {
+    int ret;
+    struct state *s;
+    GVariant *gvar;
+    char driver[64] = SIGROK_DRIVER;
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    capture_option_str(options, "driver", driver, sizeof(driver));
+    s->samplerate = capture_option_u64(options, "rate", SIGROK_SAMPLERATE);
+    unsigned int index = capture_option_u64(options, "device", 0);
+
+    if (sigrok.users++ == 0) {
+        assert_sr(sr_init(&sigrok.context), "initializing libsigrok");
+    }
+
+    s->device = get_device(get_devices(driver, &s->driver), index);
+    enumerate_device_options("Device", s->driver, s->device, NULL);
+    assert_sr(sr_dev_open(s->device), "opening device");
+
+    s->available = capture_option_u64(options, "channels", SIGROK_CHANNELS);
+    s->channels = get_device_channels(s->device, &s->num_channels);
+    atomic_init(&s->wanted, 0);
+    enable_channels(s, 0);
+    s->wake_fd = eventfd(0, 0);
+    if (-1 == s->wake_fd) {
+        perror("eventfd failed");
+        exit(1);
+    }
+
+    gvar = g_variant_new_uint64(s->samplerate);
+    ret = sr_config_set(s->device, NULL, SR_CONF_SAMPLERATE, gvar);
+    assert_sr(ret, "setting samplerate");
+    g_variant_unref(gvar);
+
+    assert_sr(sr_session_new(sigrok.context, &s->session),
+            "creating session");
+    assert_sr(sr_session_dev_add(s->session, s->device),
+            "adding device to session");
+
+    ret = sr_session_datafeed_callback_add(s->session, on_session_datafeed, s);
+    assert_sr(ret, "adding callback for session datafeed");
+
+    ret = sr_session_stopped_callback_set(s->session, on_session_stopped, s);
+    assert_sr(ret, "setting callback for session stopped");
+
+    s->running = false;
+    s->streaming = false;
+    return s;
+}
+
+
+static void sigrok_run(void *self) {
+    struct state *s = self;
+    bool paused = false;
+
+    s->running = true;
+    while (s->running) {
+        uint64_t wanted = atomic_load(&s->wanted);
+        if (wanted == 0) {
+            uint64_t wakeups;
+            if (!paused) {
+                log_msg(LOG_INFO, "No channels wanted, session idle.");
+                paused = true;
+            }
+            if (-1 == read(s->wake_fd, &wakeups, sizeof(wakeups))
+                    && errno != EINTR) {
+                perror("eventfd read failed");
+                exit(1);
+            }
+            continue;
+        }
+
+        enable_channels(s, wanted);
+        if (paused) {
+            capture_resume();
+        }
+        log_msg(LOG_INFO, "Session starting.");
+        s->streaming = true;
+        assert_sr(sr_session_start(s->session), "starting session");
+        assert_sr(sr_session_run(s->session), "running session");
+        if (s->streaming) {
+            /* The device ended the session on its own. */
+            break;
+        }
+        paused = true;
+    }
+    s->running = false;
+    s->streaming = false;
+    log_msg(LOG_INFO, "Sigrok session finished.");
+}
+
+
+static void sigrok_cleanup(void *self) {
+    struct state *s = self;
+
+    log_msg(LOG_INFO, "Sigrok shutting down...");
+    assert_sr(sr_session_destroy(s->session), "destroying session");
+    assert_sr(sr_dev_close(s->device), "closing device");
+    free(s->channels);
+    close(s->wake_fd);
+    free(s);
+    if (--sigrok.users == 0) {
+        for (size_t i = 0; i < sigrok.count; i++) {
+            g_slist_free(sigrok.drivers[i].devices);
+        }
+        sigrok.count = 0;
+        assert_sr(sr_exit(sigrok.context), "shutting down libsigrok");
+    }
+    log_msg(LOG_INFO, "Sigrok successfully closed");
+}
+
+
+const capture_backend_t capture_sigrok = {
+    .name = "sigrok",
+    .help = "sigrok[:driver=" SIGROK_DRIVER ",device=0,rate=50M,"
+        "channels=0x0aaa] (device: which of the driver's devices)",
+    .init = sigrok_init,
+    .run = sigrok_run,
+    .stop = sigrok_stop,
+    .cleanup = sigrok_cleanup,
+    .samplerate = sigrok_samplerate,
+    .channels = sigrok_channels,
+    .select = sigrok_select,
+};
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include "capture.h"
+#include "log.h"
+
+#define SYNTHETIC_SAMPLERATE 1000000
+#define SYNTHETIC_CHANNELS 16
+#define SYNTHETIC_GAP 1000
+#define SYNTHETIC_PACKET 65536
+
+
+typedef struct synthetic {
+    uint64_t samplerate;
+    unsigned int channels;
+    unsigned int unitsize;
+    uint64_t gap;
+    uint64_t packet;
+    uint64_t limit;
+    bool pace;
+    uint64_t rng;
+    uint8_t *buffer;
+    _Atomic bool running;
+} synthetic_t;
+
+
+/* xorshift64*: plenty for test patterns and much cheaper than rand(). */
+static uint64_t next_random(synthetic_t *syn) {
+    syn->rng ^= syn->rng >> 12;
+    syn->rng ^= syn->rng << 25;
+    syn->rng ^= syn->rng >> 27;
+    return syn->rng * 0x2545f4914f6cdd1dull;
+}
+
+
+/* Fills `count` samples, flipping one random channel every 1 to 2 * gap - 1
+ * samples. `until` is the distance to the next edge, carried between
+ * packets along with `value`. */
+#define FILL_SAMPLES(FUNCTION_NAME, DATA_T)                                   \
+static void FUNCTION_NAME(synthetic_t *syn, DATA_T *data, uint64_t count,     \
+        uint64_t *value, uint64_t *until) {                                   \
+    DATA_T v = (DATA_T) *value;                                               \
+    uint64_t left = *until;                                                   \
+    for (uint64_t i = 0; i < count; i++) {                                    \
+        if (left == 0) {                                                      \
+            v ^= (DATA_T) 1 << (next_random(syn) % syn->channels);            \
+            left = 1 + next_random(syn) % (2 * syn->gap - 1);                 \
+        }                                                                     \
+        data[i] = v;                                                          \
+        left--;                                                               \
+    }                                                                         \
+    *value = v;                                                               \
+    *until = left;                                                            \
+}                                                                             \
+
+FILL_SAMPLES(fill_samples_8, uint8_t)
+FILL_SAMPLES(fill_samples_16, uint16_t)
+FILL_SAMPLES(fill_samples_32, uint32_t)
+FILL_SAMPLES(fill_samples_64, uint64_t)
+
+
+static uint64_t synthetic_samplerate(void *self) {
+    synthetic_t *syn = self;
+    return syn->samplerate;
+}
+
+
+static unsigned int synthetic_channels(void *self) {
+    synthetic_t *syn = self;
+    return syn->channels;
+}
+
+
+static bool synthetic_stop(void *self) {
+    synthetic_t *syn = self;
+    return atomic_exchange(&syn->running, false);
+}
+
+
+static void *synthetic_init(const char *options) {
+    synthetic_t *syn = calloc(1, sizeof(*syn));
+    if (syn == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    syn->samplerate = capture_option_u64(options, "rate", SYNTHETIC_SAMPLERATE);
+    syn->channels = capture_option_u64(options, "channels", SYNTHETIC_CHANNELS);
+    syn->gap = capture_option_u64(options, "gap", SYNTHETIC_GAP);
+    syn->packet = capture_option_u64(options, "packet", SYNTHETIC_PACKET);
+    syn->limit = capture_option_u64(options, "samples", 0);
+    syn->pace = capture_option_u64(options, "pace", 1) != 0;
+    syn->rng = capture_option_u64(options, "seed", 1);
+
+    if (syn->channels == 0 || syn->channels > 64) {
+        fprintf(stderr, "\nsynthetic source supports 1 to 64 channels\n");
+        exit(1);
+    }
+    if (syn->samplerate == 0 || syn->gap == 0 || syn->packet == 0
+            || syn->rng == 0) {
+        fprintf(stderr, "\nsynthetic rate, gap, packet and seed must be "
+                "positive\n");
+        exit(1);
+    }
+    syn->unitsize = syn->channels <= 8 ? 1 : syn->channels <= 16 ? 2
+        : syn->channels <= 32 ? 4 : 8;
+    syn->buffer = malloc(syn->packet * syn->unitsize);
+    if (syn->buffer == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    log_msg(LOG_INFO, "Synthetic source: %u channels at %lu Hz, an edge "
+            "every %lu samples on average", syn->channels, syn->samplerate,
+            syn->gap);
+    return syn;
+}
+
+
+static void synthetic_run(void *self) {
+    synthetic_t *syn = self;
+    uint64_t value = 0;
+    uint64_t until = 0;
+    uint64_t idx = 0;
+
+    atomic_store(&syn->running, true);
+    while (atomic_load(&syn->running)
+            && (syn->limit == 0 || idx < syn->limit)) {
+        uint64_t count = syn->packet;
+        if (syn->limit != 0 && count > syn->limit - idx) {
+            count = syn->limit - idx;
+        }
+        if (syn->unitsize == 1) {
+            fill_samples_8(syn, (uint8_t *) syn->buffer, count, &value,
+                    &until);
+        } else if (syn->unitsize == 2) {
+            fill_samples_16(syn, (uint16_t *) syn->buffer, count, &value,
+                    &until);
+        } else if (syn->unitsize == 4) {
+            fill_samples_32(syn, (uint32_t *) syn->buffer, count, &value,
+                    &until);
+        } else {
+            fill_samples_64(syn, (uint64_t *) syn->buffer, count, &value,
+                    &until);
+        }
+        idx += count;
+        if (syn->pace) {
+            capture_pace(idx);
+        }
+        capture_logic(syn->buffer, count * syn->unitsize, syn->unitsize);
+    }
+    atomic_store(&syn->running, false);
+    log_msg(LOG_INFO, "Synthetic source finished after %lu samples", idx);
+}
+
+
+static void synthetic_cleanup(void *self) {
+    synthetic_t *syn = self;
+    free(syn->buffer);
+    free(syn);
+}
+
+
+const capture_backend_t capture_synthetic = {
+    .name = "synthetic",
+    .help = "synthetic[:channels=16,rate=1M,gap=1000,packet=65536,"
+        "samples=0,pace=1,seed=1]",
+    .init = synthetic_init,
+    .run = synthetic_run,
+    .stop = synthetic_stop,
+    .cleanup = synthetic_cleanup,
+    .samplerate = synthetic_samplerate,
+    .channels = synthetic_channels,
+};
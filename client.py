@@ -1,32 +1,434 @@
 #!/usr/bin/env python3
 
+import argparse
+import mmap
 import socket
 import sys
 import struct
+import time
 
 
-def main(argv):
-    if len(argv) > 1:
-        server_addr = argv[1]
-    else:
-        server_addr = './socket'
+PROTO_MAGIC = b"SMUX"
+PROTO_VERSION = 1
+ENCODINGS = {"legacy": 0, "raw": 1, "compact": 2}
+MSG_HELLO = 1
+MSG_SHM = 3
+MSG_POLICY = 4
+MSG_FILTER = 5
+MSG_BUCKETS = 6
+MSG_DECODE = 7
+MSG_TRIGGER = 8
+MSG_BACKFILL = 9
+MSG_SOCKET = 10
+MSG_TIMESTAMPS = 11
+FRAME_HELLO = 1
+FRAME_EDGES = 2
+FRAME_SHM = 3
+FRAME_GAP = 4
+FRAME_BUCKETS = 5
+FRAME_SYMBOLS = 6
+FRAME_TIMESTAMP = 7
+POLICIES = {"disconnect": 0, "grow": 1, "drop": 2, "coalesce": 3}
+GAP_REASONS = {1: "dropped", 2: "coalesced", 3: "history lacks"}
+SHM_MAGIC = 0x004d485358554d53
+SHM_RESERVED_OFFSET = 64
+SHM_HEAD_OFFSET = 128
 
-    if len(argv) > 2:
-        mask = int(argv[2], 0)
-    else:
-        mask = 0xffffffffffffffff
 
-    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
-    sock.connect(server_addr)
+def recv_exact(sock, length):
+    buf = b""
+    while len(buf) < length:
+        rcvd = sock.recv(length - len(buf))
+        if not rcvd:
+            return None
+        buf += rcvd
+    return buf
+
+
+def read_varint(data, pos):
+    value = 0
+    shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        if byte < 0x80:
+            return value, pos
+
+
+def scatter_bits(packed, mask):
+    value = 0
+    bit = 0
+    while mask:
+        lowest = mask & -mask
+        if packed & (1 << bit):
+            value |= lowest
+        bit += 1
+        mask ^= lowest
+    return value
+
+
+def print_edge(time, value):
+    print("%16.10f: %016x" % (time, value))
+
+
+def run_legacy(sock, mask):
     sock.send(struct.pack("<Q", mask))
 
     while 1:
-        rcvd = sock.recv(16)
-        if len(rcvd) != 16:
+        rcvd = recv_exact(sock, 16)
+        if rcvd is None:
             break
 
         time, value = struct.unpack("<dQ", rcvd)
-        print("%16.10f: %016x" % (time, value))
+        print_edge(time, value)
+
+
+def send_hello(sock, mask, encoding):
+    hello = struct.pack("<BBHIQ", PROTO_VERSION, encoding, 0, 0, mask)
+    sock.send(PROTO_MAGIC + struct.pack("<HH", MSG_HELLO, len(hello)) + hello)
+
+
+def send_policy(sock, policy, bucket, max_bytes):
+    msg = struct.pack("<BBHIQ", policy, 0, 0, bucket, max_bytes)
+    sock.send(struct.pack("<HH", MSG_POLICY, len(msg)) + msg)
+
+
+def send_filter(sock, channels, min_high, min_low, holdoff):
+    msg = struct.pack("<QIIII", channels, min_high, min_low, holdoff, 0)
+    sock.send(struct.pack("<HH", MSG_FILTER, len(msg)) + msg)
+
+
+def parse_filter(arg):
+    fields = [int(x, 0) for x in arg.split(":")]
+    if len(fields) == 2:
+        fields += [fields[1], 0]
+    if len(fields) == 3:
+        fields += [0]
+    if len(fields) != 4:
+        raise argparse.ArgumentTypeError("expected CHANNELS:HIGH[:LOW[:HOLDOFF]]")
+    return tuple(fields)
+
+
+DECODERS = {"uart": 1, "spi": 2, "i2c": 3}
+SYMBOL_KINDS = {1: "uart", 2: "spi", 3: "start", 4: "stop", 5: "address",
+                6: "data"}
+SYMBOL_FLAGS = {1: "framing", 2: "parity", 4: "nack"}
+
+
+def parse_decoder(arg):
+    name, *fields = arg.split(":")
+    lines = {"uart": 1, "spi": 4, "i2c": 2}.get(name)
+    if lines is None or len(fields) < min(lines, 3):
+        raise argparse.ArgumentTypeError(
+            "expected uart:RX:BAUD[:BITS[:FLAGS]], "
+            "spi:CLK:MOSI:MISO[:CS[:BITS[:FLAGS]]] or i2c:SCL:SDA")
+    channels = [0xff if x == "-" else int(x, 0) for x in fields[:lines]]
+    channels += [0xff] * (4 - len(channels))
+    rest = [int(x, 0) for x in fields[lines:]]
+    baud = rest.pop(0) if name == "uart" and rest else 0
+    bits = rest[0] if len(rest) > 0 else 0
+    flags = rest[1] if len(rest) > 1 else 0
+    return DECODERS[name], bytes(channels), bits, flags, baud
+
+
+def send_decoder(sock, decoder, channels, bits, flags, baud):
+    msg = struct.pack("<B4sBHII", decoder, channels, bits, flags, baud, 0)
+    sock.send(struct.pack("<HH", MSG_DECODE, len(msg)) + msg)
+
+
+def parse_trigger(arg):
+    """Stages separated by ',', each one conditions joined by '&': rN or fN
+    for a rise or fall of channel N, hN or lN for a level."""
+    stages = []
+    for text in arg.split(","):
+        mask = value = rising = falling = 0
+        for cond in text.split("&"):
+            cond = cond.strip()
+            if len(cond) < 2 or cond[0] not in "rfhl" or not cond[1:].isdigit():
+                raise argparse.ArgumentTypeError(
+                    "expected conditions like r3&h5, stages separated by ','")
+            bit = 1 << int(cond[1:])
+            if cond[0] == "r":
+                rising |= bit
+            elif cond[0] == "f":
+                falling |= bit
+            else:
+                mask |= bit
+                value |= bit if cond[0] == "h" else 0
+        stages.append((mask, value, rising, falling))
+    if len(stages) > 4:
+        raise argparse.ArgumentTypeError("at most 4 stages")
+    return stages
+
+
+def send_trigger(sock, stages, within, pre, post):
+    msg = struct.pack("<BBHIQQQ", len(stages), 0, 0, 0, within, pre, post)
+    for i in range(4):
+        msg += struct.pack("<QQQQ", *(stages[i] if i < len(stages)
+                                      else (0, 0, 0, 0)))
+    sock.send(struct.pack("<HH", MSG_TRIGGER, len(msg)) + msg)
+
+
+def print_symbol(samplerate, payload, pos):
+    idx, end, kind, flags, _, data, data2, _ = \
+        struct.unpack_from("<QQBBHIII", payload, pos)
+    text = "%16.10f: %-7s" % (idx / samplerate, SYMBOL_KINDS.get(kind, "?"))
+    if kind in (1, 5, 6):
+        text += " 0x%02x" % data
+    elif kind == 2:
+        text += " mosi 0x%02x miso 0x%02x" % (data, data2)
+    for bit, name in SYMBOL_FLAGS.items():
+        if flags & bit:
+            text += " " + name
+    print(text)
+
+
+def print_bucket(samplerate, payload, pos):
+    idx, width, channel, last, _, edges, high, min_pulse, max_pulse = \
+        struct.unpack_from("<QQBBHIQQQ", payload, pos)
+    print("%16.10f: channel %2d, %d edges, %5.1f%% high, pulses %d..%d, "
+          "ends %d" % (idx / samplerate, channel, edges, 100.0 * high / width,
+                       min_pulse, max_pulse, last))
+
+
+def run_framed(sock, mask, encoding, policy, filters, buckets, decoder,
+               trigger, backfill, sending, timestamps):
+    send_hello(sock, mask, encoding)
+    if policy is not None:
+        send_policy(sock, *policy)
+    for f in filters:
+        send_filter(sock, *f)
+    if buckets:
+        sock.send(struct.pack("<HHQ", MSG_BUCKETS, 8, buckets))
+    if decoder is not None:
+        send_decoder(sock, *decoder)
+    if trigger is not None:
+        send_trigger(sock, *trigger)
+    if sending is not None:
+        msg = struct.pack("<BBHIII", sending[0], 0, 0, sending[1], sending[2],
+                          0)
+        sock.send(struct.pack("<HH", MSG_SOCKET, len(msg)) + msg)
+    if backfill is not None:
+        msg = struct.pack("<QQ", *backfill)
+        sock.send(struct.pack("<HH", MSG_BACKFILL, len(msg)) + msg)
+    if timestamps:
+        msg = struct.pack("<BBHI", 1, 0, 0, 0)
+        sock.send(struct.pack("<HH", MSG_TIMESTAMPS, len(msg)) + msg)
+
+    while 1:
+        header = recv_exact(sock, 8)
+        if header is None:
+            break
+        frame_type, frame_encoding, length = struct.unpack("<HHI", header)
+        payload = recv_exact(sock, length)
+        if payload is None:
+            break
+
+        if frame_type == FRAME_HELLO:
+            version, encoding, _, _, samplerate, start_ns = \
+                struct.unpack("<BBHIQQ", payload)
+            print("protocol %d, encoding %d, %d Hz, started at %d ns"
+                  % (version, encoding, samplerate, start_ns), file=sys.stderr)
+
+        elif frame_type == FRAME_EDGES:
+            idx, samplerate, start_ns, frame_mask, count, _ = \
+                struct.unpack_from("<QQQQII", payload)
+            pos = 40
+            value_bytes = (bin(frame_mask).count("1") + 7) // 8
+            for _ in range(count):
+                if frame_encoding == ENCODINGS["raw"]:
+                    idx, value = struct.unpack_from("<QQ", payload, pos)
+                    pos += 16
+                else:
+                    delta, pos = read_varint(payload, pos)
+                    idx += delta
+                    packed = int.from_bytes(payload[pos:pos + value_bytes],
+                                            "little")
+                    pos += value_bytes
+                    value = scatter_bits(packed, frame_mask)
+                print_edge(idx / samplerate, value)
+
+        elif frame_type == FRAME_BUCKETS:
+            samplerate, _, count, _ = struct.unpack_from("<QQII", payload)
+            for i in range(count):
+                print_bucket(samplerate, payload, 24 + 48 * i)
+
+        elif frame_type == FRAME_SYMBOLS:
+            samplerate, _, count, _ = struct.unpack_from("<QQII", payload)
+            for i in range(count):
+                print_symbol(samplerate, payload, 24 + 32 * i)
+
+        elif frame_type == FRAME_TIMESTAMP:
+            idx, received_ns, queued_ns, sent_ns = \
+                struct.unpack("<QQQQ", payload)
+            now = time.time_ns()
+            if received_ns:
+                print("sample %d: %.0f us to queue, %.0f us to send, "
+                      "%.0f us to here" % (idx, (queued_ns - received_ns) / 1e3,
+                                           (sent_ns - queued_ns) / 1e3,
+                                           (now - sent_ns) / 1e3),
+                      file=sys.stderr)
+
+        elif frame_type == FRAME_GAP:
+            count, reason, _ = struct.unpack("<QII", payload)
+            print("%s %d %s" % (GAP_REASONS.get(reason, "lost"), count,
+                                "samples" if reason == 3 else "edges"),
+                  file=sys.stderr)
+
+
+def recv_shm_fd(sock):
+    buf = b""
+    fds = []
+    samplerate = 1
+    while 1:
+        while len(buf) >= 8:
+            frame_type, _, length = struct.unpack_from("<HHI", buf)
+            if len(buf) < 8 + length:
+                break
+            payload = buf[8:8 + length]
+            buf = buf[8 + length:]
+            if frame_type == FRAME_HELLO:
+                samplerate, = struct.unpack_from("<Q", payload, 8)
+            elif frame_type == FRAME_SHM:
+                size, head = struct.unpack("<QQ", payload)
+                return (fds[0] if fds else None), size, head, samplerate
+        rcvd, new_fds, _, _ = socket.recv_fds(sock, 4096, 1)
+        if not rcvd:
+            return None, 0, 0, samplerate
+        buf += rcvd
+        fds += new_fds
+
+
+def run_shm(sock, mask):
+    send_hello(sock, 0, ENCODINGS["raw"])
+    sock.send(struct.pack("<HH", MSG_SHM, 0))
+    fd, size, pos, samplerate = recv_shm_fd(sock)
+    if fd is None or size == 0:
+        print("shared memory is not available", file=sys.stderr)
+        return
+
+    ring = mmap.mmap(fd, size, prot=mmap.PROT_READ)
+    magic, _, slot_size, capacity, data_offset = \
+        struct.unpack_from("<QIIQQ", ring)
+    if magic != SHM_MAGIC:
+        print("bad shared memory magic", file=sys.stderr)
+        return
+
+    last = None
+    while 1:
+        head, = struct.unpack_from("<Q", ring, SHM_HEAD_OFFSET)
+        if head == pos:
+            time.sleep(0.001)
+            continue
+        edges = []
+        for p in range(pos, head):
+            offset = data_offset + (p % capacity) * slot_size
+            edges.append((p, ) + struct.unpack_from("<QQ", ring, offset))
+        reserved, = struct.unpack_from("<Q", ring, SHM_RESERVED_OFFSET)
+        oldest = reserved - capacity
+        if oldest > pos:
+            print("lost %d edges" % (oldest - pos), file=sys.stderr)
+            last = None
+        for p, idx, value in edges:
+            if p < oldest:
+                continue
+            if last is None or (last ^ value) & mask:
+                print_edge(idx / samplerate, value & mask)
+            last = value
+        pos = head
+
+
+def main(argv):
+    parser = argparse.ArgumentParser()
+    parser.add_argument("server_addr", nargs="?", default="./socket",
+                        help="socket path, or HOST:PORT for TCP")
+    parser.add_argument("mask", nargs="?", default="0xffffffffffffffff",
+                        type=lambda x: int(x, 0))
+    parser.add_argument("-e", "--encoding",
+                        choices=list(ENCODINGS.keys()) + ["shm"],
+                        default="legacy")
+    parser.add_argument("-p", "--policy", choices=POLICIES.keys(),
+                        help="what the server does when this client falls "
+                             "behind (framed encodings only)")
+    parser.add_argument("--bucket", type=int, default=0,
+                        help="coalesce bucket width in samples")
+    parser.add_argument("--max-bytes", type=int, default=0,
+                        help="buffer memory cap for the grow policy")
+    parser.add_argument("-f", "--filter", type=parse_filter, action="append",
+                        default=[], metavar="CHANNELS:HIGH[:LOW[:HOLDOFF]]",
+                        help="drop pulses shorter than HIGH (LOW) samples on "
+                             "CHANNELS and hold them for HOLDOFF samples "
+                             "after a change (framed encodings only)")
+    parser.add_argument("-b", "--buckets", type=int, default=0,
+                        metavar="WIDTH",
+                        help="receive per-channel statistics over buckets of "
+                             "WIDTH samples instead of edges (framed "
+                             "encodings only)")
+    parser.add_argument("-d", "--decode", type=parse_decoder,
+                        metavar="DECODER:CHANNELS...",
+                        help="receive symbols decoded from the channels, "
+                             "with uart:RX:BAUD[:BITS[:FLAGS]], "
+                             "spi:CLK:MOSI:MISO[:CS[:BITS[:FLAGS]]] or "
+                             "i2c:SCL:SDA; '-' skips an SPI line (framed "
+                             "encodings only)")
+    parser.add_argument("-t", "--trigger", type=parse_trigger,
+                        metavar="STAGE[,STAGE...]",
+                        help="only receive the edges matching the trigger "
+                             "stages in order, each one conditions like "
+                             "r3&h5: r/f for a rise or fall, h/l for a level "
+                             "of a channel (framed encodings only)")
+    parser.add_argument("--within", type=int, default=0,
+                        help="samples a trigger match may take")
+    parser.add_argument("--pre", type=int, default=0,
+                        help="samples of edges received before a match")
+    parser.add_argument("--post", type=int, default=0,
+                        help="samples of edges received after a match")
+    parser.add_argument("--from-sample", type=int, metavar="IDX",
+                        help="first receive the edges the server kept from "
+                             "this sample on (framed encodings only)")
+    parser.add_argument("--from-time", type=float, metavar="SECONDS",
+                        help="the same, from this many seconds ago")
+    parser.add_argument("--nodelay", action="store_true",
+                        help="over TCP, send every frame right away instead "
+                             "of in full segments")
+    parser.add_argument("--interval", type=int, default=0, metavar="US",
+                        help="have edges sent at most every US microseconds")
+    parser.add_argument("--batch", type=int, default=0, metavar="EDGES",
+                        help="...or as soon as this many are queued")
+    parser.add_argument("--timestamps", action="store_true",
+                        help="report how long edges took to get here, "
+                             "turning latency tracing on in the server")
+    args = parser.parse_args(argv[1:])
+
+    host, _, port = args.server_addr.rpartition(":")
+    if host and port.isdigit():
+        sock = socket.create_connection((host.strip("[]"), int(port)))
+    else:
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.connect(args.server_addr)
+
+    if args.encoding == "legacy":
+        run_legacy(sock, args.mask)
+    elif args.encoding == "shm":
+        run_shm(sock, args.mask)
+    else:
+        backfill = None
+        if args.from_sample is not None:
+            backfill = (args.from_sample, 0)
+        elif args.from_time is not None:
+            backfill = (0, time.time_ns() - int(args.from_time * 1e9))
+        policy = None
+        if args.policy is not None:
+            policy = (POLICIES[args.policy], args.bucket, args.max_bytes)
+        run_framed(sock, args.mask, ENCODINGS[args.encoding], policy,
+                   args.filter, args.buckets, args.decode,
+                   (args.trigger, args.within, args.pre, args.post)
+                   if args.trigger else None, backfill,
+                   (args.nodelay, args.interval, args.batch)
+                   if args.nodelay or args.interval or args.batch else None,
+                   args.timestamps)
 
     return 0
 
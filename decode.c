@@ -0,0 +1,312 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "decode.h"
+#include "log.h"
+
+/* Clients thread only. */
+static uint64_t next_generation = 1;
+
+static const char *decoder_names[PROTO_DECODE_COUNT] = {
+    [PROTO_DECODE_NONE] = "none",
+    [PROTO_DECODE_UART] = "uart",
+    [PROTO_DECODE_SPI] = "spi",
+    [PROTO_DECODE_I2C] = "i2c",
+};
+
+/* Lines each decoder needs; the others may be PROTO_DECODE_UNUSED. */
+static const unsigned int required_channels[PROTO_DECODE_COUNT] = {
+    [PROTO_DECODE_UART] = 1,
+    [PROTO_DECODE_SPI] = 1,
+    [PROTO_DECODE_I2C] = 2,
+};
+
+
+const char *decoder_name(proto_decoder_t type) {
+    if (type >= PROTO_DECODE_COUNT) {
+        return NULL;
+    }
+    return decoder_names[type];
+}
+
+
+decoder_config_t *decoder_config_new(const proto_decode_msg_t *msg,
+        uint64_t samplerate) {
+    if (msg->decoder == PROTO_DECODE_NONE || msg->decoder >= PROTO_DECODE_COUNT) {
+        log_msg(LOG_WARN, "Unknown decoder %u", msg->decoder);
+        return NULL;
+    }
+    unsigned int bits = msg->bits ? msg->bits : 8;
+    if (bits > 32) {
+        log_msg(LOG_WARN, "Can't decode %u-bit words", bits);
+        return NULL;
+    }
+
+    uint64_t mask = 0;
+    for (unsigned int i = 0; i < 4; i++) {
+        if (msg->channels[i] == PROTO_DECODE_UNUSED
+                && i >= required_channels[msg->decoder]) {
+            continue;
+        }
+        if (msg->channels[i] >= 64) {
+            log_msg(LOG_WARN, "Decoder channel %u is out of range",
+                    msg->channels[i]);
+            return NULL;
+        }
+        mask |= 1ull << msg->channels[i];
+    }
+
+    uint64_t bit_time = 0;
+    if (msg->decoder == PROTO_DECODE_UART) {
+        if (msg->baud == 0 || samplerate / msg->baud < 2) {
+            log_msg(LOG_WARN, "Can't decode %u baud at %lu samples/s",
+                    msg->baud, samplerate);
+            return NULL;
+        }
+        bit_time = samplerate * 256 / msg->baud;
+    }
+
+    decoder_config_t *config = malloc(sizeof(*config));
+    if (config == NULL) {
+        perror("Failed to allocate decoder");
+        exit(1);
+    }
+    config->generation = next_generation++;
+    config->type = msg->decoder;
+    memcpy(config->channels, msg->channels, sizeof(config->channels));
+    config->mask = mask;
+    config->bits = bits;
+    config->flags = msg->flags;
+    config->bit_time = bit_time;
+    return config;
+}
+
+
+void decoder_reset(decoder_t *d, const decoder_config_t *config) {
+    d->generation = config->generation;
+    d->started = false;
+    d->level = 0;
+    d->active = false;
+    d->address = false;
+    d->count = 0;
+    d->out_len = 0;
+}
+
+
+void decoder_free(decoder_t *d) {
+    free(d->out);
+    d->out = NULL;
+    d->out_len = d->out_cap = 0;
+}
+
+
+void decoder_start(decoder_t *d, uint64_t value) {
+    d->started = true;
+    d->level = value;
+}
+
+
+static void emit_symbol(decoder_t *d, uint8_t kind, uint64_t end) {
+    if (d->out_len == d->out_cap) {
+        size_t cap = d->out_cap ? 2 * d->out_cap : 64;
+        proto_symbol_t *out = realloc(d->out, cap * sizeof(out[0]));
+        if (out == NULL) {
+            perror("Failed to grow decoded symbols");
+            exit(1);
+        }
+        d->out = out;
+        d->out_cap = cap;
+    }
+    proto_symbol_t *s = &d->out[d->out_len++];
+    memset(s, 0, sizeof(*s));
+    s->idx = d->first;
+    s->end = end;
+    s->kind = kind;
+    s->flags = d->flags;
+    s->data = d->data;
+    s->data2 = d->data2;
+}
+
+
+static unsigned int line(uint64_t value, uint8_t channel) {
+    return channel < 64 ? (value >> channel) & 1 : 0;
+}
+
+
+static void begin_symbol(decoder_t *d, uint64_t idx) {
+    d->first = idx;
+    d->count = 0;
+    d->data = 0;
+    d->data2 = 0;
+    d->flags = 0;
+}
+
+
+/* Start bit, data bits, optional parity bit and stop bits, each sampled in
+ * its middle. */
+static void advance_uart(decoder_t *d, const decoder_config_t *config,
+        uint64_t end) {
+    unsigned int parity = config->flags
+        & (PROTO_DECODE_PARITY_ODD | PROTO_DECODE_PARITY_EVEN) ? 1 : 0;
+    unsigned int stop = config->flags & PROTO_DECODE_STOP_2 ? 2 : 1;
+    unsigned int total = 1 + config->bits + parity + stop;
+
+    while (d->active) {
+        uint64_t at = d->first + (2 * d->count + 1) * config->bit_time / 512;
+        if (at >= end) {
+            return;
+        }
+        unsigned int bit = line(d->level, config->channels[0]);
+        unsigned int k = d->count++;
+        if (k == 0) {
+            if (bit) {
+                /* A glitch, not a start bit. */
+                d->active = false;
+            }
+        } else if (k <= config->bits) {
+            d->data |= (uint32_t) bit << (k - 1);
+        } else if (parity && k == config->bits + 1) {
+            unsigned int ones = __builtin_popcount(d->data) + bit;
+            if ((config->flags & PROTO_DECODE_PARITY_ODD) ? !(ones & 1)
+                    : (ones & 1)) {
+                d->flags |= PROTO_SYMBOL_PARITY;
+            }
+        } else if (!bit) {
+            d->flags |= PROTO_SYMBOL_FRAMING;
+        }
+        if (d->count == total) {
+            emit_symbol(d, PROTO_SYMBOL_UART,
+                    d->first + total * config->bit_time / 256);
+            d->active = false;
+        }
+    }
+}
+
+
+static void push_uart(decoder_t *d, const decoder_config_t *config,
+        uint64_t idx, uint64_t old) {
+    uint8_t rx = config->channels[0];
+    if (!d->active && line(old, rx) && !line(d->level, rx)) {
+        begin_symbol(d, idx);
+        d->active = true;
+    }
+}
+
+
+/* Samples MOSI and MISO on the clock edge that CPOL and CPHA select, as
+ * they were just before it. Chip select, if used, frames the words. */
+static void push_spi(decoder_t *d, const decoder_config_t *config,
+        uint64_t idx, uint64_t old) {
+    uint8_t clk = config->channels[0];
+    uint8_t mosi = config->channels[1];
+    uint8_t miso = config->channels[2];
+    uint8_t cs = config->channels[3];
+
+    if (cs != PROTO_DECODE_UNUSED && line(old ^ d->level, cs)) {
+        if (d->count != 0) {
+            d->flags |= PROTO_SYMBOL_FRAMING;
+            emit_symbol(d, PROTO_SYMBOL_SPI, idx);
+        }
+        d->count = 0;
+    }
+    if (!line(old ^ d->level, clk)
+            || (cs != PROTO_DECODE_UNUSED && line(d->level, cs))) {
+        return;
+    }
+    bool cpol = config->flags & PROTO_DECODE_CPOL;
+    bool cpha = config->flags & PROTO_DECODE_CPHA;
+    if (line(d->level, clk) != (cpol == cpha)) {
+        return;
+    }
+
+    if (d->count == 0) {
+        begin_symbol(d, idx);
+    }
+    uint32_t out_bit = mosi != PROTO_DECODE_UNUSED ? line(old, mosi) : 0;
+    uint32_t in_bit = miso != PROTO_DECODE_UNUSED ? line(old, miso) : 0;
+    if (config->flags & PROTO_DECODE_LSB_FIRST) {
+        d->data |= out_bit << d->count;
+        d->data2 |= in_bit << d->count;
+    } else {
+        d->data = d->data << 1 | out_bit;
+        d->data2 = d->data2 << 1 | in_bit;
+    }
+    if (++d->count == config->bits) {
+        emit_symbol(d, PROTO_SYMBOL_SPI, idx + 1);
+        d->count = 0;
+    }
+}
+
+
+/* SDA changing while SCL stays high is a start or a stop; otherwise SDA is
+ * sampled as SCL rises, eight bits and an acknowledge per byte. */
+static void push_i2c(decoder_t *d, const decoder_config_t *config,
+        uint64_t idx, uint64_t old) {
+    uint8_t scl = config->channels[0];
+    uint8_t sda = config->channels[1];
+
+    if (line(old, scl) && line(d->level, scl) && line(old ^ d->level, sda)) {
+        bool start = !line(d->level, sda);
+        /* SCL rises once before every stop or repeated start, which looks
+         * like the first bit of a byte. */
+        if (d->active && d->count > 1) {
+            d->flags |= PROTO_SYMBOL_FRAMING;
+            emit_symbol(d, d->address ? PROTO_SYMBOL_I2C_ADDRESS
+                    : PROTO_SYMBOL_I2C_DATA, idx);
+        }
+        begin_symbol(d, idx);
+        emit_symbol(d, start ? PROTO_SYMBOL_I2C_START : PROTO_SYMBOL_I2C_STOP,
+                idx + 1);
+        d->active = start;
+        d->address = start;
+        d->count = 0;
+        return;
+    }
+    if (!d->active || line(old, scl) || !line(d->level, scl)) {
+        return;
+    }
+
+    unsigned int bit = line(old, sda);
+    if (d->count == 0) {
+        begin_symbol(d, idx);
+    }
+    if (d->count < 8) {
+        d->data = d->data << 1 | bit;
+        d->count++;
+        return;
+    }
+    if (bit) {
+        d->flags |= PROTO_SYMBOL_NACK;
+    }
+    emit_symbol(d, d->address ? PROTO_SYMBOL_I2C_ADDRESS
+            : PROTO_SYMBOL_I2C_DATA, idx + 1);
+    d->address = false;
+    d->count = 0;
+}
+
+
+void decoder_advance(decoder_t *d, const decoder_config_t *config,
+        uint64_t end) {
+    if (d->started && config->type == PROTO_DECODE_UART) {
+        advance_uart(d, config, end);
+    }
+}
+
+
+void decoder_push(decoder_t *d, const decoder_config_t *config,
+        const capture_edge_t *edge) {
+    if (!d->started) {
+        return;
+    }
+    decoder_advance(d, config, edge->idx);
+    uint64_t old = d->level;
+    d->level = edge->value;
+    switch (config->type) {
+        case PROTO_DECODE_UART: push_uart(d, config, edge->idx, old); break;
+        case PROTO_DECODE_SPI: push_spi(d, config, edge->idx, old); break;
+        case PROTO_DECODE_I2C: push_i2c(d, config, edge->idx, old); break;
+        default: break;
+    }
+}
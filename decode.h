@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "capture.h"
+#include "protocol.h"
+
+/* Streaming UART, SPI and I2C decoders, fed with a client's edges.
+ *
+ * Each decoder is a state machine that advances on edges: SPI and I2C on
+ * their clock edges and bus conditions, UART on the start bit's falling
+ * edge and then on sample points in the middle of every bit, which
+ * decoder_advance reaches as the sample index moves on. Decoding starts
+ * with the level seen by decoder_start; a symbol in flight at that point is
+ * lost.
+ *
+ * A decoder_config is immutable once published to the capture thread; the
+ * decoder_t state belongs to the capture thread.
+ */
+
+typedef struct decoder_config {
+    uint64_t generation;
+    proto_decoder_t type;
+    uint8_t channels[4];
+    /* Bits of all the channels used. */
+    uint64_t mask;
+    unsigned int bits;
+    unsigned int flags;
+    /* UART bit time, in 1/256 samples. */
+    uint64_t bit_time;
+} decoder_config_t;
+
+typedef struct decoder {
+    /* Of the config the state was built for, 0 for none. */
+    uint64_t generation;
+    bool started;
+    uint64_t level;
+    /* UART: within a character; I2C: between a start and a stop. */
+    bool active;
+    /* I2C: the next byte is an address. */
+    bool address;
+    /* The symbol being assembled: its first sample and the bits so far. */
+    uint64_t first;
+    unsigned int count;
+    uint32_t data;
+    uint32_t data2;
+    uint8_t flags;
+    /* Decoded symbols, for the caller to take. */
+    proto_symbol_t *out;
+    size_t out_len;
+    size_t out_cap;
+} decoder_t;
+
+/* Returns NULL, after logging why, if the settings make no sense. */
+decoder_config_t *decoder_config_new(const proto_decode_msg_t *msg,
+        uint64_t samplerate);
+const char *decoder_name(proto_decoder_t type);
+
+void decoder_reset(decoder_t *d, const decoder_config_t *config);
+void decoder_free(decoder_t *d);
+void decoder_start(decoder_t *d, uint64_t value);
+void decoder_push(decoder_t *d, const decoder_config_t *config,
+        const capture_edge_t *edge);
+/* Decodes whatever the samples before `end` decide. */
+void decoder_advance(decoder_t *d, const decoder_config_t *config,
+        uint64_t end);
@@ -0,0 +1,239 @@
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "edges.h"
+#include "log.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define EDGES_X86 1
+#endif
+
+
+#define EDGES_SCALAR(FUNCTION_NAME, DATA_T)                                   \
+static size_t FUNCTION_NAME(const void *buf, size_t count, uint64_t prev,     \
+        uint64_t mask, uint32_t *out) {                                       \
+    const DATA_T *data = buf;                                                 \
+    DATA_T m = (DATA_T) mask;                                                 \
+    DATA_T p = (DATA_T) prev;                                                 \
+    size_t n = 0;                                                             \
+    for (size_t i = 0; i < count; i++) {                                      \
+        DATA_T unit = data[i];                                                \
+        if ((unit ^ p) & m) {                                                 \
+            out[n++] = i;                                                     \
+        }                                                                     \
+        p = unit;                                                             \
+    }                                                                         \
+    return n;                                                                 \
+}                                                                             \
+
+EDGES_SCALAR(edges_scalar_8, uint8_t)
+EDGES_SCALAR(edges_scalar_16, uint16_t)
+EDGES_SCALAR(edges_scalar_32, uint32_t)
+EDGES_SCALAR(edges_scalar_64, uint64_t)
+
+
+#ifdef EDGES_X86
+
+/* Each iteration XORs four vectors of samples against the same vectors
+ * shifted back by one sample. If none of the masked differences is set, the
+ * whole block is skipped; otherwise the equality bitmask of each vector is
+ * walked one set bit at a time. LANE_BITS keeps one movemask bit per sample
+ * and SHIFT converts a bit position back into a sample index. SET1 and
+ * CMPEQ are the broadcast and lane compare for the width of DATA_T. */
+#define EDGES_SIMD(FUNCTION_NAME, ISA, PFX, BITS, DATA_T, SET1, CMPEQ,        \
+        LANE_BITS, SHIFT)                                                     \
+__attribute__((target(ISA)))                                                  \
+static size_t FUNCTION_NAME(const void *buf, size_t count, uint64_t prev,     \
+        uint64_t mask, uint32_t *out) {                                       \
+    const DATA_T *data = buf;                                                 \
+    const size_t lanes = sizeof(__m##BITS##i) / sizeof(DATA_T);               \
+    const size_t block = 4 * lanes;                                           \
+    const uint32_t all_equal = (uint32_t) ((1ull << sizeof(__m##BITS##i)) - 1);\
+    DATA_T m = (DATA_T) mask;                                                 \
+    size_t n = 0;                                                             \
+    size_t i = 1;                                                             \
+    if (count == 0) {                                                         \
+        return 0;                                                             \
+    }                                                                         \
+    if ((data[0] ^ (DATA_T) prev) & m) {                                      \
+        out[n++] = 0;                                                         \
+    }                                                                         \
+    const __m##BITS##i vmask = SET1(m);                                       \
+    const __m##BITS##i zero = PFX##_setzero_si##BITS();                       \
+    for (; i + block <= count; i += block) {                                  \
+        __m##BITS##i d[4];                                                    \
+        for (size_t k = 0; k < 4; k++) {                                      \
+            const DATA_T *at = data + i + k * lanes;                          \
+            __m##BITS##i cur = PFX##_loadu_si##BITS((const void *) at);       \
+            __m##BITS##i before = PFX##_loadu_si##BITS((const void *) (at - 1));\
+            d[k] = PFX##_and_si##BITS(PFX##_xor_si##BITS(cur, before), vmask);\
+        }                                                                     \
+        __m##BITS##i any = PFX##_or_si##BITS(PFX##_or_si##BITS(d[0], d[1]),   \
+                PFX##_or_si##BITS(d[2], d[3]));                               \
+        if ((uint32_t) PFX##_movemask_epi8(PFX##_cmpeq_epi8(any, zero))       \
+                == all_equal) {                                               \
+            continue;                                                         \
+        }                                                                     \
+        for (size_t k = 0; k < 4; k++) {                                      \
+            uint32_t bits = ~(uint32_t) PFX##_movemask_epi8(                  \
+                    CMPEQ(d[k], zero)) & (uint32_t) LANE_BITS;                \
+            while (bits) {                                                    \
+                out[n++] = i + k * lanes + (__builtin_ctz(bits) >> SHIFT);    \
+                bits &= bits - 1;                                             \
+            }                                                                 \
+        }                                                                     \
+    }                                                                         \
+    DATA_T p = data[i - 1];                                                   \
+    for (; i < count; i++) {                                                  \
+        DATA_T unit = data[i];                                                \
+        if ((unit ^ p) & m) {                                                 \
+            out[n++] = i;                                                     \
+        }                                                                     \
+        p = unit;                                                             \
+    }                                                                         \
+    return n;                                                                 \
+}                                                                             \
+
+/* SSE2 has no 64-bit compare: a lane is equal if both of its halves are. */
+__attribute__((target("sse2")))
+static inline __m128i sse2_cmpeq_64(__m128i a, __m128i b) {
+    __m128i halves = _mm_cmpeq_epi32(a, b);
+    return _mm_and_si128(halves,
+            _mm_shuffle_epi32(halves, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+EDGES_SIMD(edges_sse2_8, "sse2", _mm, 128, uint8_t,
+        _mm_set1_epi8, _mm_cmpeq_epi8, 0xffff, 0)
+EDGES_SIMD(edges_sse2_16, "sse2", _mm, 128, uint16_t,
+        _mm_set1_epi16, _mm_cmpeq_epi16, 0x5555, 1)
+EDGES_SIMD(edges_sse2_32, "sse2", _mm, 128, uint32_t,
+        _mm_set1_epi32, _mm_cmpeq_epi32, 0x1111, 2)
+EDGES_SIMD(edges_sse2_64, "sse2", _mm, 128, uint64_t,
+        _mm_set1_epi64x, sse2_cmpeq_64, 0x0101, 3)
+EDGES_SIMD(edges_avx2_8, "avx2", _mm256, 256, uint8_t,
+        _mm256_set1_epi8, _mm256_cmpeq_epi8, 0xffffffff, 0)
+EDGES_SIMD(edges_avx2_16, "avx2", _mm256, 256, uint16_t,
+        _mm256_set1_epi16, _mm256_cmpeq_epi16, 0x55555555, 1)
+EDGES_SIMD(edges_avx2_32, "avx2", _mm256, 256, uint32_t,
+        _mm256_set1_epi32, _mm256_cmpeq_epi32, 0x11111111, 2)
+EDGES_SIMD(edges_avx2_64, "avx2", _mm256, 256, uint64_t,
+        _mm256_set1_epi64x, _mm256_cmpeq_epi64, 0x01010101, 3)
+
+#endif
+
+
+/* Indexed by [isa][log2(unitsize)]. */
+static const edges_kernel_t kernels[EDGES_ISA_COUNT][4] = {
+    [EDGES_ISA_SCALAR] = { edges_scalar_8, edges_scalar_16, edges_scalar_32,
+        edges_scalar_64 },
+#ifdef EDGES_X86
+    [EDGES_ISA_SSE2] = { edges_sse2_8, edges_sse2_16, edges_sse2_32,
+        edges_sse2_64 },
+    [EDGES_ISA_AVX2] = { edges_avx2_8, edges_avx2_16, edges_avx2_32,
+        edges_avx2_64 },
+#endif
+};
+
+static const char *isa_names[EDGES_ISA_COUNT] = {
+    [EDGES_ISA_SCALAR] = "scalar",
+    [EDGES_ISA_SSE2] = "sse2",
+    [EDGES_ISA_AVX2] = "avx2",
+};
+
+static bool isa_supported[EDGES_ISA_COUNT];
+static edges_isa_t best_isa = EDGES_ISA_SCALAR;
+
+
+void edges_init() {
+    isa_supported[EDGES_ISA_SCALAR] = true;
+#ifdef EDGES_X86
+    __builtin_cpu_init();
+    isa_supported[EDGES_ISA_SSE2] = __builtin_cpu_supports("sse2");
+    isa_supported[EDGES_ISA_AVX2] = __builtin_cpu_supports("avx2");
+#endif
+
+    best_isa = EDGES_ISA_SCALAR;
+    for (int isa = 0; isa < EDGES_ISA_COUNT; isa++) {
+        if (isa_supported[isa]) {
+            best_isa = isa;
+        }
+    }
+
+    log_msg(LOG_INFO, "Edge detection using %s kernels", isa_names[best_isa]);
+}
+
+
+edges_isa_t edges_isa() {
+    return best_isa;
+}
+
+
+const char *edges_isa_name(edges_isa_t isa) {
+    if (isa >= EDGES_ISA_COUNT) {
+        return NULL;
+    }
+    return isa_names[isa];
+}
+
+
+static int unitsize_slot(unsigned int unitsize) {
+    switch (unitsize) {
+        case 1: return 0;
+        case 2: return 1;
+        case 4: return 2;
+        case 8: return 3;
+        default: return -1;
+    }
+}
+
+
+edges_kernel_t edges_kernel_for(edges_isa_t isa, unsigned int unitsize) {
+    int slot = unitsize_slot(unitsize);
+    if (isa >= EDGES_ISA_COUNT || !isa_supported[isa] || slot < 0) {
+        return NULL;
+    }
+    return kernels[isa][slot];
+}
+
+
+edges_kernel_t edges_kernel(unsigned int unitsize) {
+    return edges_kernel_for(best_isa, unitsize);
+}
+
+
+/* Keeps the low `bytes` bytes of every sample. With `bytes` a constant, each
+ * caller below gets its own fixed-size loop: whole 8-byte loads and a mask,
+ * and exact copies only for the last samples, where a load of 8 bytes would
+ * read past the data. */
+static inline void widen(const uint8_t *data, size_t count,
+        unsigned int unitsize, unsigned int bytes, uint64_t *out) {
+    const uint64_t keep = bytes == 8 ? UINT64_MAX : (1ull << (8 * bytes)) - 1;
+    const size_t size = count * unitsize;
+    size_t i = 0;
+    for (; i < count && i * unitsize + 8 <= size; i++) {
+        uint64_t v;
+        memcpy(&v, data + i * unitsize, 8);
+        out[i] = v & keep;
+    }
+    for (; i < count; i++) {
+        uint64_t v = 0;
+        memcpy(&v, data + i * unitsize, bytes);
+        out[i] = v;
+    }
+}
+
+
+void edges_widen(const void *data, size_t count, unsigned int unitsize,
+        uint64_t *out) {
+    switch (unitsize) {
+        case 3: widen(data, count, 3, 3, out); break;
+        case 5: widen(data, count, 5, 5, out); break;
+        case 6: widen(data, count, 6, 6, out); break;
+        case 7: widen(data, count, 7, 7, out); break;
+        default: widen(data, count, unitsize, 8, out); break;
+    }
+}
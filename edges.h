@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Edge detection kernels.
+ *
+ * A kernel scans `count` samples of `unitsize` bytes and writes to `out` the
+ * index of every sample whose masked value differs from the sample before it
+ * (the sample before data[0] being `prev`). `out` must have room for `count`
+ * entries. Returns the number of indices written.
+ */
+typedef size_t (*edges_kernel_t)(const void *data, size_t count,
+        uint64_t prev, uint64_t mask, uint32_t *out);
+
+typedef enum edges_isa {
+    EDGES_ISA_SCALAR,
+    EDGES_ISA_SSE2,
+    EDGES_ISA_AVX2,
+    EDGES_ISA_COUNT
+} edges_isa_t;
+
+void edges_init();
+edges_isa_t edges_isa();
+const char *edges_isa_name(edges_isa_t isa);
+edges_kernel_t edges_kernel(unsigned int unitsize);
+edges_kernel_t edges_kernel_for(edges_isa_t isa, unsigned int unitsize);
+
+/* There are kernels for unitsizes of 1, 2, 4 and 8 bytes. Samples of any
+ * other size are widened into uint64_t first, to go through the 8-byte
+ * kernel: this keeps their first 64 channels, as many as an edge carries. */
+void edges_widen(const void *data, size_t count, unsigned int unitsize,
+        uint64_t *out);
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "filter.h"
+
+#define FILTER_QUEUE_SIZE 256
+
+/* Clients thread only. */
+static uint64_t next_generation = 1;
+
+
+filter_config_t *filter_config_new(const filter_config_t *base) {
+    filter_config_t *config = malloc(sizeof(*config));
+    if (config == NULL) {
+        perror("Failed to allocate filter");
+        exit(1);
+    }
+    if (base != NULL) {
+        *config = *base;
+    } else {
+        memset(config, 0, sizeof(*config));
+    }
+    config->generation = next_generation++;
+    return config;
+}
+
+
+void filter_config_set(filter_config_t *config, uint64_t channels,
+        uint32_t min_high, uint32_t min_low, uint32_t holdoff) {
+    for (int b = 0; b < 64; b++) {
+        if ((channels >> b) & 1) {
+            config->min_high[b] = min_high;
+            config->min_low[b] = min_low;
+            config->holdoff[b] = holdoff;
+        }
+    }
+
+    config->channels = 0;
+    config->delay = 0;
+    for (int b = 0; b < 64; b++) {
+        if (config->min_high[b] || config->min_low[b] || config->holdoff[b]) {
+            config->channels |= 1ull << b;
+        }
+        if (config->min_high[b] > config->delay) {
+            config->delay = config->min_high[b];
+        }
+        if (config->min_low[b] > config->delay) {
+            config->delay = config->min_low[b];
+        }
+    }
+}
+
+
+void filter_reset(filter_t *f, const filter_config_t *config) {
+    f->generation = config->generation;
+    f->level = 0;
+    f->out = 0;
+    f->held = 0;
+    f->head = 0;
+    f->len = 0;
+    f->suppressed = 0;
+    memset(f->scan, 0, sizeof(f->scan));
+}
+
+
+void filter_free(filter_t *f) {
+    free(f->queue);
+    f->queue = NULL;
+    f->head = f->len = f->cap = 0;
+}
+
+
+void filter_push(filter_t *f, const capture_edge_t *edge) {
+    if (f->len == f->cap) {
+        if (f->head > f->cap / 2) {
+            memmove(f->queue, f->queue + f->head,
+                    (f->len - f->head) * sizeof(f->queue[0]));
+            for (int b = 0; b < 64; b++) {
+                f->scan[b] = f->scan[b] > f->head ? f->scan[b] - f->head : 0;
+            }
+            f->len -= f->head;
+            f->head = 0;
+        } else {
+            size_t cap = f->cap ? 2 * f->cap : FILTER_QUEUE_SIZE;
+            capture_edge_t *queue = realloc(f->queue, cap * sizeof(queue[0]));
+            if (queue == NULL) {
+                perror("Failed to grow filter queue");
+                exit(1);
+            }
+            f->queue = queue;
+            f->cap = cap;
+        }
+    }
+    f->queue[f->len++] = *edge;
+}
+
+
+/* True if the input changes channel `b` away from the current level before
+ * sample `limit`. The search resumes where the last one for the channel
+ * stopped, so every queued edge is looked at once per channel. */
+static bool changes_before(filter_t *f, int b, uint64_t limit) {
+    uint64_t bit = 1ull << b;
+    size_t i = f->scan[b] > f->head ? f->scan[b] : f->head;
+    while (i < f->len && f->queue[i].idx < limit
+            && !((f->queue[i].value ^ f->level) & bit)) {
+        i++;
+    }
+    f->scan[b] = i;
+    return i < f->len && f->queue[i].idx < limit;
+}
+
+
+uint64_t filter_horizon(const filter_config_t *config, uint64_t end) {
+    uint64_t lookahead = config->delay ? config->delay : 1;
+    return end + 1 >= lookahead ? end + 1 - lookahead : 0;
+}
+
+
+/* Walks the input one event at a time: an input edge, the end of a
+ * hold-off, or both at once. An event at sample t is decided once the
+ * samples up to t + delay - 1 are known. */
+size_t filter_pop(filter_t *f, const filter_config_t *config, uint64_t end,
+        capture_edge_t *out, size_t size) {
+    uint64_t lookahead = config->delay ? config->delay : 1;
+    size_t n = 0;
+
+    while (n < size) {
+        uint64_t t = UINT64_MAX;
+        if (f->head < f->len) {
+            t = f->queue[f->head].idx;
+        }
+        for (uint64_t held = f->held; held; held &= held - 1) {
+            int b = __builtin_ctzll(held);
+            if (f->until[b] < t) {
+                t = f->until[b];
+            }
+        }
+        if (t == UINT64_MAX || t + lookahead > end) {
+            break;
+        }
+
+        bool input = false;
+        uint64_t candidates = 0;
+        if (f->head < f->len && f->queue[f->head].idx == t) {
+            uint64_t value = f->queue[f->head++].value;
+            candidates = (f->level ^ value) & ~f->held;
+            f->level = value;
+            input = true;
+        }
+        for (uint64_t held = f->held; held; held &= held - 1) {
+            int b = __builtin_ctzll(held);
+            if (f->until[b] == t) {
+                f->held &= ~(1ull << b);
+                candidates |= 1ull << b;
+            }
+        }
+        candidates &= f->level ^ f->out;
+
+        uint64_t accepted = 0;
+        for (; candidates; candidates &= candidates - 1) {
+            int b = __builtin_ctzll(candidates);
+            uint64_t bit = 1ull << b;
+            uint32_t width = (f->level & bit)
+                ? config->min_high[b] : config->min_low[b];
+            if (width <= 1 || !changes_before(f, b, t + width)) {
+                accepted |= bit;
+                if (config->holdoff[b] != 0) {
+                    f->held |= bit;
+                    f->until[b] = t + config->holdoff[b];
+                }
+            }
+        }
+
+        if (accepted != 0) {
+            f->out ^= accepted;
+            out[n].idx = t;
+            out[n].value = f->out;
+            n++;
+        } else if (input) {
+            f->suppressed++;
+        }
+    }
+
+    if (f->head == f->len) {
+        f->head = f->len = 0;
+        memset(f->scan, 0, sizeof(f->scan));
+    }
+    return n;
+}
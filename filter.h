@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "capture.h"
+
+/* Per-client glitch filter.
+ *
+ * A change of a channel is only passed on if the new level then lasts at
+ * least `min_high` samples for a rise or `min_low` samples for a fall, so
+ * shorter pulses vanish; different widths for the two directions give the
+ * filter hysteresis. A passed change keeps its original sample index, which
+ * means the output runs `delay` samples behind the input. After a passed
+ * change the channel is held for `holdoff` samples: changes in between are
+ * ignored, and at the end of the hold-off the output catches up with the
+ * line if it differs.
+ *
+ * A filter_config is immutable once published to the capture thread; the
+ * filter_t state belongs to the capture thread.
+ */
+
+typedef struct filter_config {
+    uint64_t generation;
+    /* Channels with any non-zero setting. */
+    uint64_t channels;
+    /* Longest min_high or min_low. */
+    uint32_t delay;
+    uint32_t min_high[64];
+    uint32_t min_low[64];
+    uint32_t holdoff[64];
+} filter_config_t;
+
+typedef struct filter {
+    /* Of the config the state was built for, 0 for none. */
+    uint64_t generation;
+    /* Input value at the last decided sample, and the filtered one. */
+    uint64_t level;
+    uint64_t out;
+    /* Channels in hold-off, and the sample where each one ends. */
+    uint64_t held;
+    uint64_t until[64];
+    /* Input edges not decided yet, from queue[head] to queue[len]. */
+    capture_edge_t *queue;
+    size_t head;
+    size_t len;
+    size_t cap;
+    /* Per channel, how far changes_before looked: none of queue[head] to
+     * queue[scan[b]] - 1 changes channel b. */
+    size_t scan[64];
+    /* Input edges that changed nothing on the output. */
+    uint64_t suppressed;
+} filter_t;
+
+/* Returns a new config with the settings of `base`, which may be NULL. */
+filter_config_t *filter_config_new(const filter_config_t *base);
+void filter_config_set(filter_config_t *config, uint64_t channels,
+        uint32_t min_high, uint32_t min_low, uint32_t holdoff);
+
+void filter_reset(filter_t *f, const filter_config_t *config);
+void filter_free(filter_t *f);
+void filter_push(filter_t *f, const capture_edge_t *edge);
+/* The output of filter_pop up to `end` is final before the returned
+ * sample. */
+uint64_t filter_horizon(const filter_config_t *config, uint64_t end);
+/* Moves up to `size` output edges to `out`, as far as the samples before
+ * `end` decide them, and returns how many. */
+size_t filter_pop(filter_t *f, const filter_config_t *config, uint64_t end,
+        capture_edge_t *out, size_t size);
@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "history.h"
+
+/* Two varints of at most 10 bytes. */
+#define HISTORY_EDGE_MAX 20
+
+typedef struct history_block {
+    uint64_t first_idx;
+    _Atomic uint32_t count;
+    uint32_t reserved;
+    uint8_t data[HISTORY_BLOCK_SIZE - 16];
+} history_block_t;
+
+static struct {
+    history_block_t *blocks;
+    size_t count;
+    _Atomic uint64_t current;
+    /* Capture thread only: where the next edge goes, and the last edge of
+     * the current block. */
+    uint32_t pos;
+    uint64_t idx;
+    uint64_t value;
+} history;
+
+
+bool history_init(size_t bytes) {
+    history.count = bytes / sizeof(history_block_t);
+    if (history.count < 2) {
+        history.count = 2;
+    }
+    history.blocks = calloc(history.count, sizeof(history_block_t));
+    if (history.blocks == NULL) {
+        perror("Failed to allocate history");
+        return false;
+    }
+    atomic_init(&history.current, 0);
+    history.pos = 0;
+    return true;
+}
+
+
+void history_cleanup() {
+    free(history.blocks);
+    history.blocks = NULL;
+}
+
+
+bool history_enabled() {
+    return history.blocks != NULL;
+}
+
+
+static size_t put_varint(uint8_t *out, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out[n++] = v;
+    return n;
+}
+
+
+static bool get_varint(const uint8_t *data, size_t size, uint32_t *pos,
+        uint64_t *v) {
+    *v = 0;
+    for (unsigned int shift = 0; *pos < size && shift < 64; shift += 7) {
+        uint8_t byte = data[(*pos)++];
+        *v |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void history_append(const capture_edge_t *edges, size_t count) {
+    uint64_t current = atomic_load_explicit(&history.current,
+            memory_order_relaxed);
+    history_block_t *b = &history.blocks[current % history.count];
+    uint32_t written = atomic_load_explicit(&b->count, memory_order_relaxed);
+
+    for (size_t i = 0; i < count; i++) {
+        if (history.pos + HISTORY_EDGE_MAX > sizeof(b->data)) {
+            atomic_store_explicit(&b->count, written, memory_order_release);
+            current++;
+            atomic_store_explicit(&history.current, current,
+                    memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            b = &history.blocks[current % history.count];
+            atomic_store_explicit(&b->count, 0, memory_order_relaxed);
+            written = 0;
+            history.pos = 0;
+        }
+        if (written == 0) {
+            b->first_idx = edges[i].idx;
+            history.idx = edges[i].idx;
+            history.value = 0;
+        }
+        history.pos += put_varint(b->data + history.pos,
+                edges[i].idx - history.idx);
+        history.pos += put_varint(b->data + history.pos,
+                edges[i].value ^ history.value);
+        history.idx = edges[i].idx;
+        history.value = edges[i].value;
+        written++;
+    }
+    atomic_store_explicit(&b->count, written, memory_order_release);
+}
+
+
+static uint64_t oldest_block(uint64_t current) {
+    return current >= history.count - 1 ? current - (history.count - 1) : 0;
+}
+
+
+/* True if nothing read from the block so far can have been overwritten. */
+static bool block_valid(uint64_t block) {
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t current = atomic_load_explicit(&history.current,
+            memory_order_relaxed);
+    return block + history.count > current;
+}
+
+
+/* Starts in the last block that begins before `idx`, so that the first edge
+ * from `idx` on can be compared with the one before it. */
+uint64_t history_seek(history_cursor_t *cursor, uint64_t idx) {
+    while (true) {
+        uint64_t current = atomic_load_explicit(&history.current,
+                memory_order_acquire);
+        uint64_t lo = oldest_block(current);
+        uint64_t hi = current;
+        uint64_t oldest_idx = history.blocks[lo % history.count].first_idx;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo + 1) / 2;
+            if (history.blocks[mid % history.count].first_idx < idx) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        if (!block_valid(oldest_block(current))) {
+            continue;
+        }
+        memset(cursor, 0, sizeof(*cursor));
+        cursor->block = lo;
+        cursor->from = idx;
+        /* Until the first block is reused, the history holds every edge,
+         * and the first one follows an all-zero value. */
+        if (oldest_block(current) == 0) {
+            cursor->have_last = true;
+            return 0;
+        }
+        return oldest_idx > idx ? oldest_idx - idx : 0;
+    }
+}
+
+
+/* The history moved past the cursor: starts over from the oldest block. */
+static uint64_t skip_to_oldest(history_cursor_t *cursor) {
+    while (true) {
+        uint64_t current = atomic_load_explicit(&history.current,
+                memory_order_acquire);
+        uint64_t block = oldest_block(current);
+        uint64_t first_idx = history.blocks[block % history.count].first_idx;
+        if (!block_valid(block)) {
+            continue;
+        }
+        uint64_t lost = first_idx > cursor->from ? first_idx - cursor->from : 0;
+        memset(cursor, 0, sizeof(*cursor));
+        cursor->block = block;
+        cursor->from = first_idx;
+        return lost;
+    }
+}
+
+
+size_t history_read(history_cursor_t *cursor, uint64_t mask,
+        capture_edge_t *out, size_t size, uint64_t *lost) {
+    size_t n = 0;
+
+    while (n < size) {
+        uint64_t current = atomic_load_explicit(&history.current,
+                memory_order_acquire);
+        if (cursor->block + history.count <= current) {
+            /* Let the caller report the loss before the edges after it. */
+            if (n == 0) {
+                *lost += skip_to_oldest(cursor);
+            }
+            break;
+        }
+
+        const history_block_t *b = &history.blocks[cursor->block % history.count];
+        uint32_t count = atomic_load_explicit(&b->count, memory_order_acquire);
+        if (cursor->edge == count) {
+            /* A block before the current one is complete. */
+            if (cursor->block == current) {
+                break;
+            }
+            cursor->block++;
+            cursor->edge = 0;
+            cursor->pos = 0;
+            continue;
+        }
+
+        history_cursor_t next = *cursor;
+        size_t m = n;
+        if (next.edge == 0) {
+            next.idx = b->first_idx;
+            next.value = 0;
+        }
+        while (next.edge < count && m < size) {
+            uint64_t delta, changed;
+            if (!get_varint(b->data, sizeof(b->data), &next.pos, &delta)
+                    || !get_varint(b->data, sizeof(b->data), &next.pos,
+                        &changed)) {
+                break;
+            }
+            next.idx += delta;
+            next.value ^= changed;
+            next.edge++;
+            if (next.idx < next.from) {
+                next.have_last = true;
+                next.last = next.value;
+                continue;
+            }
+            next.from = next.idx + 1;
+            if (!next.have_last || ((next.last ^ next.value) & mask)) {
+                out[m].idx = next.idx;
+                out[m].value = next.value & mask;
+                m++;
+            }
+            next.have_last = true;
+            next.last = next.value;
+        }
+        if (!block_valid(cursor->block)) {
+            continue;
+        }
+        *cursor = next;
+        n = m;
+    }
+    return n;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "capture.h"
+
+/* In-memory history of recent edges, for backfilling new clients.
+ *
+ * The history is a ring of fixed-size blocks. Each block holds the edges
+ * from its first_idx on, delta-encoded: a varint of the distance from the
+ * previous edge of the block and a varint of the bits that changed, so a
+ * typical edge takes a few bytes. Blocks are numbered from 0 on and block
+ * b lives in slot b % count; their first_idx grows with b, so the block
+ * holding a sample is found with a binary search.
+ *
+ * The capture thread is the only writer. Before reusing a slot it stores
+ * the number of the block it starts in `current`, then fills it, and
+ * publishes the edges of the current block by advancing its count. A
+ * reader decodes a block, issues an acquire fence and reloads `current`:
+ * if the block was reused meanwhile, what it decoded must be discarded.
+ */
+
+#define HISTORY_BLOCK_SIZE 4096
+
+typedef struct history_cursor {
+    uint64_t block;
+    /* Edges of the block already decoded, and where the next one starts. */
+    uint32_t edge;
+    uint32_t pos;
+    /* The last decoded edge of the block. */
+    uint64_t idx;
+    uint64_t value;
+    /* Edges before this sample are skipped. */
+    uint64_t from;
+    /* The last decoded edge, to tell which edges change the mask. */
+    bool have_last;
+    uint64_t last;
+} history_cursor_t;
+
+/* Keeps about `bytes` of history. */
+bool history_init(size_t bytes);
+void history_cleanup();
+bool history_enabled();
+/* Capture thread only. */
+void history_append(const capture_edge_t *edges, size_t count);
+/* Clients thread: points the cursor at the first edge from sample `idx` on.
+ * Returns how many samples before the oldest one kept are missing. */
+uint64_t history_seek(history_cursor_t *cursor, uint64_t idx);
+/* Clients thread: moves up to `size` edges that change the bits of `mask`,
+ * masked, to `out` and returns how many. If the history moved past the
+ * cursor, it skips to the oldest block and adds the samples it skipped to
+ * `*lost`. */
+size_t history_read(history_cursor_t *cursor, uint64_t mask,
+        capture_edge_t *out, size_t size, uint64_t *lost);
@@ -0,0 +1,169 @@
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "log.h"
+
+#define LOG_QUEUE_SIZE 256
+#define LOG_LINE_SIZE 256
+/* Token bucket for non-error messages: refills LOG_RATE lines per second
+ * and holds at most LOG_BURST. */
+#define LOG_RATE 100
+#define LOG_BURST 200
+
+typedef struct log_entry {
+    log_level_t level;
+    char text[LOG_LINE_SIZE];
+} log_entry_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    log_entry_t queue[LOG_QUEUE_SIZE];
+    size_t head;
+    size_t tail;
+    uint64_t suppressed;
+    double tokens;
+    struct timespec refilled;
+    bool running;
+} logger;
+
+static _Atomic int log_level = LOG_INFO;
+
+static const char *level_colors[] = {
+    [LOG_ERROR] = "\033[1;31m",
+    [LOG_WARN] = "\033[1;33m",
+    [LOG_INFO] = "\033[1;32m",
+    [LOG_DEBUG] = "\033[1;34m",
+};
+
+
+static void *log_task(void *param) {
+    (void) param;
+    log_entry_t entry;
+
+    pthread_mutex_lock(&logger.mutex);
+    while (true) {
+        while (logger.running && logger.head == logger.tail
+                && logger.suppressed == 0) {
+            pthread_cond_wait(&logger.cond, &logger.mutex);
+        }
+        if (logger.head == logger.tail && logger.suppressed == 0) {
+            break;
+        }
+
+        uint64_t suppressed = logger.suppressed;
+        logger.suppressed = 0;
+        bool have_entry = logger.head != logger.tail;
+        if (have_entry) {
+            entry = logger.queue[logger.tail % LOG_QUEUE_SIZE];
+            logger.tail++;
+        }
+        pthread_mutex_unlock(&logger.mutex);
+
+        if (have_entry) {
+            fprintf(stderr, "%s%s\033[0m\n", level_colors[entry.level],
+                    entry.text);
+        }
+        if (suppressed != 0) {
+            fprintf(stderr, "%s%lu log messages suppressed\033[0m\n",
+                    level_colors[LOG_WARN], suppressed);
+        }
+
+        pthread_mutex_lock(&logger.mutex);
+    }
+    pthread_mutex_unlock(&logger.mutex);
+    return NULL;
+}
+
+
+static bool take_token() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - logger.refilled.tv_sec)
+        + (now.tv_nsec - logger.refilled.tv_nsec) / 1e9;
+    logger.refilled = now;
+    logger.tokens += elapsed * LOG_RATE;
+    if (logger.tokens > LOG_BURST) {
+        logger.tokens = LOG_BURST;
+    }
+    if (logger.tokens < 1) {
+        return false;
+    }
+    logger.tokens -= 1;
+    return true;
+}
+
+
+void log_init(log_level_t level) {
+    atomic_store(&log_level, level);
+    logger.head = 0;
+    logger.tail = 0;
+    logger.suppressed = 0;
+    logger.tokens = LOG_BURST;
+    clock_gettime(CLOCK_MONOTONIC, &logger.refilled);
+    logger.running = true;
+
+    if (0 != pthread_mutex_init(&logger.mutex, NULL)
+            || 0 != pthread_cond_init(&logger.cond, NULL)) {
+        fprintf(stderr, "\ncan't make logger mutex\n");
+        exit(1);
+    }
+    if (0 != pthread_create(&logger.thread, NULL, log_task, NULL)) {
+        fprintf(stderr, "\ncan't create logger thread\n");
+        exit(1);
+    }
+}
+
+
+void log_shutdown() {
+    pthread_mutex_lock(&logger.mutex);
+    logger.running = false;
+    pthread_cond_signal(&logger.cond);
+    pthread_mutex_unlock(&logger.mutex);
+
+    if (0 != pthread_join(logger.thread, NULL)) {
+        fprintf(stderr, "\ncan't join logger thread\n");
+    }
+    pthread_cond_destroy(&logger.cond);
+    pthread_mutex_destroy(&logger.mutex);
+}
+
+
+void log_set_level(log_level_t level) {
+    atomic_store(&log_level, level);
+}
+
+
+bool log_enabled(log_level_t level) {
+    return (int) level <= atomic_load_explicit(&log_level, memory_order_relaxed);
+}
+
+
+void log_msg(log_level_t level, const char *fmt, ...) {
+    if (!log_enabled(level)) {
+        return;
+    }
+
+    pthread_mutex_lock(&logger.mutex);
+    if (logger.head - logger.tail >= LOG_QUEUE_SIZE
+            || (level != LOG_ERROR && !take_token())) {
+        logger.suppressed++;
+    } else {
+        log_entry_t *entry = &logger.queue[logger.head % LOG_QUEUE_SIZE];
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(entry->text, sizeof(entry->text), fmt, args);
+        va_end(args);
+        entry->level = level;
+        logger.head++;
+        pthread_cond_signal(&logger.cond);
+    }
+    pthread_mutex_unlock(&logger.mutex);
+}
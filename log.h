@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+
+typedef enum log_level {
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+} log_level_t;
+
+/* Asynchronous logger.
+ *
+ * log_msg formats the message into a bounded queue and returns; a dedicated
+ * thread writes the queue to stderr. Messages above the selected level are
+ * discarded before formatting, and non-error messages are rate limited:
+ * whatever does not fit is counted and reported as suppressed. Fatal errors
+ * that are followed by exit() should keep writing to stderr directly.
+ */
+void log_init(log_level_t level);
+void log_shutdown();
+void log_set_level(log_level_t level);
+bool log_enabled(log_level_t level);
+void log_msg(log_level_t level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
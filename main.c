@@ -5,207 +5,2056 @@
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
-#include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <time.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include "capture.h"
+#include "ring.h"
+#include "log.h"
+#include "stats.h"
+#include "protocol.h"
+#include "shm.h"
+#include "record.h"
+#include "archive.h"
+#include "filter.h"
+#include "aggregate.h"
+#include "decode.h"
+#include "trigger.h"
+#include "history.h"
+#include "uring.h"
+#include "trace.h"
 
 #define UNUSED(x) (void)(x)
-#define CLIENT_BUFF_SIZE 1000
+#define CLIENT_RING_SIZE 1024
+/* Mask changes a client may have queued and not framed yet. */
+#define CLIENT_MASK_CHANGES 64
+#define CLIENT_EVENTS 64
+#define CLIENT_IN_SIZE 1024
+#define CLIENT_OUT_SIZE 16384
+/* Backfilled edges per frame, few enough to always fit in one. */
+#define BACKFILL_EDGES 256
+/* Default memory cap of a CLIENT_POLICY_GROW ring. */
+#define CLIENT_MAX_BYTES (64 << 20)
+/* Default io_uring submission entries, and registered output buffers. */
+#define CLIENT_URING_ENTRIES 256
+/* A client that sends nothing for this long is a legacy one. */
+#define CLIENT_IDENTIFY_NS 200000000ull
 
-typedef struct client_sample {
-    double time;
-    uint64_t value;
-} client_sample_t;
+RING_DEFINE(edge_ring, capture_edge_t)
+
+/* The edges from position `pos` of `ring` on were queued under `mask`. */
+typedef struct mask_change {
+    edge_ring_t *ring;
+    size_t pos;
+    uint64_t mask;
+} mask_change_t;
+
+RING_DEFINE(mask_ring, mask_change_t)
+RING_DEFINE(bucket_ring, proto_bucket_t)
+RING_DEFINE(symbol_ring, proto_symbol_t)
+
+typedef enum client_stage {
+    /* Nothing received yet: could still be a legacy client or PROTO_MAGIC. */
+    CLIENT_UNIDENTIFIED,
+    CLIENT_AWAITING_HELLO,
+    CLIENT_STREAMING,
+} client_stage_t;
 
 typedef struct client {
     int sock;
-    bool closing;
+    atomic_bool closing;
+    /* Written by the clients thread; the capture thread uses the copy in its
+     * client_group. */
     uint64_t mask;
-    client_sample_t buffer[CLIENT_BUFF_SIZE];
-    size_t buffer_idx;
-    LIST_ENTRY(client) entries;
+    /* Backpressure settings, written by the clients thread. */
+    _Atomic int policy;
+    _Atomic uint64_t bucket;
+    _Atomic uint64_t max_bytes;
+    /* Glitch filter settings, NULL for none. Written by the clients thread;
+     * the capture thread uses the copy in its client_set. */
+    filter_config_t *filter_config;
+    /* Bucket width of a statistics subscription, 0 for edges. Written by the
+     * clients thread; the capture thread uses the copy in its client_set. */
+    uint64_t buckets_width;
+    /* Protocol decoder settings, NULL for edges. Written by the clients
+     * thread; the capture thread uses the copy in its client_set. */
+    decoder_config_t *decoder_config;
+    /* Trigger settings, NULL for all edges. Written by the clients thread;
+     * the capture thread uses the copy in its client_set. */
+    trigger_config_t *trigger_config;
+    /* The capture thread pushes into `produce`; the clients thread drains
+     * `consume` and follows its `next` links when the ring had to grow. */
+    edge_ring_t *produce;
+    edge_ring_t *consume;
+    /* The masks the edges were queued under, from the capture thread to the
+     * clients thread, which frames the edges with them. */
+    mask_ring_t masks;
+    /* Statistics records, from the capture thread to the clients thread;
+     * allocated on the first subscription. */
+    bucket_ring_t *buckets;
+    /* Decoded symbols, the same way. */
+    symbol_ring_t *symbols;
+    bool writable;
+    client_stage_t stage;
+    proto_encoder_t enc;
+    uint8_t in[CLIENT_IN_SIZE];
+    size_t in_len;
+    /* Encoded bytes waiting for the socket; out_sent of them already went.
+     * CLIENT_OUT_SIZE bytes, registered with io_uring if there was one left. */
+    uint8_t *out;
+    size_t out_len;
+    size_t out_sent;
+    /* Passed as SCM_RIGHTS with the first byte of out, or -1. */
+    int out_fd;
+    bool shm_requested;
+    /* Clients thread only: socket settings. A corked TCP client is pushed
+     * out whenever its queue runs dry; a client with a send interval is
+     * deferred until `flush_at`, at `deferred_slot` - 1 in the heap of
+     * deferred clients, or 0 if it is not waiting. */
+    bool tcp;
+    bool corked;
+    bool unpushed;
+    uint64_t interval_ns;
+    size_t batch;
+    uint64_t flush_at;
+    size_t deferred_slot;
+    /* Set while the client is on the pending_clients list, linked through
+     * `pending_next`. */
+    atomic_bool flush_pending;
+    struct client *pending_next;
+    /* Clients thread only: an io_uring send from `out` is in flight. A
+     * client removed meanwhile is `orphaned`, and freed on its completion. */
+    bool in_flight;
+    bool orphaned;
+    /* Clients thread only: latencies of the edges sent while tracing, from
+     * being queued and from the arrival of their packet, allocated on the
+     * first; and whether PROTO_FRAME_TIMESTAMP frames go with the edges. */
+    trace_histogram_t *queue_latency;
+    trace_histogram_t *total_latency;
+    bool timestamps;
+    /* Clients thread only: sending edges from the history, and then skipping
+     * the live edges before `live_from`. */
+    bool backfilling;
+    history_cursor_t backfill;
+    uint64_t backfill_lost;
+    bool skip_live;
+    uint64_t live_from;
+    counter_t queued;
+    counter_t overflows;
+    counter_t dropped;
+    counter_t coalesced;
+    counter_t filtered;
+    counter_t bytes_sent;
+    /* Losses already reported to the client in PROTO_FRAME_GAP frames. */
+    uint64_t dropped_sent;
+    uint64_t coalesced_sent;
+    /* Capture thread only: the mask of the current batch, and the last one
+     * put on `masks`. */
+    uint64_t batch_mask;
+    uint64_t queued_mask;
+    /* Capture thread only: coalescing state for the current batch. */
+    bool coalesce;
+    bool have_pending;
+    capture_edge_t pending;
+    /* Capture thread only: glitch filter, statistics, decoder and trigger
+     * state, and whether the current batch goes through them. */
+    filter_t filter;
+    bool filtering;
+    aggregate_t aggregate;
+    bool aggregating;
+    decoder_t decoder;
+    /* The decoder's config while the current batch goes through it. */
+    const decoder_config_t *decoding;
+    trigger_t trigger;
+    const trigger_config_t *triggering;
 } client_t;
 
-pthread_mutex_t clients_mutex;
+/* Clients with identical masks, so that an edge is masked once for all. */
+typedef struct client_group {
+    uint64_t mask;
+    size_t count;
+    client_t **clients;
+    /* Capture thread only: the last batch and edge sent to the group. */
+    uint64_t batch;
+    uint64_t edge;
+} client_group_t;
+
+/* A client whose edges go through more stages than the ring. */
+typedef struct client_stages {
+    client_t *client;
+    uint64_t mask;
+    /* NULL without a glitch filter. */
+    const filter_config_t *filter;
+    /* 0 without a statistics subscription. */
+    uint64_t buckets_width;
+    /* NULL without a protocol decoder. */
+    const decoder_config_t *decoder;
+    /* NULL without a trigger. */
+    const trigger_config_t *trigger;
+} client_stages_t;
+
+/* Immutable snapshot of the connected clients. The clients thread is the
+ * only one that changes the set: it publishes a new snapshot on every add,
+ * remove or mask change, and frees the old one once the capture thread can
+ * no longer be reading it.
+ *
+ * The snapshot indexes the clients by channel: bit_groups[b] lists the
+ * groups whose mask has bit b, so an edge only visits the groups that
+ * subscribe to one of the bits that changed. */
+typedef struct client_set {
+    size_t count;
+    /* Union of all masks. */
+    uint64_t mask;
+    size_t groups_count;
+    client_group_t *groups;
+    client_t **grouped;
+    client_group_t **bit_groups[64];
+    size_t bit_count[64];
+    /* Clients with a glitch filter or a statistics subscription. */
+    size_t staged_count;
+    client_stages_t *staged;
+    /* Capture thread scratch: the groups touched by the current batch. */
+    client_group_t **touched;
+    client_t *clients[];
+} client_set_t;
+
 pthread_t clients_thread;
 int server_socket;
+int tcp_socket = -1;
+int ring_fd = -1;
+int epoll_fd;
+int wake_fd;
+int timer_fd;
+unsigned int stats_interval = 10;
 bool exit_flag = false;
 
-LIST_HEAD(clients_list, client) clients_head;
-struct clients_list *clients;
+_Atomic(client_set_t *) clients;
+
+/* Incremented when the capture thread enters and leaves on_capture_edges,
+ * so it is odd while a fanout pass may be holding a snapshot. */
+atomic_uint_fast64_t fanout_epoch;
+
+/* Set when samples were queued since the clients thread last drained the
+ * wake eventfd, so the capture thread writes it at most once per drain. */
+atomic_bool clients_pending;
+/* Set when some client was marked closing and has to be removed. */
+atomic_bool clients_closing;
+/* Clients the capture thread queued something for since the clients thread
+ * last flushed them: a stack the capture thread pushes onto, and the clients
+ * thread takes whole. */
+_Atomic(client_t *) pending_clients;
+
+clients_stats_t clients_stats;
+
+/* Clients thread only: latencies of the runs filed and of the edges sent
+ * since the last report, while tracing. */
+static struct {
+    trace_histogram_t fanout;
+    trace_histogram_t queue;
+    trace_histogram_t total;
+} latency;
+
+/* Clients thread only: the clients waiting for their send interval, in a
+ * min-heap by flush_at. */
+static struct {
+    client_t **heap;
+    size_t len;
+    size_t cap;
+} deferred;
+
+
+static void watch_fd(int fd, uint32_t events, void *ptr) {
+    struct epoll_event ev = { .events = events, .data.ptr = ptr };
+    if (0 != epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        perror("epoll_ctl failed");
+        exit(1);
+    }
+}
+
+
+static client_set_t *new_client_set(size_t count) {
+    client_set_t *set = malloc(sizeof(*set) + count * sizeof(set->clients[0]));
+    if (set == NULL) {
+        perror("Failed to allocate client set");
+        exit(1);
+    }
+    memset(set, 0, sizeof(*set));
+    set->count = count;
+    return set;
+}
+
+
+static void free_client_set(client_set_t *set) {
+    free(set->groups);
+    free(set->grouped);
+    free(set->touched);
+    free(set->staged);
+    free(set->bit_groups[0]);
+    free(set);
+}
+
+
+static int compare_client_masks(const void *a, const void *b) {
+    uint64_t x = (*(client_t * const *) a)->mask;
+    uint64_t y = (*(client_t * const *) b)->mask;
+    return x < y ? -1 : x > y;
+}
+
+
+/* Builds the mask groups and the per-bit index of set->clients. */
+static void index_client_set(client_set_t *set) {
+    size_t count = set->count;
+    set->groups = malloc(count * sizeof(set->groups[0]) + 1);
+    set->grouped = malloc(count * sizeof(set->grouped[0]) + 1);
+    set->touched = malloc(count * sizeof(set->touched[0]) + 1);
+    set->staged = malloc(count * sizeof(set->staged[0]) + 1);
+    if (set->groups == NULL || set->grouped == NULL || set->touched == NULL
+            || set->staged == NULL) {
+        perror("Failed to allocate client index");
+        exit(1);
+    }
+
+    size_t n = 0;
+    set->staged_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        client_t *c = set->clients[i];
+        if (c->mask == 0) {
+            continue;
+        }
+        set->grouped[n++] = c;
+        if (c->filter_config != NULL || c->buckets_width != 0
+                || c->decoder_config != NULL || c->trigger_config != NULL) {
+            client_stages_t *st = &set->staged[set->staged_count++];
+            st->client = c;
+            st->mask = c->mask;
+            st->filter = c->filter_config;
+            st->buckets_width = c->buckets_width;
+            st->decoder = c->decoder_config;
+            st->trigger = c->trigger_config;
+        }
+    }
+    qsort(set->grouped, n, sizeof(set->grouped[0]), compare_client_masks);
+
+    size_t entries = 0;
+    set->groups_count = 0;
+    set->mask = 0;
+    for (size_t i = 0; i < n; ) {
+        client_group_t *g = &set->groups[set->groups_count++];
+        g->mask = set->grouped[i]->mask;
+        g->clients = &set->grouped[i];
+        g->count = 0;
+        g->batch = 0;
+        g->edge = 0;
+        while (i < n && set->grouped[i]->mask == g->mask) {
+            g->count++;
+            i++;
+        }
+        set->mask |= g->mask;
+        entries += __builtin_popcountll(g->mask);
+    }
+
+    client_group_t **index = malloc(entries * sizeof(index[0]) + 1);
+    if (index == NULL) {
+        perror("Failed to allocate client index");
+        exit(1);
+    }
+    for (int b = 0; b < 64; b++) {
+        set->bit_groups[b] = index;
+        set->bit_count[b] = 0;
+        for (size_t g = 0; g < set->groups_count; g++) {
+            if ((set->groups[g].mask >> b) & 1) {
+                index[set->bit_count[b]++] = &set->groups[g];
+            }
+        }
+        index += set->bit_count[b];
+    }
+}
+
+
+/* Waits for the capture thread to leave a fanout pass that might have loaded
+ * a snapshot replaced before this call. */
+static void synchronize_clients() {
+    uint_fast64_t epoch = atomic_load(&fanout_epoch);
+    if (epoch & 1) {
+        while (atomic_load(&fanout_epoch) == epoch) {
+            sched_yield();
+        }
+    }
+}
+
+
+/* Asks the capture source for the channels that someone consumes. The
+ * shared-memory ring and the recording take every channel. */
+static void select_channels(client_set_t *set) {
+    if (shm_enabled() || record_enabled() || history_enabled()
+            || archive_enabled()) {
+        capture_select(UINT64_MAX);
+    } else {
+        capture_select(set->mask);
+    }
+}
+
+
+static bool set_tcp_option(int sock, int option, int value) {
+    if (0 != setsockopt(sock, IPPROTO_TCP, option, &value, sizeof(value))) {
+        log_msg(LOG_ERROR, "setsockopt failed: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+
+static uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
 
 
-static client_t *new_client() {
-    pthread_mutex_lock(&clients_mutex);
+static client_t *new_client(int sock, bool tcp) {
     client_t *c = (client_t*) malloc(sizeof(*c));
     if (c == NULL) {
         perror("Failed to allocate client");
         exit(1);
     }
     memset(c, 0, sizeof(*c));
-    LIST_INSERT_HEAD(&clients_head, c, entries);
-    pthread_mutex_unlock(&clients_mutex);
+    c->sock = sock;
+    atomic_init(&c->closing, false);
+    atomic_init(&c->flush_pending, false);
+    c->mask = 0;
+    atomic_init(&c->policy, PROTO_POLICY_DISCONNECT);
+    atomic_init(&c->bucket, 1);
+    atomic_init(&c->max_bytes, CLIENT_MAX_BYTES);
+    c->writable = true;
+    c->stage = CLIENT_UNIDENTIFIED;
+    c->in_len = 0;
+    c->out = uring_buffer_alloc();
+    if (c->out == NULL) {
+        c->out = malloc(CLIENT_OUT_SIZE);
+        if (c->out == NULL) {
+            perror("Failed to allocate client buffer");
+            exit(1);
+        }
+    }
+    c->out_len = 0;
+    c->out_sent = 0;
+    c->out_fd = -1;
+    c->shm_requested = false;
+    c->tcp = tcp;
+    c->corked = tcp && set_tcp_option(c->sock, TCP_CORK, 1);
+    c->produce = c->consume = edge_ring_new(CLIENT_RING_SIZE);
+    if (c->produce == NULL
+            || !mask_ring_init(&c->masks, CLIENT_MASK_CHANGES)) {
+        perror("Failed to allocate client buffer");
+        exit(1);
+    }
+    watch_fd(sock, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, c);
+
+    client_set_t *old = atomic_load(&clients);
+    client_set_t *set = new_client_set(old->count + 1);
+    memcpy(set->clients, old->clients, old->count * sizeof(old->clients[0]));
+    set->clients[old->count] = c;
+    index_client_set(set);
+    atomic_store(&clients, set);
+    synchronize_clients();
+    free_client_set(old);
     return c;
 }
 
 
-static void poll_clients() {
-    fd_set readfds, writefds, exceptfds;
-    if (LIST_EMPTY(&clients_head)) {
+static void free_client(client_t *c) {
+    while (c->consume != NULL) {
+        edge_ring_t *next = atomic_load(&c->consume->next);
+        edge_ring_delete(c->consume);
+        c->consume = next;
+    }
+    mask_ring_destroy(&c->masks);
+    filter_free(&c->filter);
+    free(c->filter_config);
+    aggregate_free(&c->aggregate);
+    if (c->buckets != NULL) {
+        bucket_ring_delete(c->buckets);
+    }
+    decoder_free(&c->decoder);
+    free(c->decoder_config);
+    trigger_free(&c->trigger);
+    free(c->trigger_config);
+    if (c->symbols != NULL) {
+        symbol_ring_delete(c->symbols);
+    }
+    if (!uring_buffer_free(c->out)) {
+        free(c->out);
+    }
+    free(c->queue_latency);
+    free(c->total_latency);
+    free(c);
+}
+
+
+static void swap_deferred(size_t a, size_t b) {
+    client_t *c = deferred.heap[a];
+    deferred.heap[a] = deferred.heap[b];
+    deferred.heap[b] = c;
+    deferred.heap[a]->deferred_slot = a + 1;
+    deferred.heap[b]->deferred_slot = b + 1;
+}
+
+
+/* Restores the heap order around slot `i`. */
+static void sift_deferred(size_t i) {
+    client_t **heap = deferred.heap;
+    while (i > 0 && heap[i]->flush_at < heap[(i - 1) / 2]->flush_at) {
+        swap_deferred(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (true) {
+        size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < deferred.len && heap[l]->flush_at < heap[min]->flush_at) {
+            min = l;
+        }
+        if (r < deferred.len && heap[r]->flush_at < heap[min]->flush_at) {
+            min = r;
+        }
+        if (min == i) {
+            return;
+        }
+        swap_deferred(i, min);
+        i = min;
+    }
+}
+
+
+static void add_deferred(client_t *c) {
+    if (c->deferred_slot != 0) {
+        return;
+    }
+    if (deferred.len == deferred.cap) {
+        size_t cap = deferred.cap ? 2 * deferred.cap : 64;
+        client_t **heap = realloc(deferred.heap, cap * sizeof(heap[0]));
+        if (heap == NULL) {
+            perror("Failed to allocate deferred clients");
+            exit(1);
+        }
+        deferred.heap = heap;
+        deferred.cap = cap;
+    }
+    deferred.heap[deferred.len] = c;
+    c->deferred_slot = ++deferred.len;
+    sift_deferred(deferred.len - 1);
+}
+
+
+static void remove_deferred(client_t *c) {
+    if (c->deferred_slot == 0) {
         return;
     }
+    size_t i = c->deferred_slot - 1;
+    c->deferred_slot = 0;
+    if (i != --deferred.len) {
+        deferred.heap[i] = deferred.heap[deferred.len];
+        deferred.heap[i]->deferred_slot = i + 1;
+        sift_deferred(i);
+    }
+}
+
 
-    pthread_mutex_lock(&clients_mutex);
+static void push_pending(client_t *c) {
+    client_t *head = atomic_load(&pending_clients);
+    do {
+        c->pending_next = head;
+    } while (!atomic_compare_exchange_weak(&pending_clients, &head, c));
+}
+
+
+/* Capture thread: has the clients thread flush the client on its next
+ * wake-up. */
+static void mark_pending(client_t *c) {
+    if (!atomic_exchange(&c->flush_pending, true)) {
+        push_pending(c);
+    }
+}
 
-    FD_ZERO(&readfds);
-    FD_ZERO(&writefds);
-    FD_ZERO(&exceptfds);
-    client_t *c;
-    int max_socket = 0;
 
-    LIST_FOREACH(c, &clients_head, entries) {
-        int sock = c->sock;
-        FD_SET(sock, &readfds);
-        FD_SET(sock, &writefds);
-        //FD_SET(sock, &exceptfds);
-        if (sock > max_socket) {
-            max_socket = sock;
+/* Takes the closing clients off the pending list, once the capture thread
+ * can no longer put them back, and leaves the others on it. */
+static void unlink_closed_pending() {
+    client_t *c = atomic_exchange(&pending_clients, NULL);
+    while (c != NULL) {
+        client_t *next = c->pending_next;
+        if (atomic_load(&c->closing)) {
+            atomic_store(&c->flush_pending, false);
+        } else {
+            push_pending(c);
         }
+        c = next;
     }
+}
 
-    struct timeval timeout = { 0 };
-    int res = select(max_socket+1, &readfds, NULL, NULL, &timeout);
-    if (res == -1) {
-        perror("select clients failed");
+
+static void remove_closed_clients() {
+    client_set_t *old = atomic_load(&clients);
+    client_set_t *set = new_client_set(old->count);
+    set->count = 0;
+    for (size_t i = 0; i < old->count; i++) {
+        if (!atomic_load(&old->clients[i]->closing)) {
+            set->clients[set->count++] = old->clients[i];
+        }
+    }
+    if (set->count == old->count) {
+        free(set);
+        return;
     }
 
-    LIST_FOREACH(c, &clients_head, entries) {
-        int sock = c->sock;
-        size_t buf_size = sizeof(c->buffer[0]) * c->buffer_idx;
-        
-        if (FD_ISSET(sock, &exceptfds)) {
-            uint8_t buf[16];
-            ssize_t recv_r = recv(sock, buf, 16, MSG_OOB | MSG_DONTWAIT);
-            if (recv_r == -1) {
-                perror("recv MSG_OOB failed");
-                c->closing = true;
-            } else {
-                fprintf(stderr, "Client %d sent OOB data:", sock);
-                for (unsigned int i = 0; i < recv_r; i++) {
-                    fprintf(stderr, " %02x", buf[i]);
-                }
-                fprintf(stderr, "\n");
+    index_client_set(set);
+    atomic_store(&clients, set);
+    synchronize_clients();
+    select_channels(set);
+    unlink_closed_pending();
+
+    size_t kept = 0;
+    for (size_t i = 0; i < old->count; i++) {
+        client_t *c = old->clients[i];
+        if (kept < set->count && set->clients[kept] == c) {
+            kept++;
+            continue;
+        }
+        uint64_t overflows = counter_get(&c->overflows);
+        uint64_t dropped = counter_get(&c->dropped);
+        uint64_t coalesced = counter_get(&c->coalesced);
+        uint64_t filtered = counter_get(&c->filtered);
+        log_msg(LOG_INFO, "Client %d closing (%lu bytes sent, %lu overflows, "
+                "%lu dropped, %lu coalesced, %lu filtered)", c->sock,
+                counter_get(&c->bytes_sent), overflows, dropped, coalesced,
+                filtered);
+        counter_add(&clients_stats.overflows, overflows);
+        counter_add(&clients_stats.dropped, dropped);
+        counter_add(&clients_stats.coalesced, coalesced);
+        counter_add(&clients_stats.filtered, filtered);
+        counter_add(&clients_stats.disconnects, 1);
+        if (c->total_latency != NULL) {
+            log_msg(LOG_INFO, "Client %d latency: p50 %lu us, p99 %lu us, "
+                    "max %lu us", c->sock,
+                    trace_percentile(c->total_latency, 50) / 1000,
+                    trace_percentile(c->total_latency, 99) / 1000,
+                    c->total_latency->max / 1000);
+        }
+        remove_deferred(c);
+        if (c->in_flight) {
+            /* Fails the send, rather than wait for the peer to take it. */
+            shutdown(c->sock, SHUT_RDWR);
+        }
+        if (-1 == close(c->sock)) {
+            log_msg(LOG_ERROR, "close failed: %s", strerror(errno));
+        }
+        if (c->in_flight) {
+            c->orphaned = true;
+        } else {
+            free_client(c);
+        }
+    }
+    free_client_set(old);
+}
+
+
+/* Publishes a snapshot indexed by the clients' current masks. */
+static void reindex_clients() {
+    client_set_t *old = atomic_load(&clients);
+    client_set_t *set = new_client_set(old->count);
+    memcpy(set->clients, old->clients, old->count * sizeof(old->clients[0]));
+    index_client_set(set);
+    atomic_store(&clients, set);
+    synchronize_clients();
+    select_channels(set);
+    free_client_set(old);
+}
+
+
+static void close_client(client_t *c) {
+    atomic_store(&c->closing, true);
+    atomic_store(&clients_closing, true);
+}
+
+
+static void wake_clients() {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        log_msg(LOG_ERROR, "eventfd write failed: %s", strerror(errno));
+    }
+}
+
+
+/* Queues a PROTO_FRAME_GAP if the capture thread lost edges for this client
+ * since the last one. */
+static bool fill_client_gap(client_t *c, counter_t *counter, uint64_t *sent,
+        uint32_t reason) {
+    uint64_t lost = counter_get(counter);
+    if (lost == *sent) {
+        return false;
+    }
+    proto_gap_frame_t gap = { .count = lost - *sent, .reason = reason };
+    c->out_len = proto_encode_frame(PROTO_FRAME_GAP, &c->enc, &gap,
+            sizeof(gap), c->out, CLIENT_OUT_SIZE);
+    c->out_sent = 0;
+    *sent = lost;
+    return true;
+}
+
+
+/* Encodes the next run of queued statistics records, if any. */
+static bool fill_client_buckets(client_t *c) {
+    if (c->buckets == NULL) {
+        return false;
+    }
+    proto_bucket_t *first;
+    size_t pos, used;
+    size_t count = bucket_ring_peek(c->buckets, &first, &pos);
+    if (count == 0) {
+        return false;
+    }
+    c->out_len = proto_encode_records(PROTO_FRAME_BUCKETS, &c->enc, first,
+            sizeof(*first), count, c->out, CLIENT_OUT_SIZE, &used);
+    c->out_sent = 0;
+    bucket_ring_consume(c->buckets, pos, used);
+    return true;
+}
+
+
+/* Encodes the next run of decoded symbols, if any. */
+static bool fill_client_symbols(client_t *c) {
+    if (c->symbols == NULL) {
+        return false;
+    }
+    proto_symbol_t *first;
+    size_t pos, used;
+    size_t count = symbol_ring_peek(c->symbols, &first, &pos);
+    if (count == 0) {
+        return false;
+    }
+    c->out_len = proto_encode_records(PROTO_FRAME_SYMBOLS, &c->enc, first,
+            sizeof(*first), count, c->out, CLIENT_OUT_SIZE, &used);
+    c->out_sent = 0;
+    symbol_ring_consume(c->symbols, pos, used);
+    return true;
+}
+
+
+/* Has the encoder frame the edges from position `pos` of the consumer's ring
+ * with the mask they were queued under. Returns how many of the `count`
+ * edges from there share it. */
+static size_t follow_mask(client_t *c, size_t pos, size_t count) {
+    mask_change_t *change;
+    size_t at;
+    while (mask_ring_peek(&c->masks, &change, &at) != 0
+            && change->ring == c->consume) {
+        if (change->pos > pos) {
+            return change->pos - pos < count ? change->pos - pos : count;
+        }
+        c->enc.mask = change->mask;
+        mask_ring_consume(&c->masks, at, 1);
+    }
+    return count;
+}
+
+
+/* Moves the consumer on to the `next` ring, taking along the masks of the
+ * edges queued at the end of this one. */
+static void next_ring(client_t *c, edge_ring_t *next) {
+    follow_mask(c, SIZE_MAX, 0);
+    edge_ring_delete(c->consume);
+    c->consume = next;
+}
+
+
+/* Drops the live edges queued for a backfilling client: they are in the
+ * history already, which it reads instead. */
+static void discard_live_edges(client_t *c) {
+    while (true) {
+        capture_edge_t *first;
+        size_t pos;
+        size_t count = edge_ring_peek(c->consume, &first, &pos);
+        if (count != 0) {
+            edge_ring_consume(c->consume, pos, count);
+            follow_mask(c, pos + count, 0);
+            continue;
+        }
+        edge_ring_t *next = atomic_load(&c->consume->next);
+        if (next == NULL) {
+            return;
+        }
+        if (edge_ring_size(c->consume) == 0) {
+            next_ring(c, next);
+        }
+    }
+}
+
+
+/* Encodes the next run of edges from the history. Once there are none left
+ * the client switches to the live edges, skipping the ones it already got
+ * from the history. Every live edge was added to the history before it was
+ * queued, so the edges discarded meanwhile are all before that point. */
+static bool fill_client_backfill(client_t *c) {
+    if (!c->backfilling) {
+        return false;
+    }
+    discard_live_edges(c);
+
+    capture_edge_t edges[BACKFILL_EDGES];
+    uint64_t lost = c->backfill_lost;
+    size_t count = 0;
+    c->backfill_lost = 0;
+    if (lost == 0) {
+        count = history_read(&c->backfill, c->mask, edges, BACKFILL_EDGES,
+                &lost);
+    }
+    if (lost != 0) {
+        proto_gap_frame_t gap = { .count = lost, .reason = PROTO_GAP_HISTORY };
+        c->out_len = proto_encode_frame(PROTO_FRAME_GAP, &c->enc, &gap,
+                sizeof(gap), c->out, CLIENT_OUT_SIZE);
+        c->out_sent = 0;
+        return true;
+    }
+    if (count == 0) {
+        c->backfilling = false;
+        c->skip_live = true;
+        c->live_from = c->backfill.from;
+        log_msg(LOG_INFO, "Client %d caught up with the live edges at %lu",
+                c->sock, c->live_from);
+        return false;
+    }
+    /* The history is read with the latest mask. */
+    proto_encoder_t enc = c->enc;
+    enc.mask = c->mask;
+    size_t used;
+    c->out_len = proto_encode_edges(&enc, edges, count, c->out,
+            CLIENT_OUT_SIZE, &used);
+    c->out_sent = 0;
+    return true;
+}
+
+
+static trace_histogram_t *new_histogram() {
+    trace_histogram_t *h = calloc(1, sizeof(*h));
+    if (h == NULL) {
+        perror("Failed to allocate latency histogram");
+        exit(1);
+    }
+    return h;
+}
+
+
+/* Copies the sample indices of edges about to be sent, for trace_edges,
+ * before their slots go back to the capture thread. */
+static const uint64_t *copy_traced(const capture_edge_t *edges, size_t count) {
+    static uint64_t *idx;
+    static size_t cap;
+    if (count > cap) {
+        uint64_t *grown = realloc(idx, count * sizeof(idx[0]));
+        if (grown == NULL) {
+            perror("Failed to allocate trace buffer");
+            exit(1);
+        }
+        idx = grown;
+        cap = count;
+    }
+    for (size_t i = 0; i < count; i++) {
+        idx[i] = edges[i].idx;
+    }
+    return idx;
+}
+
+
+/* Records the latencies of the edges at `idx`, sent at `now`. Consecutive
+ * edges mostly come from the same run, so it is looked up once for all of
+ * them. */
+static void trace_edges(client_t *c, const uint64_t *idx, size_t count,
+        uint64_t now) {
+    if (c->total_latency == NULL) {
+        c->queue_latency = new_histogram();
+        c->total_latency = new_histogram();
+    }
+    trace_run_t run = { 0 };
+    for (size_t i = 0; i < count; i++) {
+        if ((idx[i] < run.idx || idx[i] >= run.end)
+                && !trace_lookup(idx[i], &run)) {
+            continue;
+        }
+        uint64_t queue = now > run.queued_ns ? now - run.queued_ns : 0;
+        uint64_t total = now > run.received_ns ? now - run.received_ns : 0;
+        trace_record(&latency.queue, queue);
+        trace_record(&latency.total, total);
+        trace_record(c->queue_latency, queue);
+        trace_record(c->total_latency, total);
+    }
+}
+
+
+/* Encodes a PROTO_FRAME_TIMESTAMP for the edge at `idx`, sent at `now`. */
+static size_t encode_timestamp(client_t *c, uint64_t idx, uint64_t now,
+        uint8_t *out, size_t size) {
+    proto_timestamp_frame_t frame = {
+        .idx = idx,
+        .sent_ns = trace_realtime(now),
+    };
+    trace_run_t run;
+    if (trace_lookup(idx, &run)) {
+        frame.received_ns = trace_realtime(run.received_ns);
+        frame.queued_ns = trace_realtime(run.queued_ns);
+    }
+    return proto_encode_frame(PROTO_FRAME_TIMESTAMP, &c->enc, &frame,
+            sizeof(frame), out, size);
+}
+
+
+/* Encodes the next run of queued edges into the output buffer. */
+static bool fill_client(client_t *c) {
+    while (true) {
+        if (fill_client_gap(c, &c->dropped, &c->dropped_sent, PROTO_GAP_DROPPED)
+                || fill_client_gap(c, &c->coalesced, &c->coalesced_sent,
+                    PROTO_GAP_COALESCED)
+                || fill_client_buckets(c)
+                || fill_client_symbols(c)
+                || fill_client_backfill(c)) {
+            return true;
+        }
+
+        capture_edge_t *first;
+        size_t pos;
+        size_t count = edge_ring_peek(c->consume, &first, &pos);
+        if (count == 0) {
+            edge_ring_t *next = atomic_load(&c->consume->next);
+            if (next == NULL) {
+                return false;
+            }
+            /* The producer links `next` only after its last push here, so
+             * once this ring is seen empty it stays empty. */
+            if (edge_ring_size(c->consume) == 0) {
+                next_ring(c, next);
+            }
+            continue;
+        }
+        if (c->skip_live) {
+            size_t skip = 0;
+            while (skip < count && first[skip].idx < c->live_from) {
+                skip++;
+            }
+            if (skip != 0) {
+                edge_ring_consume(c->consume, pos, skip);
+                continue;
+            }
+            c->skip_live = false;
+        }
+        count = follow_mask(c, pos, count);
+
+        size_t used;
+        uint64_t now = trace_enabled() ? trace_now() : 0;
+        size_t stamp = 0;
+        if (c->timestamps) {
+            stamp = encode_timestamp(c, first[0].idx, now, c->out,
+                    CLIENT_OUT_SIZE);
+        }
+        c->out_len = proto_encode_edges(&c->enc, first, count,
+                c->out + stamp, CLIENT_OUT_SIZE - stamp, &used);
+        if (c->out_len != 0) {
+            c->out_len += stamp;
+        }
+        c->out_sent = 0;
+        const uint64_t *traced = now != 0 ? copy_traced(first, used) : NULL;
+        if (edge_ring_consume(c->consume, pos, used)) {
+            if (traced != NULL) {
+                trace_edges(c, traced, used, now);
             }
+            return c->out_len != 0;
         }
+        /* Dropped under our feet: report the gap, then encode again. */
+        c->out_len = 0;
+    }
+}
+
+
+/* Queues the reply to PROTO_MSG_SHM, with the memfd attached. */
+static void fill_client_shm(client_t *c) {
+    proto_shm_frame_t frame = { .size = 0, .head = 0 };
+    c->out_fd = -1;
+    if (shm_enabled() && !c->tcp) {
+        frame.size = shm_size();
+        frame.head = shm_head();
+        c->out_fd = shm_fd();
+    }
+    c->out_len = proto_encode_frame(PROTO_FRAME_SHM, &c->enc, &frame,
+            sizeof(frame), c->out, CLIENT_OUT_SIZE);
+    c->out_sent = 0;
+    c->shm_requested = false;
+}
+
+
+static ssize_t send_client(client_t *c, size_t length) {
+    uint8_t *buf = c->out + c->out_sent;
+    if (c->out_fd == -1) {
+        return send(c->sock, buf, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+
+    struct iovec iov = { .iov_base = buf, .iov_len = length };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &c->out_fd, sizeof(int));
+
+    ssize_t send_r = sendmsg(c->sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (send_r > 0) {
+        c->out_fd = -1;
+    }
+    return send_r;
+}
+
+
+/* True if a client with a send interval should keep waiting: the interval
+ * is not over and fewer than `batch` edges are queued. */
+static bool defer_client(client_t *c) {
+    if (c->interval_ns == 0 || c->stage != CLIENT_STREAMING
+            || c->out_sent != c->out_len) {
+        return false;
+    }
+    uint64_t now = monotonic_ns();
+    if (now < c->flush_at
+            && (c->batch == 0 || edge_ring_size(c->consume) < c->batch)) {
+        add_deferred(c);
+        return true;
+    }
+    remove_deferred(c);
+    c->flush_at = now + c->interval_ns;
+    return false;
+}
+
+
+static void count_sent(client_t *c, size_t sent) {
+    counter_add(&c->bytes_sent, sent);
+    counter_add(&clients_stats.bytes_sent, sent);
+    c->out_sent += sent;
+    c->unpushed = true;
+}
+
 
-        if (FD_ISSET(sock, &readfds)) {
-            ssize_t recv_r = recv(sock, &c->mask, sizeof(c->mask), MSG_DONTWAIT);
-            if (recv_r == sizeof(c->mask)) {
-                fprintf(stderr, "Client %d set mask %lx\n", sock, c->mask);
+/* Sends as much as the socket accepts. When the socket fills up the client
+ * waits for the next EPOLLOUT and resumes from out_sent. With io_uring, the
+ * send is queued instead, and the client resumes on its completion. */
+static void flush_client(client_t *c) {
+    if (c->in_flight || defer_client(c)) {
+        return;
+    }
+    while (c->writable && !atomic_load(&c->closing)) {
+        if (c->out_sent == c->out_len) {
+            if (c->shm_requested) {
+                fill_client_shm(c);
+            } else if (!fill_client(c)) {
+                break;
+            }
+        }
+        size_t buf_size = c->out_len - c->out_sent;
+        /* File descriptors still go with sendmsg. */
+        if (uring_enabled() && c->out_fd == -1
+                && uring_send(c->sock, c->out + c->out_sent, buf_size, c)) {
+            c->in_flight = true;
+            return;
+        }
+        ssize_t send_r = send_client(c, buf_size);
+        if (send_r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                c->writable = false;
             } else {
-                c->closing = true;
-                if (recv_r == 0) {
-                    fprintf(stderr, "Client %d disconnected\n", sock);
-                } else if (recv_r == -1) {
-                    perror("recv failed");
-                } else {
-                    fprintf(stderr, "Unexpected read from client %d\n", sock);
-                }
+                log_msg(LOG_ERROR, "send failed: %s", strerror(errno));
+                close_client(c);
+            }
+            continue;
+        }
+        count_sent(c, send_r);
+        if ((size_t) send_r < buf_size) {
+            c->writable = false;
+        }
+    }
+    /* Out of frames: let the last partial segment go. */
+    if (c->corked && c->unpushed && c->writable) {
+        set_tcp_option(c->sock, TCP_CORK, 0);
+        set_tcp_option(c->sock, TCP_CORK, 1);
+        c->unpushed = false;
+    }
+}
+
+
+/* Completion of an io_uring send from flush_client. */
+static void complete_send(void *data, int res) {
+    client_t *c = data;
+    c->in_flight = false;
+    if (c->orphaned) {
+        free_client(c);
+        return;
+    }
+    if (res < 0) {
+        if (res == -EAGAIN || res == -EWOULDBLOCK) {
+            c->writable = false;
+        } else if (!atomic_load(&c->closing)) {
+            log_msg(LOG_ERROR, "send failed: %s", strerror(-res));
+            close_client(c);
+        }
+        return;
+    }
+    count_sent(c, res);
+    flush_client(c);
+}
+
+
+/* The edges already queued keep the old mask: the encoder switches over
+ * when it reaches the first one queued under the new mask. */
+static void set_client_mask(client_t *c, uint64_t mask) {
+    if (c->mask != mask) {
+        c->mask = mask;
+        reindex_clients();
+    }
+    log_msg(LOG_INFO, "Client %d set mask %lx", c->sock, mask);
+}
+
+
+/* Publishes the client's new filter settings, then frees the old ones once
+ * the capture thread has moved on to the new snapshot. */
+static void set_client_filter(client_t *c, const proto_filter_msg_t *msg) {
+    filter_config_t *old = c->filter_config;
+    filter_config_t *config = filter_config_new(old);
+    filter_config_set(config, msg->channels, msg->min_high, msg->min_low,
+            msg->holdoff);
+    if (config->channels == 0) {
+        free(config);
+        config = NULL;
+    }
+    c->filter_config = config;
+    reindex_clients();
+    free(old);
+    log_msg(LOG_INFO, "Client %d filters channels %lx: high %u, low %u, "
+            "hold-off %u samples", c->sock, msg->channels, msg->min_high,
+            msg->min_low, msg->holdoff);
+}
+
+
+static void set_client_buckets(client_t *c, uint64_t width) {
+    uint64_t min = capture_samplerate() / AGGREGATE_MAX_RATE;
+    if (width != 0 && width < min) {
+        log_msg(LOG_WARN, "Client %d asked for buckets of %lu samples, "
+                "raised to %lu", c->sock, width, min);
+        width = min;
+    }
+    if (width != 0 && c->buckets == NULL) {
+        c->buckets = bucket_ring_new(CLIENT_RING_SIZE);
+        if (c->buckets == NULL) {
+            perror("Failed to allocate client buffer");
+            exit(1);
+        }
+    }
+    if (c->buckets_width != width) {
+        c->buckets_width = width;
+        reindex_clients();
+    }
+    log_msg(LOG_INFO, "Client %d set bucket width %lu", c->sock, width);
+}
+
+
+/* Publishes the client's new decoder, which also sets its mask to the
+ * decoded channels, then frees the old one. Invalid settings keep the old
+ * decoder. */
+static void set_client_decoder(client_t *c, const proto_decode_msg_t *msg) {
+    decoder_config_t *old = c->decoder_config;
+    decoder_config_t *config = NULL;
+    if (msg->decoder != PROTO_DECODE_NONE) {
+        config = decoder_config_new(msg, capture_samplerate());
+        if (config == NULL) {
+            log_msg(LOG_WARN, "Client %d asked for an invalid decoder",
+                    c->sock);
+            return;
+        }
+        if (c->symbols == NULL) {
+            c->symbols = symbol_ring_new(CLIENT_RING_SIZE);
+            if (c->symbols == NULL) {
+                perror("Failed to allocate client buffer");
+                exit(1);
+            }
+        }
+    }
+    c->decoder_config = config;
+    if (config != NULL && c->mask != config->mask) {
+        set_client_mask(c, config->mask);
+    } else {
+        reindex_clients();
+    }
+    free(old);
+    log_msg(LOG_INFO, "Client %d set decoder %s", c->sock,
+            decoder_name(msg->decoder) ? decoder_name(msg->decoder) : "?");
+}
+
+
+/* Publishes the client's new trigger, then frees the old one. Invalid
+ * settings keep the old trigger. */
+static void set_client_trigger(client_t *c, const proto_trigger_msg_t *msg) {
+    trigger_config_t *old = c->trigger_config;
+    trigger_config_t *config = NULL;
+    if (msg->stages != 0) {
+        config = trigger_config_new(msg);
+        if (config == NULL) {
+            log_msg(LOG_WARN, "Client %d asked for an invalid trigger",
+                    c->sock);
+            return;
+        }
+        if (config->channels & ~c->mask) {
+            log_msg(LOG_WARN, "Client %d triggers on channels %lx outside "
+                    "its mask", c->sock, config->channels & ~c->mask);
+        }
+    }
+    c->trigger_config = config;
+    reindex_clients();
+    free(old);
+    log_msg(LOG_INFO, "Client %d set a %u-stage trigger, window -%lu/+%lu "
+            "samples", c->sock, msg->stages, msg->pre, msg->post);
+}
+
+
+/* Starts sending the client the history from a sample index or time on. */
+static void set_client_backfill(client_t *c, const proto_backfill_msg_t *msg) {
+    if (!history_enabled()) {
+        log_msg(LOG_WARN, "Client %d asked for a backfill, but there is no "
+                "history", c->sock);
+        return;
+    }
+    if (c->filter_config != NULL || c->buckets_width != 0
+            || c->decoder_config != NULL || c->trigger_config != NULL) {
+        log_msg(LOG_WARN, "Client %d can only backfill plain edges", c->sock);
+        return;
+    }
+    uint64_t idx = msg->from_idx;
+    if (msg->from_ns != 0) {
+        uint64_t start_ns = capture_start_ns();
+        uint64_t rate = capture_samplerate();
+        uint64_t ns = msg->from_ns > start_ns ? msg->from_ns - start_ns : 0;
+        idx = ns / 1000000000 * rate + ns % 1000000000 * rate / 1000000000;
+    }
+    c->backfill_lost = history_seek(&c->backfill, idx);
+    c->backfilling = true;
+    c->skip_live = false;
+    log_msg(LOG_INFO, "Client %d backfills from sample %lu", c->sock, idx);
+    flush_client(c);
+}
+
+
+static void set_client_socket(client_t *c, const proto_socket_msg_t *msg) {
+    bool waiting = c->deferred_slot != 0;
+    remove_deferred(c);
+    if (c->tcp) {
+        set_tcp_option(c->sock, TCP_CORK, !msg->nodelay);
+        set_tcp_option(c->sock, TCP_NODELAY, msg->nodelay != 0);
+        c->corked = !msg->nodelay;
+    }
+    c->interval_ns = msg->interval_us * 1000ull;
+    c->batch = msg->batch;
+    c->flush_at = 0;
+    log_msg(LOG_INFO, "Client %d sends every %u us or %u edges%s", c->sock,
+            msg->interval_us, msg->batch,
+            c->tcp && msg->nodelay ? ", without delay" : "");
+    if (waiting) {
+        flush_client(c);
+    }
+}
+
+
+static void set_client_timestamps(client_t *c,
+        const proto_timestamps_msg_t *msg) {
+    if (msg->enable != 0 && !trace_enabled()) {
+        log_msg(LOG_INFO, "Client %d turned latency tracing on", c->sock);
+        trace_enable();
+    }
+    c->timestamps = msg->enable != 0;
+}
+
+
+static void identify_client(client_t *c, proto_encoding_t encoding,
+        uint8_t version) {
+    c->enc.encoding = encoding;
+    c->enc.version = version;
+    c->enc.samplerate = capture_samplerate();
+    c->enc.start_ns = capture_start_ns();
+}
+
+
+/* A legacy client gets the first 32 channels until it sends a mask, as it
+ * always did. */
+static void identify_legacy(client_t *c) {
+    identify_client(c, PROTO_ENC_LEGACY, 0);
+    c->stage = CLIENT_STREAMING;
+    set_client_mask(c, 0xffffffff);
+}
+
+
+static void handle_message(client_t *c, uint16_t type, const uint8_t *payload,
+        size_t length) {
+    if (type == PROTO_MSG_HELLO && c->stage == CLIENT_AWAITING_HELLO
+            && length >= sizeof(proto_hello_msg_t)) {
+        proto_hello_msg_t hello;
+        memcpy(&hello, payload, sizeof(hello));
+        proto_encoding_t encoding = hello.encoding;
+        if (encoding != PROTO_ENC_RAW && encoding != PROTO_ENC_COMPACT) {
+            encoding = PROTO_ENC_RAW;
+        }
+        uint8_t version = hello.version < PROTO_VERSION ? hello.version : PROTO_VERSION;
+        identify_client(c, encoding, version);
+        c->stage = CLIENT_STREAMING;
+        c->out_len = proto_encode_hello(&c->enc, c->out, CLIENT_OUT_SIZE);
+        c->out_sent = 0;
+        log_msg(LOG_INFO, "Client %d speaks protocol %u, %s encoding", c->sock,
+                version, proto_encoding_name(encoding));
+        set_client_mask(c, hello.mask);
+        flush_client(c);
+    } else if (type == PROTO_MSG_MASK && c->stage == CLIENT_STREAMING
+            && length >= sizeof(proto_mask_msg_t)) {
+        proto_mask_msg_t msg;
+        memcpy(&msg, payload, sizeof(msg));
+        set_client_mask(c, msg.mask);
+    } else if (type == PROTO_MSG_POLICY && c->stage == CLIENT_STREAMING
+            && length >= sizeof(proto_policy_msg_t)) {
+        proto_policy_msg_t msg;
+        memcpy(&msg, payload, sizeof(msg));
+        if (msg.policy >= PROTO_POLICY_COUNT) {
+            log_msg(LOG_WARN, "Client %d asked for unknown policy %u", c->sock,
+                    msg.policy);
+            return;
+        }
+        atomic_store(&c->bucket, msg.bucket ? msg.bucket : 1);
+        atomic_store(&c->max_bytes,
+                msg.max_bytes ? msg.max_bytes : CLIENT_MAX_BYTES);
+        atomic_store(&c->policy, msg.policy);
+        log_msg(LOG_INFO, "Client %d set backpressure policy %s", c->sock,
+                proto_policy_name(msg.policy));
+    } else if (type == PROTO_MSG_FILTER && c->stage == CLIENT_STREAMING
+            && length >= sizeof(proto_filter_msg_t)) {
+        proto_filter_msg_t msg;
+        memcpy(&msg, payload, sizeof(msg));
+        set_client_filter(c, &msg);
+    } else if (type == PROTO_MSG_BUCKETS && c->stage == CLIENT_STREAMING
+            && length >= sizeof(proto_buckets_msg_t)) {
+        proto_buckets_msg_t msg;
+        memcpy(&msg, payload, sizeof(msg));
+        set_client_buckets(c, msg.width);
+    } else if (type == PROTO_MSG_DECODE && c->stage == CLIENT_STREAMING
+            && length >= sizeof(proto_decode_msg_t)) {
+        proto_decode_msg_t msg;
+        memcpy(&msg, payload, sizeof(msg));
+        set_client_decoder(c, &msg);
+    } else if (type == PROTO_MSG_TRIGGER && c->stage == CLIENT_STREAMING
+            && length >= sizeof(proto_trigger_msg_t)) {
+        proto_trigger_msg_t msg;
+        memcpy(&msg, payload, sizeof(msg));
+        set_client_trigger(c, &msg);
+    } else if (type == PROTO_MSG_BACKFILL && c->stage == CLIENT_STREAMING
+            && length >= sizeof(proto_backfill_msg_t)) {
+        proto_backfill_msg_t msg;
+        memcpy(&msg, payload, sizeof(msg));
+        set_client_backfill(c, &msg);
+    } else if (type == PROTO_MSG_SOCKET && c->stage == CLIENT_STREAMING
+            && length >= sizeof(proto_socket_msg_t)) {
+        proto_socket_msg_t msg;
+        memcpy(&msg, payload, sizeof(msg));
+        set_client_socket(c, &msg);
+    } else if (type == PROTO_MSG_TIMESTAMPS && c->stage == CLIENT_STREAMING
+            && length >= sizeof(proto_timestamps_msg_t)) {
+        proto_timestamps_msg_t msg;
+        memcpy(&msg, payload, sizeof(msg));
+        set_client_timestamps(c, &msg);
+    } else if (type == PROTO_MSG_SHM && c->stage == CLIENT_STREAMING) {
+        if (!shm_enabled()) {
+            log_msg(LOG_WARN, "Client %d asked for shared memory, which is "
+                    "disabled", c->sock);
+        } else if (c->tcp) {
+            log_msg(LOG_WARN, "Client %d asked for shared memory over TCP",
+                    c->sock);
+        }
+        c->shm_requested = true;
+        flush_client(c);
+    } else {
+        log_msg(LOG_WARN, "Client %d sent unexpected message %u (%zu bytes)",
+                c->sock, type, length);
+        if (c->stage != CLIENT_STREAMING) {
+            close_client(c);
+        }
+    }
+}
+
+
+/* Consumes every complete message in c->in and keeps the remainder. */
+static void parse_input(client_t *c) {
+    size_t pos = 0;
+
+    if (c->stage == CLIENT_UNIDENTIFIED) {
+        if (c->in_len < PROTO_MAGIC_LEN) {
+            return;
+        }
+        remove_deferred(c);
+        if (0 == memcmp(c->in, PROTO_MAGIC, PROTO_MAGIC_LEN)) {
+            c->stage = CLIENT_AWAITING_HELLO;
+            pos = PROTO_MAGIC_LEN;
+        } else {
+            identify_client(c, PROTO_ENC_LEGACY, 0);
+            c->stage = CLIENT_STREAMING;
+        }
+    }
+
+    while (!atomic_load(&c->closing)) {
+        size_t avail = c->in_len - pos;
+        if (c->enc.encoding == PROTO_ENC_LEGACY && c->stage == CLIENT_STREAMING) {
+            uint64_t mask;
+            if (avail < sizeof(mask)) {
+                break;
             }
+            memcpy(&mask, c->in + pos, sizeof(mask));
+            set_client_mask(c, mask);
+            pos += sizeof(mask);
+        } else {
+            proto_msg_header_t header;
+            if (avail < sizeof(header)) {
+                break;
+            }
+            memcpy(&header, c->in + pos, sizeof(header));
+            if (header.length > CLIENT_IN_SIZE - sizeof(header)) {
+                log_msg(LOG_WARN, "Client %d sent oversized message", c->sock);
+                close_client(c);
+                break;
+            }
+            if (avail < sizeof(header) + header.length) {
+                break;
+            }
+            handle_message(c, header.type, c->in + pos + sizeof(header),
+                    header.length);
+            pos += sizeof(header) + header.length;
         }
+    }
 
-        if (buf_size > 0 && FD_ISSET(sock, &writefds)) {
-            ssize_t send_r = send(sock, c->buffer, buf_size, MSG_DONTWAIT);
-            if ((size_t) send_r == buf_size) {
-                c->buffer_idx = 0;
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+}
+
+
+static void read_client(client_t *c) {
+    int sock = c->sock;
+    while (!atomic_load(&c->closing)) {
+        ssize_t recv_r = recv(sock, c->in + c->in_len,
+                sizeof(c->in) - c->in_len, MSG_DONTWAIT);
+        if (recv_r > 0) {
+            c->in_len += recv_r;
+            parse_input(c);
+        } else if (recv_r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            close_client(c);
+            if (recv_r == 0) {
+                log_msg(LOG_INFO, "Client %d disconnected", sock);
             } else {
-                c->closing = true;
-                if (send_r == -1) {
-                    perror("send failed");
-                } else {
-                    fprintf(stderr, "Client %d couldn't keep up!\n", sock);
-                }
+                log_msg(LOG_ERROR, "recv failed: %s", strerror(errno));
+            }
+        }
+    }
+}
+
+
+/* Flushes the clients the capture thread queued something for. A client is
+ * taken off the list before it is flushed, so whatever is queued meanwhile
+ * puts it back. */
+static void flush_pending_clients() {
+    client_t *c = atomic_exchange(&pending_clients, NULL);
+    while (c != NULL) {
+        client_t *next = c->pending_next;
+        atomic_store(&c->flush_pending, false);
+        flush_client(c);
+        c = next;
+    }
+}
+
+
+static void flush_clients() {
+    uint64_t wakeups;
+    if (read(wake_fd, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN) {
+        log_msg(LOG_ERROR, "eventfd read failed: %s", strerror(errno));
+    }
+    atomic_store(&clients_pending, false);
+    flush_pending_clients();
+    if (trace_enabled()) {
+        trace_record_fanout(&latency.fanout);
+    }
+}
+
+
+/* Milliseconds until the first deferred client is due, or -1 for none. */
+static int deferred_timeout() {
+    if (deferred.len == 0) {
+        return -1;
+    }
+    uint64_t first = deferred.heap[0]->flush_at;
+    uint64_t now = monotonic_ns();
+    return first <= now ? 0 : (first - now + 999999) / 1000000;
+}
+
+
+static void flush_deferred_clients() {
+    uint64_t now = monotonic_ns();
+    while (deferred.len != 0 && deferred.heap[0]->flush_at <= now) {
+        client_t *c = deferred.heap[0];
+        remove_deferred(c);
+        if (c->stage == CLIENT_UNIDENTIFIED && c->in_len == 0) {
+            identify_legacy(c);
+        }
+        flush_client(c);
+    }
+}
+
+
+static void accept_clients(int listener) {
+    while (true) {
+        struct sockaddr_storage cli_addr;
+        socklen_t cli_addr_len = sizeof(cli_addr);
+        int cli_sock = accept(listener, (struct sockaddr *) &cli_addr, &cli_addr_len);
+        if (cli_sock == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_msg(LOG_ERROR, "accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+        log_msg(LOG_INFO, "Accepted client %d", cli_sock);
+        if (log_enabled(LOG_DEBUG)) {
+            char addr[3 * sizeof(cli_addr) + 1] = "";
+            for (unsigned int i = 0; i < cli_addr_len && i < sizeof(cli_addr); i++) {
+                sprintf(addr + 3 * i, " %02x", ((uint8_t*) &cli_addr)[i]);
+            }
+            log_msg(LOG_DEBUG, "Client %d is%s.", cli_sock, addr);
+        }
+        counter_add(&clients_stats.accepted, 1);
+        client_t *c = new_client(cli_sock, listener == tcp_socket);
+        c->flush_at = monotonic_ns() + CLIENT_IDENTIFY_NS;
+        add_deferred(c);
+    }
+}
+
+
+/* Capture thread: moves the client over to a ring twice as large, if its
+ * memory cap allows. */
+static bool grow_client(client_t *c) {
+    size_t size = 2 * edge_ring_capacity(c->produce);
+    uint64_t max_bytes = atomic_load_explicit(&c->max_bytes, memory_order_relaxed);
+    if (size * sizeof(capture_edge_t) > max_bytes) {
+        return false;
+    }
+    edge_ring_t *next = edge_ring_new(size);
+    if (next == NULL) {
+        return false;
+    }
+    atomic_store(&c->produce->next, next);
+    c->produce = next;
+    return true;
+}
+
+
+/* Capture thread: marks where the edges of the batch's mask start, for the
+ * clients thread. Drops a client that let the changes pile up. */
+static bool queue_mask(client_t *c) {
+    mask_change_t change = {
+        .ring = c->produce,
+        .pos = atomic_load_explicit(&c->produce->head, memory_order_relaxed),
+        .mask = c->batch_mask,
+    };
+    if (!mask_ring_push(&c->masks, &change)) {
+        counter_add(&c->overflows, 1);
+        close_client(c);
+        return false;
+    }
+    c->queued_mask = c->batch_mask;
+    return true;
+}
+
+
+/* Capture thread: queues one edge, applying the client's policy when its ring
+ * is full. Returns false once the client has been dropped. */
+static bool push_edge(client_t *c, int policy, const capture_edge_t *edge) {
+    if (c->queued_mask != c->batch_mask && !queue_mask(c)) {
+        return false;
+    }
+    if (edge_ring_push(c->produce, edge)
+            || (policy == PROTO_POLICY_GROW && grow_client(c)
+                && edge_ring_push(c->produce, edge))) {
+        counter_add(&c->queued, 1);
+        return true;
+    }
+    if (policy == PROTO_POLICY_DROP_OLDEST) {
+        counter_add(&c->dropped, edge_ring_push_overwrite(c->produce, edge));
+        counter_add(&c->queued, 1);
+        return true;
+    }
+    if (policy == PROTO_POLICY_COALESCE) {
+        counter_add(&c->dropped, 1);
+        return true;
+    }
+    counter_add(&c->overflows, 1);
+    close_client(c);
+    return false;
+}
+
+
+/* Capture thread: prepares a client for a new batch of edges under `mask`. */
+static void begin_client(client_t *c, uint64_t mask) {
+    c->batch_mask = mask;
+    int policy = atomic_load_explicit(&c->policy, memory_order_relaxed);
+    c->coalesce = policy == PROTO_POLICY_COALESCE
+        && edge_ring_size(c->produce) > edge_ring_capacity(c->produce) / 2;
+    c->have_pending = false;
+}
+
+
+static void begin_group(client_group_t *g) {
+    for (size_t i = 0; i < g->count; i++) {
+        begin_client(g->clients[i], g->mask);
+    }
+}
+
+
+/* Capture thread: queues an edge for a client, or holds it back while it
+ * may still be coalesced with the next one. */
+static void queue_edge(client_t *c, const capture_edge_t *edge) {
+    int policy = atomic_load_explicit(&c->policy, memory_order_relaxed);
+    if (!c->coalesce) {
+        push_edge(c, policy, edge);
+        return;
+    }
+    uint64_t bucket = atomic_load_explicit(&c->bucket, memory_order_relaxed);
+    if (c->have_pending && c->pending.idx / bucket == edge->idx / bucket) {
+        counter_add(&c->coalesced, 1);
+    } else if (c->have_pending) {
+        push_edge(c, policy, &c->pending);
+    }
+    c->pending = *edge;
+    c->have_pending = true;
+}
+
+
+/* Capture thread: an edge that made it through the client's filter feeds
+ * its decoder or its statistics, or is queued if it passes its trigger. */
+static void emit_edge(client_t *c, const capture_edge_t *edge) {
+    if (c->decoding) {
+        decoder_push(&c->decoder, c->decoding, edge);
+    } else if (c->aggregating) {
+        aggregate_push(&c->aggregate, edge);
+    } else if (c->triggering) {
+        const capture_edge_t *out;
+        size_t n = trigger_push(&c->trigger, c->triggering, edge, &out);
+        for (size_t i = 0; i < n; i++) {
+            queue_edge(c, &out[i]);
+        }
+    } else {
+        queue_edge(c, edge);
+    }
+}
+
+
+/* Capture thread: an edge of a group goes through the client's filter if
+ * it has one. */
+static void send_edge(client_t *c, const capture_edge_t *edge) {
+    if (atomic_load_explicit(&c->closing, memory_order_relaxed)) {
+        return;
+    }
+    if (c->filtering) {
+        filter_push(&c->filter, edge);
+    } else {
+        emit_edge(c, edge);
+    }
+}
+
+
+/* Capture thread: queues what the client held back in the batch. */
+static void end_client(client_t *c) {
+    if (c->have_pending
+            && !atomic_load_explicit(&c->closing, memory_order_relaxed)) {
+        int policy = atomic_load_explicit(&c->policy, memory_order_relaxed);
+        push_edge(c, policy, &c->pending);
+    }
+    c->have_pending = false;
+    mark_pending(c);
+}
+
+
+static void end_group(client_group_t *g) {
+    for (size_t i = 0; i < g->count; i++) {
+        end_client(g->clients[i]);
+    }
+}
+
+
+/* Capture thread: passes on the output of a client's filter as far as the
+ * samples before `end` decide it. Returns true if anything was queued. */
+static bool drain_filter(client_t *c, const filter_config_t *config,
+        uint64_t mask, uint64_t end) {
+    capture_edge_t out[64];
+    size_t n;
+    bool queued = false;
+
+    begin_client(c, mask);
+    do {
+        n = filter_pop(&c->filter, config, end, out, 64);
+        for (size_t i = 0; i < n; i++) {
+            if (!atomic_load_explicit(&c->closing, memory_order_relaxed)) {
+                emit_edge(c, &out[i]);
+                queued = true;
             }
         }
+    } while (n == 64);
+    end_client(c);
+    counter_add(&c->filtered, c->filter.suppressed);
+    c->filter.suppressed = 0;
+    return queued;
+}
+
+
+/* Capture thread: closes the client's buckets that end by `end`, the first
+ * sample whose level is not final yet, and queues their records. */
+static bool drain_aggregate(client_t *c, uint64_t end, uint64_t value) {
+    aggregate_t *a = &c->aggregate;
+    if (!a->started) {
+        aggregate_start(a, end, value);
+        return false;
+    }
+    aggregate_close(a, end);
+    if (a->out_len == 0
+            || atomic_load_explicit(&c->closing, memory_order_relaxed)) {
+        a->out_len = 0;
+        return false;
+    }
+    for (size_t i = 0; i < a->out_len; i++) {
+        if (bucket_ring_push(c->buckets, &a->out[i])) {
+            counter_add(&c->queued, 1);
+        } else {
+            counter_add(&c->dropped, 1);
+        }
+    }
+    a->out_len = 0;
+    mark_pending(c);
+    return true;
+}
+
+
+/* Capture thread: decodes what the samples before `end` decide, the first
+ * run only setting the starting level, and queues the symbols. */
+static bool drain_decoder(client_t *c, const decoder_config_t *config,
+        uint64_t end, uint64_t value) {
+    decoder_t *d = &c->decoder;
+    if (!d->started) {
+        decoder_start(d, value);
+        return false;
+    }
+    decoder_advance(d, config, end);
+    if (d->out_len == 0
+            || atomic_load_explicit(&c->closing, memory_order_relaxed)) {
+        d->out_len = 0;
+        return false;
+    }
+    for (size_t i = 0; i < d->out_len; i++) {
+        if (symbol_ring_push(c->symbols, &d->out[i])) {
+            counter_add(&c->queued, 1);
+        } else {
+            counter_add(&c->dropped, 1);
+        }
+    }
+    d->out_len = 0;
+    mark_pending(c);
+    return true;
+}
+
+
+/* Runs on the capture thread, once per run of samples. It never blocks on the
+ * clients thread: client buffers are lock-free rings and the client set is
+ * read through the epoch-protected snapshot pointer, which is entered once
+ * for the whole batch.
+ *
+ * Each edge visits only the groups subscribed to one of the bits that
+ * changed, and is masked once per group. A group is prepared the first time
+ * the batch reaches it and finished after the last edge.
+ *
+ * A PROTO_POLICY_COALESCE client whose ring is more than half full only gets
+ * the last edge of every `bucket` samples of the batch.
+ *
+ * The edges of a client with a glitch filter go into the filter instead, and
+ * whatever the filter decided by the end of the run is passed on afterwards.
+ * The edges of a client with a statistics subscription, filtered or not,
+ * only update its buckets, which are closed and queued at the end. A
+ * client with a protocol decoder gets the decoded symbols instead of edges
+ * or buckets, queued at the end of the run as well. The edges of a client
+ * with a trigger are queued only around its matches. */
+void on_capture_edges(const capture_edge_t *edges, size_t count,
+        uint64_t prev, uint64_t end) {
+    static uint64_t batch;
+    bool queued = false;
+
+    if (count != 0 && shm_enabled()) {
+        shm_publish(edges, count);
+    }
+    if (count != 0 && record_enabled()) {
+        record_append(edges, count);
+    }
+    if (count != 0 && history_enabled()) {
+        history_append(edges, count);
+    }
+    if (archive_enabled()) {
+        archive_append(edges, count, prev, end);
     }
 
-    LIST_FOREACH(c, &clients_head, entries) {
-        if (c->closing) {
-            fprintf(stderr, "Client %d closing\n", c->sock);
-            if (-1 == close(c->sock)) {
-                perror("close failed");
+    atomic_fetch_add(&fanout_epoch, 1);
+    client_set_t *set = atomic_load(&clients);
+    if (count == 0 && set->staged_count == 0) {
+        atomic_fetch_add(&fanout_epoch, 1);
+        return;
+    }
+    for (size_t j = 0; j < set->staged_count; j++) {
+        client_stages_t *st = &set->staged[j];
+        client_t *c = st->client;
+        if (st->filter != NULL) {
+            if (c->filter.generation != st->filter->generation) {
+                filter_reset(&c->filter, st->filter);
+            }
+            c->filtering = true;
+        }
+        if (st->decoder != NULL) {
+            if (c->decoder.generation != st->decoder->generation) {
+                decoder_reset(&c->decoder, st->decoder);
+            }
+            c->decoding = st->decoder;
+        } else if (st->buckets_width != 0) {
+            if (c->aggregate.width != st->buckets_width
+                    || c->aggregate.channels != st->mask) {
+                aggregate_reset(&c->aggregate, st->buckets_width, st->mask);
+            }
+            c->aggregating = true;
+        }
+        if (st->trigger != NULL) {
+            if (c->trigger.generation != st->trigger->generation) {
+                trigger_reset(&c->trigger, st->trigger);
+            }
+            c->triggering = st->trigger;
+        }
+    }
+    size_t touched = 0;
+    uint64_t p = prev;
+    batch++;
+    for (size_t k = 0; k < count; k++) {
+        uint64_t unit = edges[k].value;
+        uint64_t diff = (p ^ unit) & set->mask;
+        p = unit;
+        while (diff) {
+            int b = __builtin_ctzll(diff);
+            diff &= diff - 1;
+            for (size_t j = 0; j < set->bit_count[b]; j++) {
+                client_group_t *g = set->bit_groups[b][j];
+                if (g->batch != batch) {
+                    g->batch = batch;
+                    set->touched[touched++] = g;
+                    begin_group(g);
+                } else if (g->edge == k) {
+                    continue;
+                }
+                g->edge = k;
+                capture_edge_t edge = {
+                    .idx = edges[k].idx,
+                    .value = unit & g->mask,
+                };
+                for (size_t i = 0; i < g->count; i++) {
+                    send_edge(g->clients[i], &edge);
+                }
+                queued = true;
+            }
+        }
+    }
+    for (size_t j = 0; j < touched; j++) {
+        end_group(set->touched[j]);
+    }
+    uint64_t last = count != 0 ? edges[count - 1].value : prev;
+    for (size_t j = 0; j < set->staged_count; j++) {
+        client_stages_t *st = &set->staged[j];
+        client_t *c = st->client;
+        uint64_t settled = end;
+        uint64_t value = last & st->mask;
+        if (c->filtering) {
+            c->filtering = false;
+            queued |= drain_filter(c, st->filter, st->mask, end);
+            settled = filter_horizon(st->filter, end);
+            value = c->filter.out;
+        }
+        if (c->decoding != NULL) {
+            queued |= drain_decoder(c, c->decoding, settled, value);
+            c->decoding = NULL;
+        } else if (c->aggregating) {
+            c->aggregating = false;
+            queued |= drain_aggregate(c, settled, value);
+        }
+        if (c->triggering != NULL) {
+            if (!c->trigger.started) {
+                trigger_start(&c->trigger, value);
             }
-            LIST_REMOVE(c, entries);
-            free(c);
+            c->triggering = NULL;
         }
     }
+    atomic_fetch_add(&fanout_epoch, 1);
 
-    pthread_mutex_unlock(&clients_mutex);
+    if (queued && !atomic_exchange(&clients_pending, true)) {
+        wake_clients();
+    }
 }
 
 
-void on_capture_change(double time, uint64_t prev, uint64_t unit) {
-    client_t *c;
-    printf("%lf, %lx, %lx\n", time, prev, unit);
-    uint64_t diff = prev ^ unit;
+static void report_stats() {
+    static uint64_t last_samples, last_edges, last_bytes;
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) == -1) {
+        if (errno != EAGAIN) {
+            log_msg(LOG_ERROR, "timerfd read failed: %s", strerror(errno));
+        }
+        return;
+    }
+
+    client_set_t *set = atomic_load(&clients);
+    uint64_t overflows = counter_get(&clients_stats.overflows);
+    uint64_t dropped = counter_get(&clients_stats.dropped);
+    uint64_t coalesced = counter_get(&clients_stats.coalesced);
+    uint64_t filtered = counter_get(&clients_stats.filtered);
+    for (size_t i = 0; i < set->count; i++) {
+        overflows += counter_get(&set->clients[i]->overflows);
+        dropped += counter_get(&set->clients[i]->dropped);
+        coalesced += counter_get(&set->clients[i]->coalesced);
+        filtered += counter_get(&set->clients[i]->filtered);
+    }
+
+    uint64_t samples = counter_get(&capture_stats.samples);
+    uint64_t edges = counter_get(&capture_stats.edges);
+    uint64_t bytes = counter_get(&clients_stats.bytes_sent);
+    double seconds = (double) stats_interval * expirations;
+    log_msg(LOG_INFO, "%.0f samples/s, %.0f edges/s, %.0f bytes/s to %zu clients; "
+            "%lu packets (%lu dropped, %lu stalls), %lu overflows, "
+            "%lu edges dropped, %lu coalesced, %lu filtered, %lu disconnects",
+            (samples - last_samples) / seconds, (edges - last_edges) / seconds,
+            (bytes - last_bytes) / seconds, set->count,
+            counter_get(&capture_stats.packets),
+            counter_get(&capture_stats.dropped_packets),
+            counter_get(&capture_stats.stalls), overflows, dropped,
+            coalesced, filtered, counter_get(&clients_stats.disconnects));
+    last_samples = samples;
+    last_edges = edges;
+    last_bytes = bytes;
+
+    if (trace_enabled()) {
+        trace_record_fanout(&latency.fanout);
+    }
+    if (latency.total.count != 0) {
+        log_msg(LOG_INFO, "Latency p50/p99/max in us: %lu/%lu/%lu packet to "
+                "queue, %lu/%lu/%lu queue to send, %lu/%lu/%lu packet to send",
+                trace_percentile(&latency.fanout, 50) / 1000,
+                trace_percentile(&latency.fanout, 99) / 1000,
+                latency.fanout.max / 1000,
+                trace_percentile(&latency.queue, 50) / 1000,
+                trace_percentile(&latency.queue, 99) / 1000,
+                latency.queue.max / 1000,
+                trace_percentile(&latency.total, 50) / 1000,
+                trace_percentile(&latency.total, 99) / 1000,
+                latency.total.max / 1000);
+        memset(&latency, 0, sizeof(latency));
+    }
 
-    pthread_mutex_lock(&clients_mutex);
-    LIST_FOREACH(c, &clients_head, entries) {
-        uint64_t mask = c->mask;
-        if (!(mask & diff)) { continue; }
-        uint64_t value = unit & mask;
-        if (c->buffer_idx >= CLIENT_BUFF_SIZE) {
-            c->buffer_idx = 0;
-            fprintf(stderr, "\nBUFFER OVERFLOW FOR CLIENT %d\n", c->sock);
-            c->closing = true;
+    if (log_enabled(LOG_DEBUG)) {
+        for (size_t i = 0; i < set->count; i++) {
+            client_t *c = set->clients[i];
+            log_msg(LOG_DEBUG, "Client %d: %lu samples queued, %lu bytes sent, "
+                    "%lu overflows, %lu dropped, %lu coalesced, %lu filtered",
+                    c->sock, counter_get(&c->queued),
+                    counter_get(&c->bytes_sent), counter_get(&c->overflows),
+                    counter_get(&c->dropped), counter_get(&c->coalesced),
+                    counter_get(&c->filtered));
+            if (c->queue_latency != NULL) {
+                log_msg(LOG_DEBUG, "Client %d: p50/p99 %lu/%lu us queued, "
+                        "%lu/%lu us from the packet", c->sock,
+                        trace_percentile(c->queue_latency, 50) / 1000,
+                        trace_percentile(c->queue_latency, 99) / 1000,
+                        trace_percentile(c->total_latency, 50) / 1000,
+                        trace_percentile(c->total_latency, 99) / 1000);
+            }
         }
-        client_sample_t sample = { .time = time, .value = value };
-        c->buffer[c->buffer_idx++] = sample;
     }
-    pthread_mutex_unlock(&clients_mutex);
 }
 
 
 static void *clients_task(void *param) {
     UNUSED(param);
-    int res;
+    struct epoll_event events[CLIENT_EVENTS];
     while (!exit_flag) {
-        struct timeval timeout = { .tv_sec = 0, .tv_usec = 10000 };
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(server_socket, &readfds);
-        res = select(server_socket+1, &readfds, NULL, NULL, &timeout);
+        /* Everything the last pass queued goes in one system call. */
+        uring_submit();
+        int res = epoll_wait(epoll_fd, events, CLIENT_EVENTS,
+                deferred_timeout());
         if (res == -1) {
-            perror("select failed");
-        }
-        if (FD_ISSET(server_socket, &readfds)) {
-            struct sockaddr_un cli_addr;
-            socklen_t cli_addr_len = sizeof(cli_addr);
-            fprintf(stderr, "Accepting client...\n");
-            int cli_sock = accept(server_socket, (struct sockaddr *) &cli_addr, &cli_addr_len);
-            if (cli_sock == -1) {
-                perror("accept failed");
+            if (errno != EINTR) {
+                log_msg(LOG_ERROR, "epoll_wait failed: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        for (int i = 0; i < res; i++) {
+            void *ptr = events[i].data.ptr;
+            uint32_t ev = events[i].events;
+            if (ptr == &server_socket) {
+                accept_clients(server_socket);
+            } else if (ptr == &tcp_socket) {
+                accept_clients(tcp_socket);
+            } else if (ptr == &wake_fd) {
+                flush_clients();
+            } else if (ptr == &timer_fd) {
+                report_stats();
+            } else if (ptr == &ring_fd) {
+                uring_reap(complete_send);
             } else {
-                fprintf(stderr, "Accepted client %d\n", cli_sock);
-                fprintf(stderr, "Client %d is", cli_sock);
-                for (unsigned int i = 0; i < cli_addr_len && i < sizeof(cli_addr); i++) {
-                    fprintf(stderr, " %02x", ((uint8_t*) &cli_addr)[i]);
+                client_t *c = ptr;
+                if (ev & EPOLLIN) {
+                    read_client(c);
+                }
+                if ((ev & (EPOLLERR | EPOLLHUP)) && !atomic_load(&c->closing)) {
+                    log_msg(LOG_INFO, "Client %d hung up", c->sock);
+                    close_client(c);
+                }
+                if (ev & EPOLLOUT) {
+                    c->writable = true;
+                    flush_client(c);
                 }
-                fprintf(stderr, ".\n");
-                client_t *c = new_client(cli_sock);
-                c->sock = cli_sock;
-                c->buffer_idx = 0;
-                c->mask = 0xffffffff;
             }
         }
-        poll_clients();
-    
+
+        flush_deferred_clients();
+        if (atomic_exchange(&clients_closing, false)) {
+            remove_closed_clients();
+        }
     }
     return NULL;
 }
@@ -226,25 +2075,142 @@ static void sig_handler(int signo)
 }
 
 
-int main(int argc, char **argv) {
-    UNUSED(argc);
-    UNUSED(argv);
+/* Listens on `[host:]port`, on all addresses without a host. */
+static void listen_tcp(const char *spec) {
+    char host[256] = "";
+    const char *port = spec;
+    const char *colon = strrchr(spec, ':');
+    if (colon != NULL) {
+        snprintf(host, sizeof(host), "%.*s", (int) (colon - spec), spec);
+        port = colon + 1;
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE,
+    };
+    struct addrinfo *res;
+    int err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "\ncan't resolve %s: %s\n", spec, gai_strerror(err));
+        exit(1);
+    }
+    tcp_socket = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (-1 == tcp_socket) {
+        perror("socket failed");
+        exit(1);
+    }
+    int one = 1;
+    if (0 != setsockopt(tcp_socket, SOL_SOCKET, SO_REUSEADDR, &one,
+                sizeof(one))) {
+        perror("setsockopt failed");
+        exit(1);
+    }
+    if (0 != bind(tcp_socket, res->ai_addr, res->ai_addrlen)) {
+        perror("bind failed");
+        exit(1);
+    }
+    freeaddrinfo(res);
+    if (0 != listen(tcp_socket, SOMAXCONN)) {
+        perror("listen failed");
+        exit(1);
+    }
+    watch_fd(tcp_socket, EPOLLIN | EPOLLET, &tcp_socket);
+    log_msg(LOG_INFO, "Listening on TCP %s", spec);
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-v] [-q] [-s seconds] [-m slots] [-r file] [-a file.sr] [-H mb] [-t [host:]port] [-u entries] [-T] [-c source] [-j workers] [socket_path]\n", prog);
+    fprintf(stderr, "  -v          more verbose logging (repeatable)\n");
+    fprintf(stderr, "  -q          less verbose logging (repeatable)\n");
+    fprintf(stderr, "  -s seconds  statistics report interval, 0 to disable\n");
+    fprintf(stderr, "  -m slots    publish edges to a shared-memory ring of this size\n");
+    fprintf(stderr, "  -r file     record every edge to this file\n");
+    fprintf(stderr, "  -a file.sr  archive every sample to a sigrok session file\n");
+    fprintf(stderr, "  -H mb       keep this many MiB of edge history for backfills\n");
+    fprintf(stderr, "  -t [host:]port  also accept clients over TCP\n");
+    fprintf(stderr, "  -u entries  io_uring sends in one submission, 0 to send on EPOLLOUT\n");
+    fprintf(stderr, "  -T          trace the latency of edges from packet to socket\n");
+    fprintf(stderr, "  -c source   capture from this source, the first one listed by default\n");
+    fprintf(stderr, "              (repeat to merge several sources into one bus)\n");
+    fprintf(stderr, "  -j workers  detect edges on this many threads\n");
+    capture_usage();
+    exit(1);
+}
+
 
+int main(int argc, char **argv) {
     char *socket_path = "./socket";
     struct sockaddr_un addr;
+    int log_level = LOG_INFO;
+    size_t shm_slots = 0;
+    char *record_path = NULL;
+    char *archive_path = NULL;
+    size_t history_mb = 0;
+    char *tcp_spec = NULL;
+    unsigned int uring_entries = CLIENT_URING_ENTRIES;
+    const char *sources[CAPTURE_DEVICES_MAX];
+    size_t source_count = 0;
+    unsigned int workers = 0;
+    int opt;
 
-    LIST_INIT(&clients_head);
-    if (0 != pthread_mutex_init(&clients_mutex, NULL)) {
-        fprintf(stderr, "\ncan't make mutex\n");
-        exit(1);
+    while ((opt = getopt(argc, argv, "vqs:m:r:a:H:t:u:Tc:j:")) != -1) {
+        switch (opt) {
+            case 'v': log_level++; break;
+            case 'q': log_level--; break;
+            case 's': stats_interval = strtoul(optarg, NULL, 10); break;
+            case 'm': shm_slots = strtoul(optarg, NULL, 10); break;
+            case 'r': record_path = optarg; break;
+            case 'a': archive_path = optarg; break;
+            case 'H': history_mb = strtoul(optarg, NULL, 10); break;
+            case 't': tcp_spec = optarg; break;
+            case 'u': uring_entries = strtoul(optarg, NULL, 10); break;
+            case 'T': trace_enable(); break;
+            case 'c':
+                if (source_count == CAPTURE_DEVICES_MAX) {
+                    fprintf(stderr, "at most %d sources\n",
+                            CAPTURE_DEVICES_MAX);
+                    exit(1);
+                }
+                sources[source_count++] = optarg;
+                break;
+            case 'j': workers = strtoul(optarg, NULL, 10); break;
+            default: usage(argv[0]);
+        }
     }
+    if (optind < argc) {
+        socket_path = argv[optind];
+    }
+    if (log_level < LOG_ERROR) {
+        log_level = LOG_ERROR;
+    } else if (log_level > LOG_DEBUG) {
+        log_level = LOG_DEBUG;
+    }
+    log_init(log_level);
 
-    for (int i = 0; i < argc; i++) {
-        if (i == 1) {
-            socket_path = argv[i];
-        }
+    if (shm_slots != 0 && !shm_init(shm_slots)) {
+        fprintf(stderr, "\ncan't create shared memory ring\n");
+        exit(1);
+    }
+    if (record_path != NULL && !record_init(record_path)) {
+        fprintf(stderr, "\ncan't create recording\n");
+        exit(1);
+    }
+    if (history_mb != 0 && !history_init(history_mb << 20)) {
+        fprintf(stderr, "\ncan't allocate history\n");
+        exit(1);
     }
 
+    client_set_t *set = new_client_set(0);
+    index_client_set(set);
+    atomic_init(&clients, set);
+    atomic_init(&fanout_epoch, 0);
+    atomic_init(&clients_pending, false);
+    atomic_init(&pending_clients, NULL);
+    atomic_init(&clients_closing, false);
+
     server_socket = socket(AF_UNIX, SOCK_STREAM, 0);
     if (-1 == server_socket) {
         perror("socket failed");
@@ -277,11 +2243,52 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    if (0 != listen(server_socket, 16)) {
+    if (0 != listen(server_socket, SOMAXCONN)) {
         perror("listen failed");
         exit(1);
     }
 
+    epoll_fd = epoll_create1(0);
+    if (-1 == epoll_fd) {
+        perror("epoll_create1 failed");
+        exit(1);
+    }
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (-1 == wake_fd) {
+        perror("eventfd failed");
+        exit(1);
+    }
+    watch_fd(server_socket, EPOLLIN | EPOLLET, &server_socket);
+    watch_fd(wake_fd, EPOLLIN | EPOLLET, &wake_fd);
+    if (tcp_spec != NULL) {
+        listen_tcp(tcp_spec);
+    }
+    if (uring_entries != 0 && uring_init(uring_entries, uring_entries,
+                CLIENT_OUT_SIZE)) {
+        ring_fd = uring_fd();
+        watch_fd(ring_fd, EPOLLIN, &ring_fd);
+        log_msg(LOG_INFO, "Sending to clients with io_uring");
+    } else {
+        log_msg(LOG_INFO, "Sending to clients on EPOLLOUT");
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (-1 == timer_fd) {
+        perror("timerfd_create failed");
+        exit(1);
+    }
+    if (stats_interval != 0) {
+        struct itimerspec period = {
+            .it_interval = { .tv_sec = stats_interval },
+            .it_value = { .tv_sec = stats_interval },
+        };
+        if (0 != timerfd_settime(timer_fd, 0, &period, NULL)) {
+            perror("timerfd_settime failed");
+            exit(1);
+        }
+    }
+    watch_fd(timer_fd, EPOLLIN | EPOLLET, &timer_fd);
+
     if (signal(SIGINT, sig_handler) == SIG_ERR) {
         fprintf(stderr, "\ncan't catch SIGINT\n");
         exit(1);
@@ -295,25 +2302,35 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    capture_init(sources, source_count, workers);
+    if (archive_path != NULL && !archive_init(archive_path)) {
+        fprintf(stderr, "\ncan't create archive\n");
+        exit(1);
+    }
+    select_channels(set);
+
     if (0 != pthread_create(&clients_thread, NULL, clients_task, NULL)) {
         fprintf(stderr,  "\ncan't create thread\n");
         exit(1);
     }
 
-    capture_init();
     capture_run();
     exit_flag = 1;
+    wake_clients();
     if (0 != pthread_join(clients_thread, NULL)) {
         fprintf(stderr, "\ncan't join thread\n");
         exit(1);
     }
 
-    if (0 != pthread_mutex_destroy(&clients_mutex)) {
-        fprintf(stderr, "\ncan't destroy mutex\n");
-        exit(1);
-    }
-    
     unlink(addr.sun_path);
+    archive_cleanup();
+    capture_cleanup();
+    shm_cleanup();
+    record_cleanup();
+    history_cleanup();
+    uring_cleanup();
+    trace_cleanup();
+    log_shutdown();
     exit(0);
 }
 
@@ -0,0 +1,349 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "merge.h"
+#include "trace.h"
+
+typedef struct merge_queue {
+    /* Edges head to tail - 1 are queued, edge i in edges[i % MERGE_QUEUE]. */
+    capture_edge_t *edges;
+    uint64_t head;
+    uint64_t tail;
+    /* Every edge pushed from now on is at or after this index. */
+    uint64_t end;
+    /* The oldest packet pushed since the last merge, if tracing. */
+    uint64_t received_ns;
+    uint64_t pushed_ns;
+    bool finished;
+    unsigned int shift;
+    uint64_t mask;
+    capture_stats_t stats;
+} merge_queue_t;
+
+static struct {
+    merge_queue_t *queues;
+    size_t count;
+    pthread_mutex_t mutex;
+    pthread_cond_t pushed;
+    pthread_cond_t popped;
+    /* The first sample not merged yet; later edges are moved up to it. */
+    uint64_t merged;
+    /* Merge thread only. */
+    uint64_t value;
+    capture_edge_t *out;
+    size_t *heap;
+    size_t heap_len;
+} merge;
+
+
+static uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+
+void merge_init(size_t devices, const unsigned int *shift,
+        const unsigned int *width) {
+    pthread_condattr_t attr;
+
+    merge.count = devices;
+    merge.queues = calloc(devices, sizeof(merge.queues[0]));
+    merge.heap = calloc(devices, sizeof(merge.heap[0]));
+    merge.out = malloc(MERGE_BATCH * sizeof(merge.out[0]));
+    if (merge.queues == NULL || merge.heap == NULL || merge.out == NULL) {
+        perror("Failed to allocate merge");
+        exit(1);
+    }
+    uint64_t now = now_ns();
+    for (size_t i = 0; i < devices; i++) {
+        merge_queue_t *q = &merge.queues[i];
+        q->edges = malloc(MERGE_QUEUE * sizeof(q->edges[0]));
+        if (q->edges == NULL) {
+            perror("Failed to allocate merge");
+            exit(1);
+        }
+        q->shift = shift[i];
+        q->mask = (width[i] < 64 ? (1ull << width[i]) - 1 : UINT64_MAX)
+            << shift[i];
+        q->pushed_ns = now;
+    }
+    merge.merged = 0;
+    merge.value = 0;
+
+    if (0 != pthread_mutex_init(&merge.mutex, NULL)
+            || 0 != pthread_condattr_init(&attr)
+            || 0 != pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)
+            || 0 != pthread_cond_init(&merge.pushed, &attr)
+            || 0 != pthread_cond_init(&merge.popped, NULL)) {
+        fprintf(stderr, "\ncan't make merge mutex\n");
+        exit(1);
+    }
+    pthread_condattr_destroy(&attr);
+}
+
+
+void merge_cleanup() {
+    if (merge.queues == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < merge.count; i++) {
+        free(merge.queues[i].edges);
+    }
+    free(merge.queues);
+    free(merge.heap);
+    free(merge.out);
+    merge.queues = NULL;
+    pthread_cond_destroy(&merge.popped);
+    pthread_cond_destroy(&merge.pushed);
+    pthread_mutex_destroy(&merge.mutex);
+}
+
+
+capture_stats_t *merge_stats(size_t device) {
+    return &merge.queues[device].stats;
+}
+
+
+void merge_push(size_t device, const capture_edge_t *edges, size_t count,
+        uint64_t end, uint64_t received_ns) {
+    merge_queue_t *q = &merge.queues[device];
+
+    pthread_mutex_lock(&merge.mutex);
+    if (received_ns != 0 && q->received_ns == 0) {
+        q->received_ns = received_ns;
+    }
+    for (size_t i = 0; i < count; i++) {
+        capture_edge_t e = edges[i];
+        if (e.idx < merge.merged) {
+            e.idx = merge.merged;
+        }
+        if (q->tail - q->head == MERGE_QUEUE) {
+            /* Whatever is queued can go before this edge. */
+            if (e.idx > q->end) {
+                q->end = e.idx;
+            }
+            pthread_cond_signal(&merge.pushed);
+            while (q->tail - q->head == MERGE_QUEUE) {
+                pthread_cond_wait(&merge.popped, &merge.mutex);
+            }
+            if (e.idx < merge.merged) {
+                e.idx = merge.merged;
+            }
+        }
+        e.value = (e.value << q->shift) & q->mask;
+        q->edges[q->tail++ % MERGE_QUEUE] = e;
+    }
+    if (end > q->end) {
+        q->end = end;
+    }
+    q->pushed_ns = now_ns();
+    pthread_cond_signal(&merge.pushed);
+    pthread_mutex_unlock(&merge.mutex);
+}
+
+
+void merge_finish(size_t device) {
+    pthread_mutex_lock(&merge.mutex);
+    merge.queues[device].finished = true;
+    pthread_cond_signal(&merge.pushed);
+    pthread_mutex_unlock(&merge.mutex);
+}
+
+
+static uint64_t head_idx(size_t device) {
+    merge_queue_t *q = &merge.queues[device];
+    return q->edges[q->head % MERGE_QUEUE].idx;
+}
+
+
+/* Min-heap of the devices with edges to merge, by the index of their first
+ * one; ties go to the lower device. */
+static bool heap_less(size_t a, size_t b) {
+    uint64_t ia = head_idx(merge.heap[a]), ib = head_idx(merge.heap[b]);
+    return ia < ib || (ia == ib && merge.heap[a] < merge.heap[b]);
+}
+
+
+static void heap_swap(size_t a, size_t b) {
+    size_t t = merge.heap[a];
+    merge.heap[a] = merge.heap[b];
+    merge.heap[b] = t;
+}
+
+
+static void heap_push(size_t device) {
+    size_t i = merge.heap_len++;
+    merge.heap[i] = device;
+    while (i > 0 && heap_less(i, (i - 1) / 2)) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+
+static void heap_sift_down() {
+    size_t i = 0;
+    while (true) {
+        size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < merge.heap_len && heap_less(l, min)) {
+            min = l;
+        }
+        if (r < merge.heap_len && heap_less(r, min)) {
+            min = r;
+        }
+        if (min == i) {
+            return;
+        }
+        heap_swap(i, min);
+        i = min;
+    }
+}
+
+
+/* Merges the queued edges before `limit`, at most MERGE_BATCH of them, and
+ * returns the index the batch runs up to. */
+static uint64_t merge_batch(uint64_t limit, size_t *count) {
+    size_t n = 0;
+    /* The bus value before out[n - 1]. */
+    uint64_t before = merge.value;
+
+    merge.heap_len = 0;
+    for (size_t i = 0; i < merge.count; i++) {
+        merge_queue_t *q = &merge.queues[i];
+        if (q->head != q->tail && head_idx(i) < limit) {
+            heap_push(i);
+        }
+    }
+    while (merge.heap_len > 0) {
+        size_t device = merge.heap[0];
+        merge_queue_t *q = &merge.queues[device];
+        capture_edge_t e = q->edges[q->head % MERGE_QUEUE];
+        bool same = n != 0 && merge.out[n - 1].idx == e.idx;
+        if (n == MERGE_BATCH && !same) {
+            limit = e.idx;
+            break;
+        }
+        uint64_t value = (merge.value & ~q->mask) | e.value;
+        if (same && value == before) {
+            /* The devices' edges at this index cancel out. */
+            n--;
+        } else if (same) {
+            merge.out[n - 1].value = value;
+        } else if (value != merge.value) {
+            before = merge.value;
+            merge.out[n].idx = e.idx;
+            merge.out[n].value = value;
+            n++;
+        }
+        merge.value = value;
+        q->head++;
+        if (q->head != q->tail && head_idx(device) < limit) {
+            heap_sift_down();
+        } else {
+            merge.heap[0] = merge.heap[--merge.heap_len];
+            heap_sift_down();
+        }
+    }
+    *count = n;
+    return limit;
+}
+
+
+/* The index every device still streaming is past, or, if none is, the
+ * furthest one any device reached. */
+static uint64_t merge_limit(uint64_t now) {
+    uint64_t limit = UINT64_MAX;
+    uint64_t furthest = merge.merged;
+    for (size_t i = 0; i < merge.count; i++) {
+        merge_queue_t *q = &merge.queues[i];
+        if (q->end > furthest) {
+            furthest = q->end;
+        }
+        if (!q->finished && now - q->pushed_ns < MERGE_IDLE_NS
+                && q->end < limit) {
+            limit = q->end;
+        }
+    }
+    return limit == UINT64_MAX ? furthest : limit;
+}
+
+
+static bool merge_done() {
+    for (size_t i = 0; i < merge.count; i++) {
+        merge_queue_t *q = &merge.queues[i];
+        if (!q->finished || q->head != q->tail) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void publish_stats() {
+    uint64_t packets = 0, dropped = 0;
+    for (size_t i = 0; i < merge.count; i++) {
+        packets += counter_get(&merge.queues[i].stats.packets);
+        dropped += counter_get(&merge.queues[i].stats.dropped_packets);
+    }
+    atomic_store_explicit(&capture_stats.packets, packets,
+            memory_order_relaxed);
+    atomic_store_explicit(&capture_stats.dropped_packets, dropped,
+            memory_order_relaxed);
+}
+
+
+void merge_run() {
+    pthread_mutex_lock(&merge.mutex);
+    while (true) {
+        uint64_t limit = merge_limit(now_ns());
+        if (limit <= merge.merged) {
+            if (merge_done()) {
+                break;
+            }
+            /* Wakes up to notice a device going idle. */
+            struct timespec due;
+            clock_gettime(CLOCK_MONOTONIC, &due);
+            due.tv_nsec += MERGE_IDLE_NS / 4;
+            if (due.tv_nsec >= 1000000000) {
+                due.tv_sec++;
+                due.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&merge.pushed, &merge.mutex, &due);
+            continue;
+        }
+
+        uint64_t prev = merge.value;
+        uint64_t start = merge.merged;
+        size_t count;
+        uint64_t end = merge_batch(limit, &count);
+        uint64_t received_ns = 0;
+        for (size_t i = 0; i < merge.count; i++) {
+            merge_queue_t *q = &merge.queues[i];
+            if (q->received_ns != 0 && (received_ns == 0
+                        || q->received_ns < received_ns)) {
+                received_ns = q->received_ns;
+            }
+            q->received_ns = 0;
+        }
+        merge.merged = end;
+        publish_stats();
+        pthread_cond_broadcast(&merge.popped);
+        pthread_mutex_unlock(&merge.mutex);
+
+        counter_add(&capture_stats.samples, end - start);
+        counter_add(&capture_stats.edges, count);
+        if (received_ns != 0) {
+            trace_run(start, end, received_ns);
+        }
+        on_capture_edges(merge.out, count, prev, end);
+
+        pthread_mutex_lock(&merge.mutex);
+    }
+    publish_stats();
+    pthread_mutex_unlock(&merge.mutex);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "capture.h"
+#include "stats.h"
+
+/* Time-ordered merge of the edges of several capture devices into one bus.
+ *
+ * Every device thread pushes its edges, already moved to the common sample
+ * index, into a bounded queue of its own, along with the index every later
+ * edge of it will be at or after; their values go to the device's channels
+ * of the bus.
+ * The merge thread takes the lowest of those indices over the devices as
+ * the limit, k-way merges the queued edges before it with a min-heap of
+ * the queue heads, and hands them to on_capture_edges as one stream: the
+ * value of each edge is the whole bus, with the other devices' channels
+ * as they last were. Edges of different devices at the same index become
+ * one edge.
+ *
+ * A device that pushes nothing for MERGE_IDLE_NS, such as a sigrok source
+ * without wanted channels, stops holding the others back. If it turns out
+ * to be only late, its edges from before what was merged meanwhile are
+ * moved up to the first sample not merged yet.
+ *
+ * A device thread waits when its queue is full, so a fast source is held
+ * back by the slowest one rather than growing without bound.
+ */
+
+#define MERGE_QUEUE (1 << 16)
+#define MERGE_BATCH 4096
+#define MERGE_IDLE_NS 200000000ull
+
+/* `shift` is the first bus channel of every device and `width` its number
+ * of channels. */
+void merge_init(size_t devices, const unsigned int *shift,
+        const unsigned int *width);
+void merge_cleanup();
+/* Device threads: queues `count` edges of `device` with values of the
+ * device's own channels, and moves its limit on to `end`. `received_ns`
+ * is when the samples arrived, 0 if not tracing. */
+void merge_push(size_t device, const capture_edge_t *edges, size_t count,
+        uint64_t end, uint64_t received_ns);
+/* Device threads: the device will push nothing more. */
+void merge_finish(size_t device);
+/* Merges until every device is finished and everything pushed delivered. */
+void merge_run();
+/* Packets and dropped packets: each device keeps its own, and the merge
+ * thread publishes their sums in capture_stats. */
+capture_stats_t *merge_stats(size_t device);
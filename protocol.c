@@ -0,0 +1,209 @@
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "protocol.h"
+
+/* Worst case size of one compact edge: a 10-byte varint and 8 value bytes. */
+#define COMPACT_EDGE_MAX 18
+
+
+static const char *encoding_names[PROTO_ENC_COUNT] = {
+    [PROTO_ENC_LEGACY] = "legacy",
+    [PROTO_ENC_RAW] = "raw",
+    [PROTO_ENC_COMPACT] = "compact",
+};
+
+
+const char *proto_encoding_name(proto_encoding_t encoding) {
+    if (encoding >= PROTO_ENC_COUNT) {
+        return NULL;
+    }
+    return encoding_names[encoding];
+}
+
+
+static const char *policy_names[PROTO_POLICY_COUNT] = {
+    [PROTO_POLICY_DISCONNECT] = "disconnect",
+    [PROTO_POLICY_GROW] = "grow",
+    [PROTO_POLICY_DROP_OLDEST] = "drop-oldest",
+    [PROTO_POLICY_COALESCE] = "coalesce",
+};
+
+
+const char *proto_policy_name(proto_policy_t policy) {
+    if (policy >= PROTO_POLICY_COUNT) {
+        return NULL;
+    }
+    return policy_names[policy];
+}
+
+
+static size_t put_varint(uint8_t *out, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t) v;
+    return n;
+}
+
+
+static uint64_t gather_bits(uint64_t value, uint64_t mask) {
+    uint64_t packed = 0;
+    unsigned int bit = 0;
+    while (mask) {
+        uint64_t lowest = mask & -mask;
+        if (value & lowest) {
+            packed |= 1ull << bit;
+        }
+        bit++;
+        mask ^= lowest;
+    }
+    return packed;
+}
+
+
+size_t proto_encode_frame(uint16_t type, const proto_encoder_t *enc,
+        const void *payload, size_t length, uint8_t *out, size_t size) {
+    proto_frame_header_t header = {
+        .type = type,
+        .encoding = enc->encoding,
+        .length = length,
+    };
+    if (size < sizeof(header) + length) {
+        return 0;
+    }
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + sizeof(header), payload, length);
+    return sizeof(header) + length;
+}
+
+
+size_t proto_encode_hello(const proto_encoder_t *enc, uint8_t *out,
+        size_t size) {
+    proto_hello_frame_t hello = {
+        .version = enc->version,
+        .encoding = enc->encoding,
+        .samplerate = enc->samplerate,
+        .start_ns = enc->start_ns,
+    };
+    return proto_encode_frame(PROTO_FRAME_HELLO, enc, &hello, sizeof(hello),
+            out, size);
+}
+
+
+static size_t encode_legacy(const proto_encoder_t *enc,
+        const capture_edge_t *edges, size_t count, uint8_t *out, size_t size,
+        size_t *used) {
+    double samplerate = enc->samplerate;
+    size_t n = size / sizeof(proto_legacy_sample_t);
+    if (n > count) {
+        n = count;
+    }
+    for (size_t i = 0; i < n; i++) {
+        proto_legacy_sample_t sample = {
+            .time = edges[i].idx / samplerate,
+            .value = edges[i].value,
+        };
+        memcpy(out + i * sizeof(sample), &sample, sizeof(sample));
+    }
+    *used = n;
+    return n * sizeof(proto_legacy_sample_t);
+}
+
+
+size_t proto_encode_edges(const proto_encoder_t *enc,
+        const capture_edge_t *edges, size_t count, uint8_t *out, size_t size,
+        size_t *used) {
+    *used = 0;
+    if (enc->encoding == PROTO_ENC_LEGACY) {
+        return encode_legacy(enc, edges, count, out, size, used);
+    }
+
+    const size_t start = sizeof(proto_frame_header_t)
+        + sizeof(proto_edges_header_t);
+    if (count == 0 || size < start) {
+        return 0;
+    }
+
+    size_t pos = start;
+    size_t n = 0;
+    if (enc->encoding == PROTO_ENC_RAW) {
+        n = (size - start) / sizeof(proto_raw_edge_t);
+        if (n > count) {
+            n = count;
+        }
+        for (size_t i = 0; i < n; i++) {
+            proto_raw_edge_t edge = {
+                .idx = edges[i].idx,
+                .value = edges[i].value,
+            };
+            memcpy(out + pos, &edge, sizeof(edge));
+            pos += sizeof(edge);
+        }
+    } else {
+        size_t value_bytes = (__builtin_popcountll(enc->mask) + 7) / 8;
+        uint64_t last = edges[0].idx;
+        for (; n < count && pos + COMPACT_EDGE_MAX <= size; n++) {
+            pos += put_varint(out + pos, edges[n].idx - last);
+            last = edges[n].idx;
+            uint64_t packed = gather_bits(edges[n].value, enc->mask);
+            memcpy(out + pos, &packed, value_bytes);
+            pos += value_bytes;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    proto_frame_header_t header = {
+        .type = PROTO_FRAME_EDGES,
+        .encoding = enc->encoding,
+        .length = pos - sizeof(proto_frame_header_t),
+    };
+    proto_edges_header_t edges_header = {
+        .first_idx = edges[0].idx,
+        .samplerate = enc->samplerate,
+        .start_ns = enc->start_ns,
+        .mask = enc->mask,
+        .count = n,
+    };
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + sizeof(header), &edges_header, sizeof(edges_header));
+    *used = n;
+    return pos;
+}
+
+
+size_t proto_encode_records(uint16_t type, const proto_encoder_t *enc,
+        const void *records, size_t record_size, size_t count, uint8_t *out,
+        size_t size, size_t *used) {
+    const size_t start = sizeof(proto_frame_header_t)
+        + sizeof(proto_records_header_t);
+    *used = 0;
+    if (count == 0 || size < start + record_size) {
+        return 0;
+    }
+
+    size_t n = (size - start) / record_size;
+    if (n > count) {
+        n = count;
+    }
+    proto_frame_header_t header = {
+        .type = type,
+        .encoding = enc->encoding,
+        .length = sizeof(proto_records_header_t) + n * record_size,
+    };
+    proto_records_header_t records_header = {
+        .samplerate = enc->samplerate,
+        .start_ns = enc->start_ns,
+        .count = n,
+    };
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + sizeof(header), &records_header, sizeof(records_header));
+    memcpy(out + start, records, n * record_size);
+    *used = n;
+    return start + n * record_size;
+}
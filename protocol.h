@@ -0,0 +1,393 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "capture.h"
+
+/* Wire protocol. All integers are little-endian.
+ *
+ * A client that starts its stream with anything but PROTO_MAGIC is a legacy
+ * client: it sends bare 8-byte masks and receives bare proto_legacy_sample
+ * records. So is a client that sends nothing at all: it gets the first 32
+ * channels until its first mask. Otherwise the magic is followed by
+ * messages, each one a proto_msg_header and `length` bytes of payload, the
+ * first of which must be a PROTO_MSG_HELLO. The server answers with a
+ * PROTO_FRAME_HELLO and from then on sends only frames: a
+ * proto_frame_header and `length` bytes.
+ *
+ * PROTO_FRAME_EDGES carries a proto_edges_header and `count` edges. With
+ * PROTO_ENC_RAW every edge is a proto_raw_edge. With PROTO_ENC_COMPACT every
+ * edge is a varint (LEB128) of its distance in samples from the previous
+ * edge of the frame (from first_idx for the first one) followed by
+ * `(popcount(mask) + 7) / 8` bytes holding the bits of the value selected by
+ * mask, gathered from least to most significant.
+ *
+ * PROTO_MSG_SHM asks for the shared-memory ring described in shm.h. The
+ * reply is a PROTO_FRAME_SHM whose first byte carries the memfd as
+ * SCM_RIGHTS ancillary data; a size of 0 means the ring is not available.
+ * Edges keep flowing on the socket until the client sets its mask to 0.
+ *
+ * PROTO_MSG_POLICY chooses what happens when the client falls behind and its
+ * buffer fills up: the default is to disconnect it. Whenever edges were lost
+ * to a policy, a PROTO_FRAME_GAP with the number lost precedes the next
+ * edges.
+ *
+ * PROTO_MSG_FILTER sets up the glitch filter described in filter.h for the
+ * given channels; all-zero settings turn it off for them. Edges of a
+ * filtered client arrive up to the longest minimum width late.
+ *
+ * PROTO_MSG_BUCKETS with a non-zero width replaces the client's edges with
+ * PROTO_FRAME_BUCKETS: a proto_records_header and `count` proto_bucket
+ * records, one per bucket of `width` samples and channel of the mask, as
+ * described in aggregate.h; a run of buckets without edges comes as a single
+ * record of their total width. Widths below 1 ms of samples are raised to
+ * that. A width of 0 goes back to edges.
+ *
+ * PROTO_MSG_DECODE attaches a UART, SPI or I2C decoder to the channels it
+ * names, which become the client's mask. From then on the client receives
+ * PROTO_FRAME_SYMBOLS: a proto_records_header and `count` proto_symbol
+ * records. PROTO_DECODE_NONE goes back to edges.
+ *
+ * PROTO_MSG_TRIGGER limits the client's edges to the ones that complete a
+ * match of the trigger described in trigger.h, or, with a pre- or
+ * post-trigger window, to the edges within the windows around them. Zero
+ * stages turn the trigger off.
+ *
+ * PROTO_MSG_BACKFILL asks for the edges kept in the history described in
+ * history.h from a sample index, or from a CLOCK_REALTIME time if from_ns
+ * is not 0, on. They arrive as PROTO_FRAME_EDGES before the live edges,
+ * which then continue from the first edge after the backfilled ones. If
+ * the history does not reach back that far, a PROTO_FRAME_GAP with reason
+ * PROTO_GAP_HISTORY counts the samples missing.
+ *
+ * PROTO_MSG_SOCKET tunes how frames are sent. By default every batch of the
+ * capture is sent as soon as it is queued, and TCP clients are corked so
+ * that it goes out in full segments. With an interval, queued edges are
+ * held back until the interval has passed since the last send or `batch`
+ * edges are waiting. On TCP, nodelay turns the corking off for clients that
+ * care more about latency than about throughput. PROTO_MSG_SHM is refused
+ * over TCP.
+ *
+ * PROTO_MSG_TIMESTAMPS turns on the latency tracing described in trace.h,
+ * if it was not on, and with `enable` precedes every PROTO_FRAME_EDGES with
+ * a PROTO_FRAME_TIMESTAMP for its first edge: when the packet holding it
+ * reached the host, when it was queued to the client and when the frame was
+ * sent, so that the client can tell how long the edges took to reach it.
+ */
+
+#define PROTO_MAGIC "SMUX"
+#define PROTO_MAGIC_LEN 4
+#define PROTO_VERSION 1
+
+typedef enum proto_encoding {
+    PROTO_ENC_LEGACY,
+    PROTO_ENC_RAW,
+    PROTO_ENC_COMPACT,
+    PROTO_ENC_COUNT
+} proto_encoding_t;
+
+enum proto_msg_type {
+    PROTO_MSG_HELLO = 1,
+    PROTO_MSG_MASK = 2,
+    PROTO_MSG_SHM = 3,
+    PROTO_MSG_POLICY = 4,
+    PROTO_MSG_FILTER = 5,
+    PROTO_MSG_BUCKETS = 6,
+    PROTO_MSG_DECODE = 7,
+    PROTO_MSG_TRIGGER = 8,
+    PROTO_MSG_BACKFILL = 9,
+    PROTO_MSG_SOCKET = 10,
+    PROTO_MSG_TIMESTAMPS = 11,
+};
+
+enum proto_frame_type {
+    PROTO_FRAME_HELLO = 1,
+    PROTO_FRAME_EDGES = 2,
+    PROTO_FRAME_SHM = 3,
+    PROTO_FRAME_GAP = 4,
+    PROTO_FRAME_BUCKETS = 5,
+    PROTO_FRAME_SYMBOLS = 6,
+    PROTO_FRAME_TIMESTAMP = 7,
+};
+
+typedef enum proto_policy {
+    PROTO_POLICY_DISCONNECT,
+    /* Double the buffer, up to max_bytes. */
+    PROTO_POLICY_GROW,
+    PROTO_POLICY_DROP_OLDEST,
+    /* Keep the last edge of every `bucket` samples while behind. */
+    PROTO_POLICY_COALESCE,
+    PROTO_POLICY_COUNT
+} proto_policy_t;
+
+enum proto_gap_reason {
+    PROTO_GAP_DROPPED = 1,
+    PROTO_GAP_COALESCED = 2,
+    /* The count is of samples, not edges. */
+    PROTO_GAP_HISTORY = 3,
+};
+
+typedef enum proto_decoder {
+    PROTO_DECODE_NONE,
+    PROTO_DECODE_UART,
+    PROTO_DECODE_SPI,
+    PROTO_DECODE_I2C,
+    PROTO_DECODE_COUNT
+} proto_decoder_t;
+
+enum proto_decode_flags {
+    PROTO_DECODE_PARITY_ODD = 1 << 0,
+    PROTO_DECODE_PARITY_EVEN = 1 << 1,
+    PROTO_DECODE_STOP_2 = 1 << 2,
+    PROTO_DECODE_CPOL = 1 << 3,
+    PROTO_DECODE_CPHA = 1 << 4,
+    PROTO_DECODE_LSB_FIRST = 1 << 5,
+};
+
+/* No channel, for the optional SPI lines. */
+#define PROTO_DECODE_UNUSED 0xff
+
+enum proto_symbol_kind {
+    /* UART: data is the character. */
+    PROTO_SYMBOL_UART = 1,
+    /* SPI: data is the MOSI word and data2 the MISO word. */
+    PROTO_SYMBOL_SPI = 2,
+    /* I2C conditions, and the bytes after them: the first one after a start
+     * is the address byte, with the R/W bit. */
+    PROTO_SYMBOL_I2C_START = 3,
+    PROTO_SYMBOL_I2C_STOP = 4,
+    PROTO_SYMBOL_I2C_ADDRESS = 5,
+    PROTO_SYMBOL_I2C_DATA = 6,
+};
+
+enum proto_symbol_flags {
+    /* UART: no stop bit; SPI: word cut short by chip select; I2C: bus
+     * condition in the middle of a byte. */
+    PROTO_SYMBOL_FRAMING = 1 << 0,
+    PROTO_SYMBOL_PARITY = 1 << 1,
+    /* I2C: the byte was not acknowledged. */
+    PROTO_SYMBOL_NACK = 1 << 2,
+};
+
+typedef struct proto_msg_header {
+    uint16_t type;
+    uint16_t length;
+} proto_msg_header_t;
+
+typedef struct proto_hello_msg {
+    uint8_t version;
+    uint8_t encoding;
+    uint16_t reserved0;
+    uint32_t reserved1;
+    uint64_t mask;
+} proto_hello_msg_t;
+
+typedef struct proto_mask_msg {
+    uint64_t mask;
+} proto_mask_msg_t;
+
+typedef struct proto_policy_msg {
+    uint8_t policy;
+    uint8_t reserved0;
+    uint16_t reserved1;
+    /* PROTO_POLICY_COALESCE bucket width in samples; 0 means 1. */
+    uint32_t bucket;
+    /* PROTO_POLICY_GROW memory cap in bytes; 0 means the default. */
+    uint64_t max_bytes;
+} proto_policy_msg_t;
+
+typedef struct proto_filter_msg {
+    uint64_t channels;
+    /* Samples a channel must stay high after a rise, or low after a fall,
+     * for the change to be passed on. */
+    uint32_t min_high;
+    uint32_t min_low;
+    /* Samples a channel is held after a passed change. */
+    uint32_t holdoff;
+    uint32_t reserved;
+} proto_filter_msg_t;
+
+typedef struct proto_buckets_msg {
+    uint64_t width;
+} proto_buckets_msg_t;
+
+typedef struct proto_decode_msg {
+    uint8_t decoder;
+    /* UART: rx; SPI: clock, MOSI, MISO, chip select (active low); I2C: SCL,
+     * SDA. Unused lines are PROTO_DECODE_UNUSED. */
+    uint8_t channels[4];
+    /* Data bits per character or word; 0 means 8. */
+    uint8_t bits;
+    /* PROTO_DECODE_* flags. */
+    uint16_t flags;
+    /* UART bits per second. */
+    uint32_t baud;
+    uint32_t reserved;
+} proto_decode_msg_t;
+
+#define PROTO_TRIGGER_STAGES 4
+
+/* Matches an edge whose value has `value` on the bits of `mask`, and on
+ * which the bits of `rising` rise and the bits of `falling` fall. */
+typedef struct proto_trigger_stage {
+    uint64_t mask;
+    uint64_t value;
+    uint64_t rising;
+    uint64_t falling;
+} proto_trigger_stage_t;
+
+typedef struct proto_trigger_msg {
+    uint8_t stages;
+    uint8_t reserved0;
+    uint16_t reserved1;
+    uint32_t reserved2;
+    /* Samples from the edge matching the first stage to the one matching
+     * the last; 0 for no limit. */
+    uint64_t within;
+    /* Samples passed on before and after every edge completing a match. */
+    uint64_t pre;
+    uint64_t post;
+    proto_trigger_stage_t stage[PROTO_TRIGGER_STAGES];
+} proto_trigger_msg_t;
+
+typedef struct proto_backfill_msg {
+    uint64_t from_idx;
+    uint64_t from_ns;
+} proto_backfill_msg_t;
+
+typedef struct proto_socket_msg {
+    uint8_t nodelay;
+    uint8_t reserved0;
+    uint16_t reserved1;
+    /* Microseconds between sends, 0 to send right away. */
+    uint32_t interval_us;
+    /* Queued edges that trigger a send before the interval is over; 0 for
+     * no limit. */
+    uint32_t batch;
+    uint32_t reserved2;
+} proto_socket_msg_t;
+
+typedef struct proto_timestamps_msg {
+    uint8_t enable;
+    uint8_t reserved0;
+    uint16_t reserved1;
+    uint32_t reserved2;
+} proto_timestamps_msg_t;
+
+typedef struct proto_frame_header {
+    uint16_t type;
+    uint16_t encoding;
+    uint32_t length;
+} proto_frame_header_t;
+
+typedef struct proto_hello_frame {
+    uint8_t version;
+    uint8_t encoding;
+    uint16_t reserved0;
+    uint32_t reserved1;
+    uint64_t samplerate;
+    /* CLOCK_REALTIME of sample index 0, in nanoseconds. */
+    uint64_t start_ns;
+} proto_hello_frame_t;
+
+typedef struct proto_edges_header {
+    uint64_t first_idx;
+    uint64_t samplerate;
+    uint64_t start_ns;
+    uint64_t mask;
+    uint32_t count;
+    uint32_t reserved;
+} proto_edges_header_t;
+
+typedef struct proto_shm_frame {
+    /* Size of the mapping, 0 if shared memory is disabled. */
+    uint64_t size;
+    /* Ring position of the next edge to be published. */
+    uint64_t head;
+} proto_shm_frame_t;
+
+typedef struct proto_gap_frame {
+    uint64_t count;
+    uint32_t reason;
+    uint32_t reserved;
+} proto_gap_frame_t;
+
+/* CLOCK_REALTIME times in nanoseconds, 0 where the packet was not traced. */
+typedef struct proto_timestamp_frame {
+    uint64_t idx;
+    uint64_t received_ns;
+    uint64_t queued_ns;
+    uint64_t sent_ns;
+} proto_timestamp_frame_t;
+
+/* Starts every frame of fixed-size records. */
+typedef struct proto_records_header {
+    uint64_t samplerate;
+    uint64_t start_ns;
+    uint32_t count;
+    uint32_t reserved;
+} proto_records_header_t;
+
+typedef struct proto_bucket {
+    /* First sample of the bucket, and its width in samples. */
+    uint64_t idx;
+    uint64_t width;
+    uint8_t channel;
+    /* Level at the end of the bucket. */
+    uint8_t last;
+    uint16_t reserved;
+    uint32_t edges;
+    /* Samples the channel spent high. */
+    uint64_t high;
+    /* Shortest and longest pulse that ended in the bucket, 0 if none. */
+    uint64_t min_pulse;
+    uint64_t max_pulse;
+} proto_bucket_t;
+
+typedef struct proto_symbol {
+    /* First sample of the symbol and the one after it. */
+    uint64_t idx;
+    uint64_t end;
+    uint8_t kind;
+    uint8_t flags;
+    uint16_t reserved0;
+    uint32_t data;
+    uint32_t data2;
+    uint32_t reserved1;
+} proto_symbol_t;
+
+typedef struct proto_raw_edge {
+    uint64_t idx;
+    uint64_t value;
+} proto_raw_edge_t;
+
+typedef struct proto_legacy_sample {
+    double time;
+    uint64_t value;
+} proto_legacy_sample_t;
+
+/* Per-client encoding state, owned by the clients thread. */
+typedef struct proto_encoder {
+    proto_encoding_t encoding;
+    uint8_t version;
+    uint64_t mask;
+    uint64_t samplerate;
+    uint64_t start_ns;
+} proto_encoder_t;
+
+const char *proto_encoding_name(proto_encoding_t encoding);
+const char *proto_policy_name(proto_policy_t policy);
+
+/* The encoders return the number of bytes written to `out`, or 0 if nothing
+ * fits in `size` bytes. proto_encode_edges sets `used` to the number of
+ * edges it consumed. */
+size_t proto_encode_frame(uint16_t type, const proto_encoder_t *enc,
+        const void *payload, size_t length, uint8_t *out, size_t size);
+size_t proto_encode_hello(const proto_encoder_t *enc, uint8_t *out,
+        size_t size);
+size_t proto_encode_edges(const proto_encoder_t *enc,
+        const capture_edge_t *edges, size_t count, uint8_t *out, size_t size,
+        size_t *used);
+size_t proto_encode_records(uint16_t type, const proto_encoder_t *enc,
+        const void *records, size_t record_size, size_t count, uint8_t *out,
+        size_t size, size_t *used);
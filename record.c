@@ -0,0 +1,225 @@
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "record.h"
+#include "log.h"
+
+/* The file is allocated and mapped this many chunks (64 MiB) at a time, so
+ * the kernel writes it back in long sequential runs. Allocating up front
+ * also turns a full disk into an error here instead of a SIGBUS later. */
+#define RECORD_EXTENT_CHUNKS 1024
+#define RECORD_EXTENT_SIZE (RECORD_EXTENT_CHUNKS * RECORD_CHUNK_SIZE)
+
+static struct {
+    int fd;
+    record_header_t *header;
+    uint8_t *extent;
+    uint64_t extent_first;
+    record_chunk_t *chunk;
+    uint64_t chunks;
+    uint64_t edges;
+    bool started;
+    /* Summaries of the completed chunks, written out as the index. */
+    record_chunk_t *index;
+    size_t index_cap;
+} rec = { .fd = -1 };
+
+
+static bool unmap_extent() {
+    if (rec.extent == NULL) {
+        return true;
+    }
+    msync(rec.extent, RECORD_EXTENT_SIZE, MS_ASYNC);
+    bool ok = 0 == munmap(rec.extent, RECORD_EXTENT_SIZE);
+    rec.extent = NULL;
+    return ok;
+}
+
+
+static bool map_extent(uint64_t first) {
+    off_t offset = RECORD_DATA_OFFSET + first * RECORD_CHUNK_SIZE;
+    int err = posix_fallocate(rec.fd, offset, RECORD_EXTENT_SIZE);
+    if (err != 0) {
+        log_msg(LOG_ERROR, "Can't extend recording: %s", strerror(err));
+        return false;
+    }
+    void *map = mmap(NULL, RECORD_EXTENT_SIZE, PROT_READ | PROT_WRITE,
+            MAP_SHARED, rec.fd, offset);
+    if (map == MAP_FAILED) {
+        log_msg(LOG_ERROR, "Can't map recording: %s", strerror(errno));
+        return false;
+    }
+    madvise(map, RECORD_EXTENT_SIZE, MADV_SEQUENTIAL);
+    rec.extent = map;
+    rec.extent_first = first;
+    return true;
+}
+
+
+static bool index_chunk(const record_chunk_t *chunk) {
+    if (rec.chunks > rec.index_cap) {
+        size_t cap = rec.index_cap ? 2 * rec.index_cap : 1024;
+        record_chunk_t *index = realloc(rec.index, cap * sizeof(*index));
+        if (index == NULL) {
+            log_msg(LOG_ERROR, "Can't grow recording index");
+            return false;
+        }
+        rec.index = index;
+        rec.index_cap = cap;
+    }
+    rec.index[rec.chunks - 1] = *chunk;
+    return true;
+}
+
+
+static bool next_chunk() {
+    if (rec.chunk != NULL && !index_chunk(rec.chunk)) {
+        return false;
+    }
+    if (rec.extent == NULL
+            || rec.chunks - rec.extent_first == RECORD_EXTENT_CHUNKS) {
+        if (!unmap_extent() || !map_extent(rec.chunks)) {
+            return false;
+        }
+    }
+    rec.chunk = (record_chunk_t *) (rec.extent
+        + (rec.chunks - rec.extent_first) * RECORD_CHUNK_SIZE);
+    memset(rec.chunk, 0, sizeof(*rec.chunk));
+    rec.chunk->min = UINT64_MAX;
+    rec.chunk->all = UINT64_MAX;
+    rec.chunks++;
+    return true;
+}
+
+
+/* Stops recording after an error; what was written so far stays readable. */
+static void record_fail() {
+    log_msg(LOG_ERROR, "Recording stopped after %lu edges", rec.edges);
+    unmap_extent();
+    munmap(rec.header, RECORD_DATA_OFFSET);
+    close(rec.fd);
+    rec.fd = -1;
+    rec.chunk = NULL;
+}
+
+
+bool record_init(const char *path) {
+    rec.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (rec.fd == -1) {
+        perror("open failed");
+        return false;
+    }
+    if (0 != ftruncate(rec.fd, RECORD_DATA_OFFSET)) {
+        perror("ftruncate failed");
+        close(rec.fd);
+        rec.fd = -1;
+        return false;
+    }
+    void *map = mmap(NULL, RECORD_DATA_OFFSET, PROT_READ | PROT_WRITE,
+            MAP_SHARED, rec.fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap failed");
+        close(rec.fd);
+        rec.fd = -1;
+        return false;
+    }
+
+    rec.header = map;
+    rec.header->magic = RECORD_MAGIC;
+    rec.header->version = RECORD_VERSION;
+    rec.header->edge_size = sizeof(capture_edge_t);
+    rec.header->chunk_size = RECORD_CHUNK_SIZE;
+    rec.header->data_offset = RECORD_DATA_OFFSET;
+    return true;
+}
+
+
+void record_cleanup() {
+    if (rec.fd == -1) {
+        free(rec.index);
+        rec.index = NULL;
+        return;
+    }
+
+    bool ok = rec.chunk == NULL || index_chunk(rec.chunk);
+    ok = unmap_extent() && ok;
+    off_t index_offset = RECORD_DATA_OFFSET + rec.chunks * RECORD_CHUNK_SIZE;
+    size_t index_size = rec.chunks * sizeof(record_chunk_t);
+    ok = ok && 0 == ftruncate(rec.fd, index_offset);
+    ok = ok && index_size == (size_t) pwrite(rec.fd, rec.index, index_size,
+            index_offset);
+    ok = ok && 0 == fdatasync(rec.fd);
+    if (ok) {
+        rec.header->index_offset = index_offset;
+    } else {
+        fprintf(stderr, "\ncan't write recording index\n");
+    }
+    msync(rec.header, RECORD_DATA_OFFSET, MS_SYNC);
+    munmap(rec.header, RECORD_DATA_OFFSET);
+    close(rec.fd);
+    rec.fd = -1;
+    free(rec.index);
+    rec.index = NULL;
+}
+
+
+bool record_enabled() {
+    return rec.fd != -1;
+}
+
+
+void record_append(const capture_edge_t *edges, size_t count) {
+    if (!rec.started) {
+        rec.header->samplerate = capture_samplerate();
+        rec.header->start_ns = capture_start_ns();
+        rec.started = true;
+    }
+
+    while (count > 0) {
+        if (rec.chunk == NULL || rec.chunk->count == RECORD_CHUNK_EDGES) {
+            if (!next_chunk()) {
+                record_fail();
+                return;
+            }
+        }
+        record_chunk_t *chunk = rec.chunk;
+        capture_edge_t *slots = (capture_edge_t *) (chunk + 1) + chunk->count;
+        size_t n = RECORD_CHUNK_EDGES - chunk->count;
+        if (n > count) {
+            n = count;
+        }
+        memcpy(slots, edges, n * sizeof(*edges));
+
+        uint64_t min = chunk->min, max = chunk->max;
+        uint64_t any = chunk->any, all = chunk->all;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t value = edges[i].value;
+            min = value < min ? value : min;
+            max = value > max ? value : max;
+            any |= value;
+            all &= value;
+        }
+        if (chunk->count == 0) {
+            chunk->first_idx = edges[0].idx;
+        }
+        chunk->last_idx = edges[n - 1].idx;
+        chunk->min = min;
+        chunk->max = max;
+        chunk->any = any;
+        chunk->all = all;
+        chunk->count += n;
+
+        rec.edges += n;
+        edges += n;
+        count -= n;
+    }
+    rec.header->chunk_count = rec.chunks;
+    rec.header->edge_count = rec.edges;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "capture.h"
+
+/* On-disk edge recording.
+ *
+ * The file starts with a record_header in its first RECORD_DATA_OFFSET bytes,
+ * followed by fixed-size chunks of RECORD_CHUNK_SIZE bytes: a record_chunk
+ * summary and up to RECORD_CHUNK_EDGES capture_edge_t, sorted by index.
+ * Chunk k therefore lives at data_offset + k * chunk_size, and since the
+ * chunks are in index order a reader finds the chunk holding any sample
+ * with a binary search over their first_idx, then the edge with a second
+ * one inside the chunk.
+ *
+ * When the recording is closed cleanly the summaries are also copied into a
+ * dense index of record_chunk at index_offset, so that seeking touches a
+ * few pages instead of one per probed chunk. A recording that was cut short
+ * has index_offset 0, but its header counts and chunk summaries are updated
+ * after every batch of edges and remain valid.
+ *
+ * All integers are little-endian.
+ */
+
+#define RECORD_MAGIC 0x0043455258554d53ull /* "SMUXREC\0" read as little-endian */
+#define RECORD_VERSION 1
+#define RECORD_DATA_OFFSET 4096
+#define RECORD_CHUNK_SIZE 65536
+#define RECORD_CHUNK_EDGES \
+    ((RECORD_CHUNK_SIZE - sizeof(record_chunk_t)) / sizeof(capture_edge_t))
+
+typedef struct record_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t edge_size;
+    uint64_t chunk_size;
+    uint64_t data_offset;
+    uint64_t samplerate;
+    /* CLOCK_REALTIME of sample index 0, in nanoseconds. */
+    uint64_t start_ns;
+    uint64_t chunk_count;
+    uint64_t edge_count;
+    uint64_t index_offset;
+} record_header_t;
+
+typedef struct record_chunk {
+    uint64_t first_idx;
+    uint64_t last_idx;
+    /* Smallest and largest value of the chunk, and the bits that were set
+     * in any and in all of its edges. */
+    uint64_t min;
+    uint64_t max;
+    uint64_t any;
+    uint64_t all;
+    uint32_t count;
+    uint32_t reserved0;
+    uint64_t reserved1;
+} record_chunk_t;
+
+bool record_init(const char *path);
+void record_cleanup();
+bool record_enabled();
+/* Capture thread only. */
+void record_append(const capture_edge_t *edges, size_t count);
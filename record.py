@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+
+import argparse
+import mmap
+import struct
+import sys
+
+
+RECORD_MAGIC = 0x0043455258554d53
+HEADER = struct.Struct("<QIIQQQQQQQ")
+CHUNK = struct.Struct("<QQQQQQIIQ")
+EDGE = struct.Struct("<QQ")
+
+
+class Recording:
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.map = mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)
+        (magic, _, edge_size, self.chunk_size, self.data_offset,
+         self.samplerate, self.start_ns, self.chunk_count, self.edge_count,
+         self.index_offset) = HEADER.unpack_from(self.map)
+        if magic != RECORD_MAGIC or edge_size != EDGE.size:
+            raise ValueError("%s is not a sigrok-mux recording" % path)
+
+    def chunk(self, k):
+        """Summary of chunk k, from the index if the recording has one."""
+        if self.index_offset:
+            offset = self.index_offset + k * CHUNK.size
+        else:
+            offset = self.data_offset + k * self.chunk_size
+        return CHUNK.unpack_from(self.map, offset)
+
+    def edge(self, k, i):
+        offset = self.data_offset + k * self.chunk_size + CHUNK.size
+        return EDGE.unpack_from(self.map, offset + i * EDGE.size)
+
+    def seek(self, idx):
+        """Position (chunk, edge) of the first edge at or after sample idx."""
+        lo, hi = 0, self.chunk_count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self.chunk(mid)[1] < idx:
+                lo = mid + 1
+            else:
+                hi = mid
+        if lo == self.chunk_count:
+            return lo, 0
+        count = self.chunk(lo)[6]
+        first, last = 0, count
+        while first < last:
+            mid = (first + last) // 2
+            if self.edge(lo, mid)[0] < idx:
+                first = mid + 1
+            else:
+                last = mid
+        return lo, first
+
+    def edges(self, idx):
+        k, i = self.seek(idx)
+        while k < self.chunk_count:
+            count = self.chunk(k)[6]
+            while i < count:
+                yield self.edge(k, i)
+                i += 1
+            k, i = k + 1, 0
+
+
+def main(argv):
+    parser = argparse.ArgumentParser()
+    parser.add_argument("path")
+    parser.add_argument("-s", "--start", type=float, default=0.0,
+                        help="seconds from the start of the recording")
+    parser.add_argument("-d", "--duration", type=float,
+                        help="seconds to print, the whole recording if omitted")
+    parser.add_argument("--summary", action="store_true",
+                        help="print the chunk summaries instead of edges")
+    args = parser.parse_args(argv[1:])
+
+    rec = Recording(args.path)
+    print("%d Hz, started at %d ns, %d edges in %d chunks%s"
+          % (rec.samplerate, rec.start_ns, rec.edge_count, rec.chunk_count,
+             "" if rec.index_offset else " (no index)"), file=sys.stderr)
+
+    if args.summary:
+        for k in range(rec.chunk_count):
+            first, last, low, high, any_, all_, count, _, _ = rec.chunk(k)
+            print("%16.10f %16.10f: %6d edges, min %016x max %016x "
+                  "any %016x all %016x"
+                  % (first / rec.samplerate, last / rec.samplerate, count,
+                     low, high, any_, all_))
+        return 0
+
+    start = int(args.start * rec.samplerate)
+    end = None
+    if args.duration is not None:
+        end = start + int(args.duration * rec.samplerate)
+    for idx, value in rec.edges(start):
+        if end is not None and idx >= end:
+            break
+        print("%16.10f: %016x" % (idx / rec.samplerate, value))
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define RING_CACHELINE 64
+
+/* Single-producer/single-consumer ring of ELEM_T.
+ *
+ * The producer only ever writes `head`, so pushing takes no lock. The
+ * capacity is rounded up to a power of two and the indices run freely,
+ * wrapping through the mask on access.
+ *
+ * `tail` normally belongs to the consumer, but NAME##_push_overwrite lets the
+ * producer drop the oldest item by advancing it too. The consumer therefore
+ * releases items with a compare-and-swap from the tail that NAME##_peek
+ * returned; when that fails, some of the items it looked at were dropped and
+ * possibly overwritten, and it has to peek again.
+ *
+ * `next` lets a producer that outgrew the ring continue in a larger one: it
+ * links the new ring once it has stopped pushing here, and the consumer
+ * moves over after draining this one.
+ */
+#define RING_DEFINE(NAME, ELEM_T)                                             \
+typedef struct NAME {                                                         \
+    _Alignas(RING_CACHELINE) _Atomic size_t head;                             \
+    _Alignas(RING_CACHELINE) _Atomic size_t tail;                             \
+    _Alignas(RING_CACHELINE) size_t mask;                                     \
+    ELEM_T *items;                                                            \
+    _Atomic(struct NAME *) next;                                              \
+} NAME##_t;                                                                   \
+                                                                              \
+static inline bool NAME##_init(NAME##_t *r, size_t capacity) {                \
+    size_t size = 1;                                                          \
+    while (size < capacity) {                                                 \
+        size <<= 1;                                                           \
+    }                                                                         \
+    r->items = malloc(size * sizeof(ELEM_T));                                 \
+    if (r->items == NULL) {                                                   \
+        return false;                                                         \
+    }                                                                         \
+    r->mask = size - 1;                                                       \
+    atomic_init(&r->head, 0);                                                 \
+    atomic_init(&r->tail, 0);                                                 \
+    atomic_init(&r->next, NULL);                                              \
+    return true;                                                              \
+}                                                                             \
+                                                                              \
+static inline NAME##_t *NAME##_new(size_t capacity) {                         \
+    size_t size = (sizeof(NAME##_t) + RING_CACHELINE - 1)                     \
+        & ~(size_t) (RING_CACHELINE - 1);                                     \
+    NAME##_t *r = aligned_alloc(RING_CACHELINE, size);                        \
+    if (r != NULL && !NAME##_init(r, capacity)) {                             \
+        free(r);                                                              \
+        r = NULL;                                                             \
+    }                                                                         \
+    return r;                                                                 \
+}                                                                             \
+                                                                              \
+static inline void NAME##_destroy(NAME##_t *r) {                              \
+    free(r->items);                                                           \
+    r->items = NULL;                                                          \
+}                                                                             \
+                                                                              \
+static inline void NAME##_delete(NAME##_t *r) {                               \
+    NAME##_destroy(r);                                                        \
+    free(r);                                                                  \
+}                                                                             \
+                                                                              \
+static inline size_t NAME##_capacity(NAME##_t *r) {                           \
+    return r->mask + 1;                                                       \
+}                                                                             \
+                                                                              \
+static inline size_t NAME##_size(NAME##_t *r) {                               \
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);       \
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);       \
+    return head - tail;                                                       \
+}                                                                             \
+                                                                              \
+/* Producer side. Returns false when the ring is full. */                     \
+static inline bool NAME##_push(NAME##_t *r, const ELEM_T *item) {             \
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);       \
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);       \
+    if (head - tail > r->mask) {                                              \
+        return false;                                                         \
+    }                                                                         \
+    r->items[head & r->mask] = *item;                                         \
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);          \
+    return true;                                                              \
+}                                                                             \
+                                                                              \
+/* Producer side. Pushes even when full by dropping the oldest item; returns \
+ * the number of items dropped (0 or 1). */                                   \
+static inline size_t NAME##_push_overwrite(NAME##_t *r, const ELEM_T *item) { \
+    size_t dropped = 0;                                                       \
+    while (!NAME##_push(r, item)) {                                           \
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);   \
+        size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);   \
+        if (head - tail > r->mask                                             \
+                && atomic_compare_exchange_weak(&r->tail, &tail, tail + 1)) { \
+            dropped++;                                                        \
+        }                                                                     \
+    }                                                                         \
+    return dropped;                                                           \
+}                                                                             \
+                                                                              \
+/* Consumer side. Points `first` at the longest contiguous run of queued    \
+ * items, stores the matching tail in `pos` and returns the run length; call \
+ * NAME##_consume with `pos` once the items are used. */                      \
+static inline size_t NAME##_peek(NAME##_t *r, ELEM_T **first, size_t *pos) { \
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);       \
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);       \
+    *pos = tail;                                                              \
+    size_t offset = tail & r->mask;                                           \
+    size_t count = head - tail;                                               \
+    if (count > r->mask + 1 - offset) {                                       \
+        count = r->mask + 1 - offset;                                         \
+    }                                                                         \
+    *first = &r->items[offset];                                               \
+    return count;                                                             \
+}                                                                             \
+                                                                              \
+/* Returns false if the producer dropped items since the peek at `pos`. */   \
+static inline bool NAME##_consume(NAME##_t *r, size_t pos, size_t count) {    \
+    return atomic_compare_exchange_strong(&r->tail, &pos, pos + count);       \
+}                                                                             \
+
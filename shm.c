@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "shm.h"
+
+#define SHM_DATA_OFFSET 4096
+
+static struct {
+    int fd;
+    size_t size;
+    shm_header_t *header;
+    capture_edge_t *slots;
+    uint64_t mask;
+} shm = { .fd = -1 };
+
+
+bool shm_init(size_t capacity) {
+    size_t slots = 1;
+    while (slots < capacity) {
+        slots <<= 1;
+    }
+
+    shm.fd = memfd_create("sigrok-mux", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (shm.fd == -1) {
+        perror("memfd_create failed");
+        return false;
+    }
+    shm.size = SHM_DATA_OFFSET + slots * sizeof(capture_edge_t);
+    if (0 != ftruncate(shm.fd, shm.size)) {
+        perror("ftruncate failed");
+        close(shm.fd);
+        shm.fd = -1;
+        return false;
+    }
+    void *map = mmap(NULL, shm.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            shm.fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap failed");
+        close(shm.fd);
+        shm.fd = -1;
+        return false;
+    }
+
+    /* Only the writable mapping the mux already holds can change the ring:
+     * readers can neither map it writable nor resize it. Kernels before 5.1
+     * can't seal against future writes, and get no ring at all rather than
+     * one any reader could scribble over. */
+    if (0 != fcntl(shm.fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+                | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL)) {
+        perror("Can't seal the shared memory ring");
+        munmap(map, shm.size);
+        close(shm.fd);
+        shm.fd = -1;
+        return false;
+    }
+
+    shm.header = map;
+    shm.slots = (capture_edge_t *) ((uint8_t *) map + SHM_DATA_OFFSET);
+    shm.mask = slots - 1;
+    shm.header->magic = SHM_MAGIC;
+    shm.header->version = SHM_VERSION;
+    shm.header->slot_size = sizeof(capture_edge_t);
+    shm.header->capacity = slots;
+    shm.header->data_offset = SHM_DATA_OFFSET;
+    atomic_init(&shm.header->reserved, 0);
+    atomic_init(&shm.header->head, 0);
+    return true;
+}
+
+
+void shm_cleanup() {
+    if (shm.fd == -1) {
+        return;
+    }
+    munmap(shm.header, shm.size);
+    close(shm.fd);
+    shm.fd = -1;
+    shm.header = NULL;
+}
+
+
+bool shm_enabled() {
+    return shm.fd != -1;
+}
+
+
+int shm_fd() {
+    return shm.fd;
+}
+
+
+size_t shm_size() {
+    return shm.size;
+}
+
+
+uint64_t shm_head() {
+    return atomic_load(&shm.header->head);
+}
+
+
+void shm_publish(const capture_edge_t *edges, size_t count) {
+    uint64_t head = atomic_load_explicit(&shm.header->head, memory_order_relaxed);
+    uint64_t end = head + count;
+
+    /* Only the newest `capacity` edges can survive anyway. */
+    if (count > shm.mask + 1) {
+        edges += count - (shm.mask + 1);
+        head = end - (shm.mask + 1);
+    }
+
+    atomic_store_explicit(&shm.header->reserved, end, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (uint64_t p = head; p < end; p++) {
+        shm.slots[p & shm.mask] = *edges++;
+    }
+    atomic_store_explicit(&shm.header->head, end, memory_order_release);
+}
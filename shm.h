@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "capture.h"
+
+/* Shared-memory edge ring.
+ *
+ * A memfd holds an shm_header followed, at data_offset, by `capacity`
+ * capture_edge_t slots. The mux is the only writer and publishes every edge,
+ * unmasked; any number of local readers map the fd read-only and filter
+ * with their own mask. The fd is sealed against writes and resizing, so a
+ * reader can't corrupt the ring for the others.
+ *
+ * Positions in the ring are 64-bit sequence numbers: position p lives in
+ * slot p % capacity.
+ *
+ * The writer first advances `reserved`, then fills the slots, then advances
+ * `head`. A reader copies positions below `head` (loaded with acquire),
+ * issues an acquire fence and reloads `reserved`: any copied position below
+ * `reserved - capacity` may have been overwritten and must be discarded as
+ * lost.
+ */
+
+#define SHM_MAGIC 0x004d485358554d53ull /* "SMUXSHM\0" read as little-endian */
+#define SHM_VERSION 1
+
+typedef struct shm_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slot_size;
+    uint64_t capacity;
+    uint64_t data_offset;
+    _Alignas(64) _Atomic uint64_t reserved;
+    _Alignas(64) _Atomic uint64_t head;
+} shm_header_t;
+
+bool shm_init(size_t capacity);
+void shm_cleanup();
+bool shm_enabled();
+int shm_fd();
+size_t shm_size();
+uint64_t shm_head();
+/* Capture thread only. */
+void shm_publish(const capture_edge_t *edges, size_t count);
@@ -0,0 +1,373 @@
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "srzip.h"
+#include "log.h"
+
+#define ZIP_LOCAL_MAGIC 0x04034b50
+#define ZIP_CENTRAL_MAGIC 0x02014b50
+#define ZIP_END_MAGIC 0x06054b50
+#define ZIP_LOCAL_SIZE 30
+#define ZIP_CENTRAL_SIZE 46
+#define ZIP_END_SIZE 22
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+
+struct srzip {
+    const uint8_t *map;
+    size_t size;
+    const uint8_t *central;
+    size_t entries;
+};
+
+typedef struct srzip_entry {
+    char *name;
+    uint16_t method;
+    uint32_t crc;
+    uint32_t length;
+    uint32_t size;
+    uint32_t offset;
+} srzip_entry_t;
+
+struct srzip_writer {
+    int fd;
+    uint64_t offset;
+    /* Size of the central directory of the members so far. */
+    uint64_t directory;
+    uint16_t time;
+    uint16_t date;
+    srzip_entry_t *entries;
+    size_t count;
+    size_t cap;
+};
+
+
+static uint16_t get16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+static uint32_t get32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+static uint8_t *put16(uint8_t *p, uint16_t v) {
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+
+static uint8_t *put32(uint8_t *p, uint32_t v) {
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+
+srzip_t *srzip_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("open failed");
+        return NULL;
+    }
+    struct stat st;
+    if (0 != fstat(fd, &st) || st.st_size < ZIP_END_SIZE) {
+        fprintf(stderr, "%s is not a zip archive\n", path);
+        close(fd);
+        return NULL;
+    }
+    const uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap failed");
+        return NULL;
+    }
+
+    /* The end record sits before a comment of up to 64 KiB. */
+    size_t size = st.st_size;
+    const uint8_t *end = NULL;
+    for (size_t pos = size - ZIP_END_SIZE; ; pos--) {
+        if (get32(map + pos) == ZIP_END_MAGIC) {
+            end = map + pos;
+            break;
+        }
+        if (pos == 0 || size - pos > ZIP_END_SIZE + 0xffff) {
+            break;
+        }
+    }
+    uint32_t central_size = end ? get32(end + 12) : 0;
+    uint32_t central_offset = end ? get32(end + 16) : 0;
+    if (end == NULL || (size_t) central_offset + central_size > size) {
+        fprintf(stderr, "%s is not a zip archive\n", path);
+        munmap((void *) map, size);
+        return NULL;
+    }
+
+    srzip_t *zip = malloc(sizeof(*zip));
+    if (zip == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    zip->map = map;
+    zip->size = size;
+    zip->central = map + central_offset;
+    zip->entries = get16(end + 10);
+    return zip;
+}
+
+
+void srzip_close(srzip_t *zip) {
+    if (zip == NULL) {
+        return;
+    }
+    munmap((void *) zip->map, zip->size);
+    free(zip);
+}
+
+
+static void *inflate_member(const uint8_t *data, size_t length, size_t size) {
+    uint8_t *out = malloc(size ? size : 1);
+    if (out == NULL) {
+        return NULL;
+    }
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (Z_OK != inflateInit2(&z, -MAX_WBITS)) {
+        free(out);
+        return NULL;
+    }
+    z.next_in = (Bytef *) data;
+    z.avail_in = length;
+    z.next_out = out;
+    z.avail_out = size;
+    int ret = inflate(&z, Z_FINISH);
+    inflateEnd(&z);
+    if (ret != Z_STREAM_END || z.total_out != size) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+
+void *srzip_read(srzip_t *zip, const char *name, size_t *size) {
+    size_t name_len = strlen(name);
+    const uint8_t *p = zip->central;
+    const uint8_t *limit = zip->map + zip->size;
+
+    for (size_t i = 0; i < zip->entries; i++) {
+        if (p + ZIP_CENTRAL_SIZE > limit || get32(p) != ZIP_CENTRAL_MAGIC) {
+            log_msg(LOG_ERROR, "Corrupt zip central directory");
+            return NULL;
+        }
+        uint16_t method = get16(p + 10);
+        uint32_t compressed = get32(p + 20);
+        uint32_t uncompressed = get32(p + 24);
+        uint16_t len = get16(p + 28);
+        uint16_t extra = get16(p + 30);
+        uint16_t comment = get16(p + 32);
+        uint32_t offset = get32(p + 42);
+        const uint8_t *entry_name = p + ZIP_CENTRAL_SIZE;
+        p += ZIP_CENTRAL_SIZE + len + extra + comment;
+        if (len != name_len || 0 != memcmp(entry_name, name, len)) {
+            continue;
+        }
+
+        const uint8_t *local = zip->map + offset;
+        if (local + ZIP_LOCAL_SIZE > limit || get32(local) != ZIP_LOCAL_MAGIC) {
+            log_msg(LOG_ERROR, "Corrupt zip member %s", name);
+            return NULL;
+        }
+        const uint8_t *data = local + ZIP_LOCAL_SIZE + get16(local + 26)
+            + get16(local + 28);
+        if (data + compressed > limit) {
+            log_msg(LOG_ERROR, "Truncated zip member %s", name);
+            return NULL;
+        }
+
+        void *out = NULL;
+        if (method == ZIP_STORED && compressed == uncompressed) {
+            out = malloc(uncompressed ? uncompressed : 1);
+            if (out != NULL) {
+                memcpy(out, data, uncompressed);
+            }
+        } else if (method == ZIP_DEFLATED) {
+            out = inflate_member(data, compressed, uncompressed);
+        } else {
+            log_msg(LOG_ERROR, "Unsupported zip method %u for %s", method,
+                    name);
+            return NULL;
+        }
+        if (out == NULL) {
+            log_msg(LOG_ERROR, "Can't decompress zip member %s", name);
+            return NULL;
+        }
+        *size = uncompressed;
+        return out;
+    }
+    return NULL;
+}
+
+
+srzip_writer_t *srzip_create(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("open failed");
+        return NULL;
+    }
+    srzip_writer_t *w = calloc(1, sizeof(*w));
+    if (w == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    w->fd = fd;
+    /* Every member is stamped with the creation time, in MS-DOS format. */
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    w->time = tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2;
+    w->date = (tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday;
+    return w;
+}
+
+
+static bool write_all(int fd, const void *data, size_t size) {
+    const uint8_t *p = data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write failed");
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+bool srzip_add(srzip_writer_t *w, const char *name, const void *data,
+        size_t length, size_t size, uint32_t crc, bool deflated) {
+    size_t name_len = strlen(name);
+    uint64_t directory = w->directory + ZIP_CENTRAL_SIZE + name_len;
+    /* The central directory and the end record have to fit as well. */
+    if (w->offset + ZIP_LOCAL_SIZE + name_len + length + directory
+            + ZIP_END_SIZE > UINT32_MAX
+            || size > UINT32_MAX || w->count == UINT16_MAX) {
+        log_msg(LOG_ERROR, "Zip archive full at member %s", name);
+        return false;
+    }
+    if (w->count == w->cap) {
+        size_t cap = w->cap ? 2 * w->cap : 64;
+        srzip_entry_t *entries = realloc(w->entries, cap * sizeof(*entries));
+        if (entries == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        w->entries = entries;
+        w->cap = cap;
+    }
+    srzip_entry_t *e = &w->entries[w->count];
+    e->name = strdup(name);
+    if (e->name == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    e->method = deflated ? ZIP_DEFLATED : ZIP_STORED;
+    e->crc = crc;
+    e->length = length;
+    e->size = size;
+    e->offset = w->offset;
+
+    uint8_t header[ZIP_LOCAL_SIZE];
+    uint8_t *p = put32(header, ZIP_LOCAL_MAGIC);
+    p = put16(p, 20);
+    p = put16(p, 0);
+    p = put16(p, e->method);
+    p = put16(p, w->time);
+    p = put16(p, w->date);
+    p = put32(p, e->crc);
+    p = put32(p, e->length);
+    p = put32(p, e->size);
+    p = put16(p, name_len);
+    put16(p, 0);
+    if (!write_all(w->fd, header, sizeof(header))
+            || !write_all(w->fd, name, name_len)
+            || !write_all(w->fd, data, length)) {
+        /* Drops what was written of the member, for srzip_finish. */
+        if (0 != ftruncate(w->fd, w->offset)
+                || w->offset != (uint64_t) lseek(w->fd, w->offset, SEEK_SET)) {
+            perror("can't truncate archive");
+        }
+        free(e->name);
+        return false;
+    }
+    w->offset += ZIP_LOCAL_SIZE + name_len + length;
+    w->directory = directory;
+    w->count++;
+    return true;
+}
+
+
+bool srzip_finish(srzip_writer_t *w) {
+    bool ok = true;
+    uint64_t central = w->offset;
+    uint8_t header[ZIP_CENTRAL_SIZE];
+
+    for (size_t i = 0; i < w->count; i++) {
+        srzip_entry_t *e = &w->entries[i];
+        size_t name_len = strlen(e->name);
+        uint8_t *p = put32(header, ZIP_CENTRAL_MAGIC);
+        p = put16(p, 20);
+        p = put16(p, 20);
+        p = put16(p, 0);
+        p = put16(p, e->method);
+        p = put16(p, w->time);
+        p = put16(p, w->date);
+        p = put32(p, e->crc);
+        p = put32(p, e->length);
+        p = put32(p, e->size);
+        p = put16(p, name_len);
+        p = put16(p, 0);
+        p = put16(p, 0);
+        p = put16(p, 0);
+        p = put16(p, 0);
+        p = put32(p, 0);
+        put32(p, e->offset);
+        ok = ok && write_all(w->fd, header, sizeof(header))
+            && write_all(w->fd, e->name, name_len);
+        w->offset += ZIP_CENTRAL_SIZE + name_len;
+        free(e->name);
+    }
+
+    uint8_t end[ZIP_END_SIZE];
+    uint8_t *p = put32(end, ZIP_END_MAGIC);
+    p = put16(p, 0);
+    p = put16(p, 0);
+    p = put16(p, w->count);
+    p = put16(p, w->count);
+    p = put32(p, w->offset - central);
+    p = put32(p, central);
+    put16(p, 0);
+    ok = ok && w->offset <= UINT32_MAX && write_all(w->fd, end, sizeof(end));
+    ok = 0 == close(w->fd) && ok;
+    free(w->entries);
+    free(w);
+    return ok;
+}
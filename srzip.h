@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Minimal reader and writer for the zip archives sigrok saves sessions in
+ * (.sr).
+ *
+ * Members may be stored or deflated; zip64 archives are not supported, which
+ * limits an archive to 4 GiB. An .sr file holds a "metadata" ini file and
+ * the samples of each logic device as members named "<capturefile>-1",
+ * "<capturefile>-2" and so on.
+ */
+typedef struct srzip srzip_t;
+
+srzip_t *srzip_open(const char *path);
+void srzip_close(srzip_t *zip);
+/* Returns the malloc'd contents of member `name` and sets `size`, or NULL if
+ * there is no such member or it can't be decompressed. */
+void *srzip_read(srzip_t *zip, const char *name, size_t *size);
+
+typedef struct srzip_writer srzip_writer_t;
+
+srzip_writer_t *srzip_create(const char *path);
+/* Appends member `name` of `size` bytes with CRC-32 `crc`: `data` holds them
+ * as they are or, if `deflated`, raw-deflated into `length` bytes. False if
+ * it can't be written or the archive, central directory included, would
+ * outgrow the zip limits; the archive can still be finished then. */
+bool srzip_add(srzip_writer_t *w, const char *name, const void *data,
+        size_t length, size_t size, uint32_t crc, bool deflated);
+/* Writes the central directory and closes the archive. */
+bool srzip_finish(srzip_writer_t *w);
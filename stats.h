@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Every counter has exactly one writing thread, so it is bumped with a
+ * relaxed load/store pair instead of a locked read-modify-write; other
+ * threads only ever read it. */
+typedef _Atomic uint64_t counter_t;
+
+static inline void counter_add(counter_t *c, uint64_t n) {
+    uint64_t v = atomic_load_explicit(c, memory_order_relaxed);
+    atomic_store_explicit(c, v + n, memory_order_relaxed);
+}
+
+static inline uint64_t counter_get(counter_t *c) {
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+/* Written by the capture threads: packets, dropped_packets and stalls by
+ * the backend's, samples and edges by the one calling on_capture_edges.
+ * With several devices, each counts its packets apart and the merge thread
+ * stores their sums here. */
+typedef struct capture_stats {
+    counter_t packets;
+    counter_t samples;
+    counter_t edges;
+    counter_t dropped_packets;
+    /* Times the backend waited for a free pipeline buffer. */
+    counter_t stalls;
+} capture_stats_t;
+
+/* Written by the clients thread. */
+typedef struct clients_stats {
+    counter_t accepted;
+    counter_t disconnects;
+    counter_t overflows;
+    counter_t dropped;
+    counter_t coalesced;
+    counter_t filtered;
+    counter_t bytes_sent;
+} clients_stats_t;
+
+extern capture_stats_t capture_stats;
+extern clients_stats_t clients_stats;
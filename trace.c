@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "trace.h"
+
+/* Runs kept for lookups: seconds of capture at any packet rate a device
+ * reaches. */
+#define TRACE_RUNS 65536
+
+static struct {
+    trace_run_t *runs;
+    _Atomic bool enabled;
+    /* Runs whose slot is being written, and runs complete. */
+    _Atomic uint64_t started;
+    _Atomic uint64_t done;
+    int64_t realtime_offset;
+    /* Clients thread only: the first run trace_record_fanout has not seen. */
+    uint64_t fanout_next;
+} trace;
+
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+
+void trace_enable() {
+    if (trace.runs != NULL) {
+        return;
+    }
+    trace.runs = calloc(TRACE_RUNS, sizeof(trace.runs[0]));
+    if (trace.runs == NULL) {
+        perror("Failed to allocate trace");
+        exit(1);
+    }
+    trace.realtime_offset = clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC);
+    atomic_store_explicit(&trace.enabled, true, memory_order_release);
+}
+
+
+void trace_cleanup() {
+    atomic_store(&trace.enabled, false);
+    free(trace.runs);
+    trace.runs = NULL;
+}
+
+
+bool trace_enabled() {
+    return atomic_load_explicit(&trace.enabled, memory_order_acquire);
+}
+
+
+uint64_t trace_now() {
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+
+uint64_t trace_realtime(uint64_t ns) {
+    return ns + trace.realtime_offset;
+}
+
+
+void trace_run(uint64_t idx, uint64_t end, uint64_t received_ns) {
+    uint64_t n = atomic_load_explicit(&trace.done, memory_order_relaxed);
+    atomic_store_explicit(&trace.started, n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    trace_run_t *run = &trace.runs[n % TRACE_RUNS];
+    run->idx = idx;
+    run->end = end;
+    run->received_ns = received_ns;
+    run->queued_ns = trace_now();
+    atomic_store_explicit(&trace.done, n + 1, memory_order_release);
+}
+
+
+/* Reads run `n`, false if its slot was reused meanwhile. */
+static bool read_run(uint64_t n, trace_run_t *run) {
+    *run = trace.runs[n % TRACE_RUNS];
+    atomic_thread_fence(memory_order_acquire);
+    return n + TRACE_RUNS
+        > atomic_load_explicit(&trace.started, memory_order_relaxed);
+}
+
+
+bool trace_lookup(uint64_t idx, trace_run_t *run) {
+    uint64_t done = atomic_load_explicit(&trace.done, memory_order_acquire);
+    uint64_t lo = done > TRACE_RUNS ? done - TRACE_RUNS : 0;
+    uint64_t hi = done;
+    trace_run_t found;
+    /* The first run ending after idx. */
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (!read_run(mid, &found)) {
+            lo = mid + 1;
+        } else if (found.end <= idx) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == done || !read_run(lo, &found) || found.idx > idx) {
+        return false;
+    }
+    *run = found;
+    return true;
+}
+
+
+void trace_record_fanout(trace_histogram_t *h) {
+    uint64_t done = atomic_load_explicit(&trace.done, memory_order_acquire);
+    uint64_t n = trace.fanout_next;
+    if (done - n > TRACE_RUNS) {
+        n = done - TRACE_RUNS;
+    }
+    for (; n < done; n++) {
+        trace_run_t run;
+        if (read_run(n, &run)) {
+            trace_record(h, run.queued_ns - run.received_ns);
+        }
+    }
+    trace.fanout_next = done;
+}
+
+
+static size_t bucket_of(uint64_t ns) {
+    if (ns < (1u << TRACE_SUB_BITS)) {
+        return ns;
+    }
+    unsigned int e = 63 - __builtin_clzll(ns);
+    return ((size_t) (e - TRACE_SUB_BITS + 1) << TRACE_SUB_BITS)
+        + ((ns >> (e - TRACE_SUB_BITS)) & ((1u << TRACE_SUB_BITS) - 1));
+}
+
+
+/* The highest latency counted in bucket `b`. */
+static uint64_t bucket_top(size_t b) {
+    if (b < (1u << TRACE_SUB_BITS)) {
+        return b;
+    }
+    unsigned int shift = (b >> TRACE_SUB_BITS) - 1;
+    uint64_t sub = b & ((1u << TRACE_SUB_BITS) - 1);
+    return (((1ull << TRACE_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+
+void trace_record(trace_histogram_t *h, uint64_t ns) {
+    h->buckets[bucket_of(ns)]++;
+    h->count++;
+    if (ns > h->max) {
+        h->max = ns;
+    }
+}
+
+
+uint64_t trace_percentile(const trace_histogram_t *h, double percent) {
+    uint64_t target = h->count * percent / 100;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < TRACE_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > target || seen == h->count) {
+            uint64_t top = bucket_top(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return 0;
+}
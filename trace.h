@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Opt-in latency tracing, from the arrival of a packet to the send of its
+ * edges.
+ *
+ * The capture layer stamps every packet with CLOCK_MONOTONIC as it arrives.
+ * The stamp stays with the packet's samples through edge detection, and
+ * when the edges reach the fanout, the run of samples they came from is
+ * filed with its stamp and the time its edges are queued to the clients.
+ * The runs go in a ring ordered by sample, so the clients thread finds the
+ * run of an edge it sends from the edge's index: the edge rings stay 16
+ * bytes an edge, tracing or not.
+ *
+ * Latencies are counted in HDR-style histograms: exact below
+ * 2^TRACE_SUB_BITS nanoseconds, and above that TRACE_SUB_BITS bits of
+ * precision in every power of two, so a percentile is within 1/16 of the
+ * latency it reports.
+ *
+ * The capture thread is the only writer of the ring. It announces the run
+ * it starts writing before reusing its slot, and publishes it once
+ * written; a reader that finds a later run started in the slot it read
+ * discards what it read. Histograms belong to the clients thread.
+ */
+
+#define TRACE_SUB_BITS 4
+#define TRACE_BUCKETS ((64 - TRACE_SUB_BITS + 1) << TRACE_SUB_BITS)
+
+typedef struct trace_run {
+    /* The first sample of the run, and the one after its last. */
+    uint64_t idx;
+    uint64_t end;
+    uint64_t received_ns;
+    uint64_t queued_ns;
+} trace_run_t;
+
+typedef struct trace_histogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[TRACE_BUCKETS];
+} trace_histogram_t;
+
+/* Clients thread: starts tracing, if it was not on yet. */
+void trace_enable();
+void trace_cleanup();
+bool trace_enabled();
+uint64_t trace_now();
+/* CLOCK_REALTIME of a trace_now time. */
+uint64_t trace_realtime(uint64_t ns);
+/* Capture thread: files the run of samples from `idx` to `end`, received
+ * at `received_ns`, as its edges are about to be queued. */
+void trace_run(uint64_t idx, uint64_t end, uint64_t received_ns);
+/* Clients thread: finds the run holding sample `idx`. False if it is not
+ * in the ring, or was never stamped. */
+bool trace_lookup(uint64_t idx, trace_run_t *run);
+
+void trace_record(trace_histogram_t *h, uint64_t ns);
+/* Clients thread: records in `h` how long each run filed since the last
+ * call took from its packet to the fanout, once per run however many
+ * clients get its edges. Runs already overwritten in the ring are lost. */
+void trace_record_fanout(trace_histogram_t *h);
+/* The latency below which `percent` of the recorded ones are. */
+uint64_t trace_percentile(const trace_histogram_t *h, double percent);
@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "trigger.h"
+#include "log.h"
+
+#define TRIGGER_HISTORY_SIZE 256
+
+/* Clients thread only. */
+static uint64_t next_generation = 1;
+
+
+trigger_config_t *trigger_config_new(const proto_trigger_msg_t *msg) {
+    if (msg->stages == 0 || msg->stages > PROTO_TRIGGER_STAGES) {
+        log_msg(LOG_WARN, "Can't match %u trigger stages", msg->stages);
+        return NULL;
+    }
+
+    trigger_config_t *config = malloc(sizeof(*config));
+    if (config == NULL) {
+        perror("Failed to allocate trigger");
+        exit(1);
+    }
+    memset(config, 0, sizeof(*config));
+    for (size_t k = 0; k < msg->stages; k++) {
+        const proto_trigger_stage_t *in = &msg->stage[k];
+        trigger_stage_t *st = &config->stage[k];
+        if (in->rising & in->falling) {
+            log_msg(LOG_WARN, "Trigger stage %zu rises and falls on %lx", k,
+                    in->rising & in->falling);
+            free(config);
+            return NULL;
+        }
+        uint64_t edges = in->rising | in->falling;
+        st->prev_mask = edges;
+        st->prev_match = in->falling;
+        st->mask = in->mask | edges;
+        st->match = (in->value & in->mask & ~edges) | in->rising;
+        config->channels |= st->mask;
+    }
+    config->generation = next_generation++;
+    config->stages = msg->stages;
+    config->within = msg->within;
+    config->pre = msg->pre;
+    config->post = msg->post;
+    return config;
+}
+
+
+void trigger_reset(trigger_t *t, const trigger_config_t *config) {
+    t->generation = config->generation;
+    t->started = false;
+    t->level = 0;
+    for (size_t k = 0; k < PROTO_TRIGGER_STAGES; k++) {
+        t->reached[k] = UINT64_MAX;
+    }
+    t->open = false;
+    t->head = t->len = 0;
+}
+
+
+void trigger_free(trigger_t *t) {
+    free(t->history);
+    t->history = NULL;
+    t->head = t->len = t->cap = 0;
+}
+
+
+void trigger_start(trigger_t *t, uint64_t value) {
+    t->started = true;
+    t->level = value;
+}
+
+
+static bool stage_matches(const trigger_stage_t *st, uint64_t prev,
+        uint64_t value) {
+    return ((prev ^ st->prev_match) & st->prev_mask) == 0
+        && ((value ^ st->match) & st->mask) == 0;
+}
+
+
+/* True if the edge completes a match. Stages are updated from the last one
+ * down, so that one edge moves a partial match by one stage at most. */
+static bool match_edge(trigger_t *t, const trigger_config_t *config,
+        const capture_edge_t *edge) {
+    uint64_t prev = t->level;
+    t->level = edge->value;
+    for (size_t k = config->stages; k-- > 0; ) {
+        if (!stage_matches(&config->stage[k], prev, edge->value)) {
+            continue;
+        }
+        uint64_t start = k == 0 ? edge->idx : t->reached[k - 1];
+        if (start == UINT64_MAX
+                || (config->within && edge->idx - start > config->within)) {
+            continue;
+        }
+        if (k == config->stages - 1) {
+            for (size_t j = 0; j < config->stages; j++) {
+                t->reached[j] = UINT64_MAX;
+            }
+            return true;
+        }
+        t->reached[k] = start;
+    }
+    return false;
+}
+
+
+static void keep_edge(trigger_t *t, const capture_edge_t *edge) {
+    if (t->len - t->head == TRIGGER_HISTORY_MAX) {
+        t->head++;
+    }
+    if (t->len == t->cap) {
+        if (t->head > t->cap / 2) {
+            memmove(t->history, t->history + t->head,
+                    (t->len - t->head) * sizeof(t->history[0]));
+            t->len -= t->head;
+            t->head = 0;
+        } else {
+            size_t cap = t->cap ? 2 * t->cap : TRIGGER_HISTORY_SIZE;
+            capture_edge_t *history = realloc(t->history,
+                    cap * sizeof(history[0]));
+            if (history == NULL) {
+                perror("Failed to grow trigger history");
+                exit(1);
+            }
+            t->history = history;
+            t->cap = cap;
+        }
+    }
+    t->history[t->len++] = *edge;
+}
+
+
+size_t trigger_push(trigger_t *t, const trigger_config_t *config,
+        const capture_edge_t *edge, const capture_edge_t **out) {
+    if (!t->started) {
+        return 0;
+    }
+    if (t->head == t->len) {
+        t->head = t->len = 0;
+    }
+    if (t->open && edge->idx > t->until) {
+        t->open = false;
+    }
+
+    uint64_t from = edge->idx >= config->pre ? edge->idx - config->pre : 0;
+    while (t->head < t->len && t->history[t->head].idx < from) {
+        t->head++;
+    }
+
+    if (match_edge(t, config, edge)) {
+        t->matches++;
+        t->open = true;
+        t->until = edge->idx + config->post;
+    } else if (!t->open) {
+        /* Not passed on, at least not yet. */
+        if (config->pre != 0) {
+            keep_edge(t, edge);
+        }
+        return 0;
+    }
+
+    keep_edge(t, edge);
+    *out = t->history + t->head;
+    size_t n = t->len - t->head;
+    t->head = t->len;
+    return n;
+}
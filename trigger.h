@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "capture.h"
+#include "protocol.h"
+
+/* Per-client trigger, run over the client's edges.
+ *
+ * A trigger is a sequence of up to PROTO_TRIGGER_STAGES conditions on an
+ * edge: levels of some channels, and rises or falls of others. Edges
+ * matching the stages in order, with any edges in between and the last one
+ * at most `within` samples after the first, complete a match. Each stage is
+ * compiled into two masked comparisons, one on the value before the edge
+ * and one on the value after it, and the matcher keeps, for every stage,
+ * the latest start of a partial match that got that far.
+ *
+ * Only the edges completing a match are passed on, along with the edges
+ * `pre` samples before and `post` samples after them. Edges waiting for a
+ * match are kept back for the pre-trigger window, at most
+ * TRIGGER_HISTORY_MAX of them.
+ *
+ * Conditions can only see the channels of the client's mask. A
+ * trigger_config is immutable once published to the capture thread; the
+ * trigger_t state belongs to the capture thread.
+ */
+
+#define TRIGGER_HISTORY_MAX 65536
+
+typedef struct trigger_stage {
+    uint64_t prev_mask;
+    uint64_t prev_match;
+    uint64_t mask;
+    uint64_t match;
+} trigger_stage_t;
+
+typedef struct trigger_config {
+    uint64_t generation;
+    /* Bits of all the channels the stages look at. */
+    uint64_t channels;
+    size_t stages;
+    trigger_stage_t stage[PROTO_TRIGGER_STAGES];
+    uint64_t within;
+    uint64_t pre;
+    uint64_t post;
+} trigger_config_t;
+
+typedef struct trigger {
+    /* Of the config the state was built for, 0 for none. */
+    uint64_t generation;
+    bool started;
+    uint64_t level;
+    /* First sample of the latest partial match through each stage, or
+     * UINT64_MAX. */
+    uint64_t reached[PROTO_TRIGGER_STAGES];
+    /* Edges up to this sample are passed on, if `open`. */
+    bool open;
+    uint64_t until;
+    /* Edges kept back for the pre-trigger window, from history[head] to
+     * history[len]. */
+    capture_edge_t *history;
+    size_t head;
+    size_t len;
+    size_t cap;
+    uint64_t matches;
+} trigger_t;
+
+/* Returns NULL, after logging why, if the settings make no sense. */
+trigger_config_t *trigger_config_new(const proto_trigger_msg_t *msg);
+
+void trigger_reset(trigger_t *t, const trigger_config_t *config);
+void trigger_free(trigger_t *t);
+void trigger_start(trigger_t *t, uint64_t value);
+/* Runs the matcher over an edge, and points `out` at the edges to pass on
+ * because of it, returning how many. They stay valid until the next call. */
+size_t trigger_push(trigger_t *t, const trigger_config_t *config,
+        const capture_edge_t *edge, const capture_edge_t **out);
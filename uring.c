@@ -0,0 +1,408 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "uring.h"
+#include "log.h"
+
+#ifndef CLIENTS_NO_URING
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+static struct {
+    int fd;
+    unsigned int entries;
+    /* Submission ring: the kernel consumes from sq_head, sends are queued
+     * at `tail`, `queued` of them since the last io_uring_enter. */
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_flags;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int tail;
+    unsigned int queued;
+    struct io_uring_sqe *sqes;
+    /* Completion ring: the kernel produces at cq_tail. */
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    /* Client buffers, and the indices of the free ones; registered while
+     * `fixed`. */
+    uint8_t *buffers;
+    size_t buffer_count;
+    size_t buffer_size;
+    size_t *free_buffers;
+    size_t free_count;
+    bool fixed;
+} uring = { .fd = -1 };
+
+
+static int uring_enter(unsigned int to_submit, unsigned int min_complete,
+        unsigned int flags) {
+    return syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete,
+            flags, NULL, 0);
+}
+
+
+static bool map_rings(const struct io_uring_params *p) {
+    uring.sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+    uring.cq_ring_size = p->cq_off.cqes
+        + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring.cq_ring_size > uring.sq_ring_size) {
+            uring.sq_ring_size = uring.cq_ring_size;
+        }
+        uring.cq_ring_size = uring.sq_ring_size;
+    }
+
+    uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    if (uring.sq_ring == MAP_FAILED) {
+        uring.sq_ring = NULL;
+        return false;
+    }
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        uring.cq_ring = uring.sq_ring;
+    } else {
+        uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+        if (uring.cq_ring == MAP_FAILED) {
+            uring.cq_ring = NULL;
+            return false;
+        }
+    }
+    uring.sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        uring.sqes = NULL;
+        return false;
+    }
+
+    uint8_t *sq = uring.sq_ring;
+    uring.sq_head = (unsigned int *) (sq + p->sq_off.head);
+    uring.sq_tail = (unsigned int *) (sq + p->sq_off.tail);
+    uring.sq_flags = (unsigned int *) (sq + p->sq_off.flags);
+    uring.sq_array = (unsigned int *) (sq + p->sq_off.array);
+    uring.sq_mask = *(unsigned int *) (sq + p->sq_off.ring_mask);
+    uring.tail = *uring.sq_tail;
+    uint8_t *cq = uring.cq_ring;
+    uring.cq_head = (unsigned int *) (cq + p->cq_off.head);
+    uring.cq_tail = (unsigned int *) (cq + p->cq_off.tail);
+    uring.cq_mask = *(unsigned int *) (cq + p->cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *) (cq + p->cq_off.cqes);
+    uring.entries = p->sq_entries;
+    return true;
+}
+
+
+/* Without the buffers registered, clients allocate their own. */
+static void register_buffers(size_t count, size_t size) {
+    if (count == 0) {
+        return;
+    }
+    uint8_t *buffers = mmap(NULL, count * size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+        log_msg(LOG_WARN, "Can't allocate send buffers: %s", strerror(errno));
+        return;
+    }
+    struct iovec iov = { .iov_base = buffers, .iov_len = count * size };
+    if (0 != syscall(__NR_io_uring_register, uring.fd,
+                IORING_REGISTER_BUFFERS, &iov, 1)) {
+        log_msg(LOG_INFO, "Can't register send buffers: %s", strerror(errno));
+        munmap(buffers, count * size);
+        return;
+    }
+
+    uring.free_buffers = malloc(count * sizeof(uring.free_buffers[0]));
+    if (uring.free_buffers == NULL) {
+        perror("Failed to allocate send buffers");
+        exit(1);
+    }
+    for (size_t i = 0; i < count; i++) {
+        uring.free_buffers[i] = count - 1 - i;
+    }
+    uring.free_count = count;
+    uring.buffers = buffers;
+    uring.buffer_count = count;
+    uring.buffer_size = size;
+    uring.fixed = true;
+}
+
+
+static bool queue_send(int sock, const uint8_t *buf, size_t length,
+        bool fixed, void *data) {
+    if (uring.tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE)
+            == uring.entries) {
+        uring_submit();
+        if (uring.tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE)
+                == uring.entries) {
+            return false;
+        }
+    }
+
+    unsigned int slot = uring.tail & uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sock;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = length;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t) data;
+    if (fixed) {
+        sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+        sqe->buf_index = 0;
+    }
+    uring.sq_array[slot] = slot;
+    uring.tail++;
+    uring.queued++;
+    __atomic_store_n(uring.sq_tail, uring.tail, __ATOMIC_RELEASE);
+    return true;
+}
+
+
+static int probe_res;
+
+
+static void probe_complete(void *data, int res) {
+    (void) data;
+    probe_res = res;
+}
+
+
+/* Sends a byte over a socket pair and waits for it: older kernels lack
+ * IORING_OP_SEND, or sends from registered buffers. */
+static bool probe_send(bool fixed) {
+    static const uint8_t byte = 0;
+    int pair[2];
+    if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) {
+        return false;
+    }
+    probe_res = -EIO;
+    if (queue_send(pair[0], fixed ? uring.buffers : &byte, 1, fixed, NULL)
+            && uring_enter(uring.queued, 1, IORING_ENTER_GETEVENTS) >= 0) {
+        uring.queued = 0;
+        uring_reap(probe_complete);
+    }
+    close(pair[0]);
+    close(pair[1]);
+    return probe_res == 1;
+}
+
+
+bool uring_init(unsigned int entries, size_t buffers, size_t buffer_size) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP;
+    uring.fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (uring.fd == -1) {
+        log_msg(LOG_INFO, "io_uring is unavailable: %s", strerror(errno));
+        return false;
+    }
+    /* Without IORING_FEAT_NODROP, completions could be lost with more
+     * clients than the completion ring holds. */
+    if (!(p.features & IORING_FEAT_NODROP) || !map_rings(&p)) {
+        log_msg(LOG_INFO, "io_uring is too old to send to clients");
+        uring_cleanup();
+        return false;
+    }
+
+    register_buffers(buffers, buffer_size);
+    /* Some kernels only take registered buffers for zero-copy sends, which
+     * hold the buffer until the peer acknowledges it: the buffers are still
+     * handed out, but unpinned. */
+    if (uring.fixed && !probe_send(true)) {
+        log_msg(LOG_INFO, "io_uring can't send from registered buffers");
+        syscall(__NR_io_uring_register, uring.fd, IORING_UNREGISTER_BUFFERS,
+                NULL, 0);
+        uring.fixed = false;
+    }
+    if (!probe_send(false)) {
+        log_msg(LOG_INFO, "io_uring can't send to sockets");
+        uring_cleanup();
+        return false;
+    }
+    return true;
+}
+
+
+void uring_cleanup() {
+    if (uring.sqes != NULL) {
+        munmap(uring.sqes, uring.sqes_size);
+    }
+    if (uring.cq_ring != NULL && uring.cq_ring != uring.sq_ring) {
+        munmap(uring.cq_ring, uring.cq_ring_size);
+    }
+    if (uring.sq_ring != NULL) {
+        munmap(uring.sq_ring, uring.sq_ring_size);
+    }
+    if (uring.fd != -1) {
+        close(uring.fd);
+    }
+    if (uring.buffers != NULL) {
+        munmap(uring.buffers, uring.buffer_count * uring.buffer_size);
+    }
+    free(uring.free_buffers);
+    memset(&uring, 0, sizeof(uring));
+    uring.fd = -1;
+}
+
+
+bool uring_enabled() {
+    return uring.sqes != NULL;
+}
+
+
+int uring_fd() {
+    return uring.fd;
+}
+
+
+uint8_t *uring_buffer_alloc() {
+    if (uring.free_count == 0) {
+        return NULL;
+    }
+    return uring.buffers
+        + uring.free_buffers[--uring.free_count] * uring.buffer_size;
+}
+
+
+static bool registered(const uint8_t *buf) {
+    uintptr_t p = (uintptr_t) buf;
+    uintptr_t start = (uintptr_t) uring.buffers;
+    return uring.buffers != NULL && p >= start
+        && p < start + uring.buffer_count * uring.buffer_size;
+}
+
+
+bool uring_buffer_free(uint8_t *buf) {
+    if (!registered(buf)) {
+        return false;
+    }
+    uring.free_buffers[uring.free_count++] =
+        (buf - uring.buffers) / uring.buffer_size;
+    return true;
+}
+
+
+bool uring_send(int sock, const uint8_t *buf, size_t length, void *data) {
+    return queue_send(sock, buf, length, uring.fixed && registered(buf), data);
+}
+
+
+void uring_submit() {
+    while (uring.queued > 0) {
+        int res = uring_enter(uring.queued, 0, 0);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* EAGAIN and EBUSY pass once completions are reaped. */
+            if (errno != EAGAIN && errno != EBUSY) {
+                log_msg(LOG_ERROR, "io_uring_enter failed: %s",
+                        strerror(errno));
+            }
+            return;
+        }
+        if (res == 0) {
+            return;
+        }
+        uring.queued -= res;
+    }
+}
+
+
+void uring_reap(void (*complete)(void *data, int res)) {
+    bool flushed = false;
+    while (true) {
+        unsigned int head = *uring.cq_head;
+        unsigned int tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            /* Completions that did not fit wait in the kernel until asked
+             * for. */
+            if (flushed || !(__atomic_load_n(uring.sq_flags, __ATOMIC_RELAXED)
+                        & IORING_SQ_CQ_OVERFLOW)) {
+                return;
+            }
+            uring_enter(0, 0, IORING_ENTER_GETEVENTS);
+            flushed = true;
+            continue;
+        }
+        while (head != tail) {
+            struct io_uring_cqe cqe = uring.cqes[head & uring.cq_mask];
+            head++;
+            __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+            complete((void *) (uintptr_t) cqe.user_data, cqe.res);
+        }
+    }
+}
+
+#else
+
+bool uring_init(unsigned int entries, size_t buffers, size_t buffer_size) {
+    (void) entries;
+    (void) buffers;
+    (void) buffer_size;
+    log_msg(LOG_INFO, "Built without io_uring");
+    return false;
+}
+
+
+void uring_cleanup() {
+}
+
+
+bool uring_enabled() {
+    return false;
+}
+
+
+int uring_fd() {
+    return -1;
+}
+
+
+uint8_t *uring_buffer_alloc() {
+    return NULL;
+}
+
+
+bool uring_buffer_free(uint8_t *buf) {
+    (void) buf;
+    return false;
+}
+
+
+bool uring_send(int sock, const uint8_t *buf, size_t length, void *data) {
+    (void) sock;
+    (void) buf;
+    (void) length;
+    (void) data;
+    return false;
+}
+
+
+void uring_submit() {
+}
+
+
+void uring_reap(void (*complete)(void *data, int res)) {
+    (void) complete;
+}
+
+#endif
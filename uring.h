@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* io_uring send engine of the clients thread.
+ *
+ * Sends are queued as submission entries, without a system call, and
+ * uring_submit hands every send queued since the last one to the kernel in
+ * one io_uring_enter, however many clients they are for. The kernel waits
+ * for each socket to take its data, and posts a completion; the ring's fd
+ * turns readable when there are some to reap.
+ *
+ * Output buffers from uring_buffer_alloc lie in one region registered with
+ * the ring, so that the kernel does not have to map their pages on every
+ * send, if it can send from registered buffers at all. A buffer must not
+ * change while a send from it is in flight.
+ *
+ * Everything here belongs to the clients thread. Without io_uring, or with
+ * CLIENTS_NO_URING, uring_init fails and the clients thread keeps sending
+ * with send() on EPOLLOUT.
+ */
+
+/* Sets up a ring of `entries` sends and `buffers` registered buffers of
+ * `buffer_size` bytes. */
+bool uring_init(unsigned int entries, size_t buffers, size_t buffer_size);
+void uring_cleanup();
+bool uring_enabled();
+/* Readable when completions are waiting, -1 without a ring. */
+int uring_fd();
+/* A registered buffer, or NULL if they are all taken. */
+uint8_t *uring_buffer_alloc();
+/* False if `buf` is not a registered buffer. */
+bool uring_buffer_free(uint8_t *buf);
+/* Queues a send of `length` bytes from `buf`; its completion passes `data`
+ * back. False if the ring is full even after submitting. */
+bool uring_send(int sock, const uint8_t *buf, size_t length, void *data);
+void uring_submit();
+/* Calls `complete` for every finished send, with the bytes sent or -errno.
+ * It may queue more sends. */
+void uring_reap(void (*complete)(void *data, int res));